@@ -2,8 +2,57 @@
 #include "ast.h"
 #include "ast_details.h"
 
+#include <new>
+
+///////////////////////////////
+// nil, true and false live for the whole process. nil goes first, the
+// other nodes take it as their meta
+namespace
+{
+  const ast_node_nil s_nil;
+}
+ast_node::ptr ast_node::nil_node = ast_node_ptr::make_static (&s_nil);
+
+namespace
+{
+  const ast_node_bool<true> s_true;
+  const ast_node_bool<false> s_false;
+}
+ast_node::ptr ast_node::true_node = ast_node_ptr::make_static (&s_true);
+ast_node::ptr ast_node::false_node = ast_node_ptr::make_static (&s_false);
+ast_node::ptr ast_node::invalid_node = make_sp<ast_node_invalid> ();
+ast_node::ptr ast_node_raised::s_node = make_sp<ast_node_raised> ();
+ast_node::ptr ast_node_raised::s_value;
+
+///////////////////////////////
+/// ast_node class
+///////////////////////////////
+void
+ast_node::destroy (const ast_node* node)
+{
+  delete node;
+}
+
+///////////////////////////////
+/// ast_node_ptr class
+///////////////////////////////
+const ast_node*
+ast_node_ptr::ref::materialize_int (void* storage, int64_t value)
+{
+  static_assert (sizeof (ast_node_int) <= STORAGE_SIZE, "immediate int does not fit the ref storage");
+  return new (storage) ast_node_int (value);
+}
+
+///////////////////////////////
+void
+ast_node_ptr::ref::release_int (void* storage)
+{
+  static_cast<ast_node_int*> (storage)->~ast_node_int ();
+}
+
 ///////////////////////////////
-ast_node::ptr ast_node::nil_node = std::make_shared<ast_node_nil> ();
-ast_node::ptr ast_node::true_node = std::make_shared<ast_node_bool<true>> ();
-ast_node::ptr ast_node::false_node = std::make_shared<ast_node_bool<false>> ();
-ast_node::ptr ast_node::invalid_node = std::make_shared<ast_node_invalid> ();
+ast_node_ptr
+ast_node_ptr::make_heap_int (int64_t value)
+{
+  return make_sp<ast_node_int> (value);
+}
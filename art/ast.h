@@ -1,18 +1,20 @@
 #pragma once
 
 #include "pointer.h"
-#include "arena.h"
 #include "exceptions.h"
 #include "MAL.h"
 
 #include <string>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
 
 #include <assert.h>
 
 ///////////////////////////////
-enum class node_type_enum
+enum class node_type_enum : uint8_t
 {
   UNKNOWN = 0,
   ATOM,
@@ -27,25 +29,227 @@ enum class node_type_enum
   HASHMAP,
   CALLABLE_BUILTIN,
   CALLABLE_LAMBDA,
+  CALLABLE_VM_CLOSURE,
   MACRO_CALL,
+  TRANSIENT,
   HT_LIST, // for internal use only
+  CODE, // for internal use only
+  VM_CALL, // for internal use only
+  RAISED, // for internal use only
   INVALID,
   NODE_TYPE_COUNT
 };
 
+///////////////////////////////
+void intrusive_add_ref (const ast_node* node);
+void intrusive_release (const ast_node* node);
+
+///////////////////////////////
+// handle to an ast node, one word. Heap nodes are reference counted
+// through their header (see ast_node). Besides them it carries
+// immediates: integers are tagged into the pointer bits, so making or
+// copying one allocates nothing and touches no counter.
+class ast_node_ptr
+{
+public:
+  // the node an immediate integer stands for exists only while it is
+  // dereferenced, inside this object. Do not keep pointers to it beyond
+  // the full expression.
+  class ref
+  {
+  public:
+    ref (const ref& other)
+      : ref (other.m_bits, other.m_node == other.storage () ? nullptr : other.m_node)
+    {}
+
+    ~ref ()
+    {
+      if (m_node == storage ())
+        release_int (storage ());
+    }
+
+    const ast_node* operator -> () const
+    {
+      return m_node;
+    }
+
+    operator const ast_node& () const
+    {
+      return *m_node;
+    }
+
+  private:
+    friend class ast_node_ptr;
+
+    ref (uintptr_t bits, const ast_node* node)
+      : m_bits (bits)
+      , m_node (node ? node : materialize_int (storage (), ast_node_ptr::int_from_bits (bits)))
+    {}
+
+    ref& operator = (const ref&) = delete;
+
+    void* storage () const
+    {
+      return const_cast<void*> (static_cast<const void*> (&m_storage));
+    }
+
+    static const ast_node* materialize_int (void* storage, int64_t value);
+    static void release_int (void* storage);
+
+    static constexpr size_t STORAGE_SIZE = 4 * sizeof (void*);
+
+    uintptr_t m_bits;
+    const ast_node* m_node;
+    typename std::aligned_storage<STORAGE_SIZE, alignof (void*)>::type m_storage;
+  };
+
+  static constexpr int64_t MIN_IMMEDIATE_INT = -(int64_t (1) << 62);
+  static constexpr int64_t MAX_IMMEDIATE_INT = (int64_t (1) << 62) - 1;
+
+  ast_node_ptr () = default;
+  ast_node_ptr (std::nullptr_t)
+  {}
+
+  template <typename T, typename = typename std::enable_if<std::is_convertible<T*, const ast_node*>::value>::type>
+  ast_node_ptr (sp<T> node)
+    : m_node (node.detach ())
+  {}
+
+  ast_node_ptr (const ast_node_ptr& other)
+    : m_node (other.m_node)
+  {
+    if (other.is_counted ())
+      intrusive_add_ref (m_node);
+  }
+
+  ast_node_ptr (ast_node_ptr&& other) noexcept
+    : m_node (other.m_node)
+  {
+    other.m_node = nullptr;
+  }
+
+  ~ast_node_ptr ()
+  {
+    if (is_counted ())
+      intrusive_release (m_node);
+  }
+
+  ast_node_ptr& operator = (ast_node_ptr other) noexcept
+  {
+    std::swap (m_node, other.m_node);
+    return *this;
+  }
+
+  // an immediate integer, or a heap node when the value does not fit
+  static ast_node_ptr make_int (int64_t value)
+  {
+    if (value < MIN_IMMEDIATE_INT || value > MAX_IMMEDIATE_INT)
+      return make_heap_int (value);
+
+    return ast_node_ptr (reinterpret_cast<const ast_node*> ((static_cast<uintptr_t> (value) << 1) | INT_TAG));
+  }
+
+  // a node with static lifetime. It keeps one reference forever, so
+  // the count never drops to zero
+  static ast_node_ptr make_static (const ast_node* node)
+  {
+    intrusive_add_ref (node);
+    intrusive_add_ref (node);
+    return ast_node_ptr (node);
+  }
+
+  bool is_int () const
+  {
+    return (bits () & INT_TAG) != 0;
+  }
+
+  int64_t int_value () const
+  {
+    assert (is_int ());
+    return int_from_bits (bits ());
+  }
+
+  ref operator -> () const
+  {
+    return ref (bits (), is_int () ? nullptr : m_node);
+  }
+
+  ref operator * () const
+  {
+    return ref (bits (), is_int () ? nullptr : m_node);
+  }
+
+  // raw pointer to a heap or static node, never an immediate integer
+  const ast_node* get () const
+  {
+    assert (!is_int ());
+    return m_node;
+  }
+
+  explicit operator bool () const
+  {
+    return m_node != nullptr;
+  }
+
+  friend bool operator == (const ast_node_ptr& lhs, const ast_node_ptr& rhs)
+  {
+    return lhs.m_node == rhs.m_node;
+  }
+
+  friend bool operator != (const ast_node_ptr& lhs, const ast_node_ptr& rhs)
+  {
+    return !(lhs == rhs);
+  }
+
+private:
+  static constexpr uintptr_t INT_TAG = 1;
+
+  // takes the bits as they are, no reference is added
+  explicit ast_node_ptr (const ast_node* bits)
+    : m_node (bits)
+  {}
+
+  bool is_counted () const
+  {
+    return m_node && !is_int ();
+  }
+
+  static ast_node_ptr make_heap_int (int64_t value);
+
+  static int64_t int_from_bits (uintptr_t bits)
+  {
+    return static_cast<int64_t> (bits) >> 1;
+  }
+
+  uintptr_t bits () const
+  {
+    return reinterpret_cast<uintptr_t> (m_node);
+  }
+
+  const ast_node* m_node = nullptr;
+};
+
 ///////////////////////////////
 class ast_node
 {
 public:
-  using ptr = std::shared_ptr <const ast_node>;
+  using ptr = ast_node_ptr;
 
   static ptr nil_node;
   static ptr true_node;
   static ptr false_node;
   static ptr invalid_node;
 
+  // header flags
+  enum : uint8_t
+  {
+    FLAG_CONSTANT = 1 << 0,  // a literal which evaluates to itself, see is_constant_literal
+  };
+
   //
-  ast_node () = default;
+  explicit ast_node (node_type_enum type)
+    : m_type (type)
+  {}
   virtual ~ast_node () = default;
 
   virtual std::string to_string () const
@@ -54,7 +258,28 @@ public:
   }
 
   virtual std::string to_string (bool print_readable) const = 0;
-  virtual node_type_enum type () const = 0;
+
+  node_type_enum type () const
+  {
+    return m_type;
+  }
+
+  bool has_flag (uint8_t flag) const
+  {
+    return (m_flags & flag) != 0;
+  }
+
+  // the one reference is the caller's
+  bool unique () const
+  {
+    return m_refcount == 1;
+  }
+
+  // by the reader, for a vector or hash-map of constant literals
+  void mark_constant ()
+  {
+    m_flags |= FLAG_CONSTANT;
+  }
 
   virtual bool operator == (const ast_node&) const = 0;
   virtual uint32_t hash () const = 0;
@@ -89,14 +314,14 @@ public:
   T* as_or_throw ()
   {
     if (!T::IS_VALID_TYPE (type ()))
-      raise<TException> (this->to_string ());
+      raise_not_valid<TException> ();
     return static_cast<T*> (this);
   }
   template <typename T, typename TException>
   const T* as_or_throw () const
   {
     if (!T::IS_VALID_TYPE (type ()))
-      raise<TException> (this->to_string ());
+      raise_not_valid<TException> ();
     return static_cast<const T*> (this);
   }
 
@@ -116,16 +341,57 @@ public:
   }
 
 protected:
-  using mutable_ptr = std::shared_ptr <ast_node>;
+  using mutable_ptr = sp <ast_node>;
   virtual mutable_ptr clone () const = 0;
 
 private:
   ast_node (const ast_node&) = delete;
   ast_node& operator = (const ast_node&) = delete;
 
+  friend void intrusive_add_ref (const ast_node* node);
+  friend void intrusive_release (const ast_node* node);
+
+  // out of line, the release inlined everywhere stays a decrement
+  static void destroy (const ast_node* node);
+
+  // the message is the node printed, only if the error is reported. An
+  // integer may be an immediate materialized for the call - printed now
+  template <typename TException>
+  void raise_not_valid () const;
+
+  // 8 byte header: type tag, flags and a non-atomic reference count -
+  // nodes are owned by one thread
+  const node_type_enum m_type;
+  uint8_t m_flags = 0;
+  mutable uint32_t m_refcount = 0;
+
   ast_node::ptr m_meta = nil_node;
 };
 
+///////////////////////////////
+inline void intrusive_add_ref (const ast_node* node)
+{
+  ++node->m_refcount;
+}
+
+///////////////////////////////
+inline void intrusive_release (const ast_node* node)
+{
+  if (--node->m_refcount == 0)
+    ast_node::destroy (node);
+}
+
+///////////////////////////////
+template <typename TException>
+void ast_node::raise_not_valid () const
+{
+  if (m_type == node_type_enum::INT)
+    raise<TException> (to_string ());
+
+  ast_node::ptr node (sp<const ast_node> (this));
+  raise_deferred<TException> ([node] () { return node->to_string (); });
+}
+
 ///////////////////////////////
 inline bool equals (const ast_node& left, const ast_node& right)
 {
@@ -138,6 +404,18 @@ inline bool operator != (const ast_node& lhs, const ast_node& rhs)
   return ! (lhs == rhs);
 }
 
+///////////////////////////////
+inline bool operator == (const ast_node_ptr::ref& lhs, const ast_node_ptr::ref& rhs)
+{
+  return equals (lhs, rhs);
+}
+
+///////////////////////////////
+inline bool operator != (const ast_node_ptr::ref& lhs, const ast_node_ptr::ref& rhs)
+{
+  return !equals (lhs, rhs);
+}
+
 ///////////////////////////////
 class ast
 {
@@ -147,7 +425,7 @@ public:
     : m_node (node)
   {}
 
-  ast_node::ptr operator -> () const
+  const ast_node::ptr& operator -> () const
   {
     return m_node;
   }
@@ -1,6 +1,197 @@
 #include "ast_details.h"
 #include "environment.h"
 
+#include <algorithm>
+#include <unordered_map>
+
+///////////////////////////////
+/// ast_node_container_base class
+///////////////////////////////
+// a long chain of lists consed onto each other is released one by one,
+// not by recursion
+ast_node_container_base::~ast_node_container_base ()
+{
+  sp<const ast_node_container_base> next = std::move (m_next);
+  while (next && next->unique () && next->m_next)
+    next = std::move (const_cast<ast_node_container_base*> (next.get ())->m_next);
+}
+
+///////////////////////////////
+void
+ast_node_container_base::erase (size_t index)
+{
+  assert (index < size ());
+  if (m_shared_begin)
+    unshare ();
+
+  size_t in_trie = trie_size ();
+
+  // the last leaf becomes the tail again
+  if (m_children.empty () && index < in_trie && index >= in_trie - trie::WIDTH)
+  {
+    m_trie = trie::pop_leaf (m_trie, [&] (const ast_node::ptr& v) { m_children.push_back (v); });
+    in_trie = trie_size ();
+  }
+
+  if (index >= in_trie)
+  {
+    m_children.erase (m_children.begin () + (index - in_trie));
+    return;
+  }
+
+  // further inside the trie - the vector is built again (the reader
+  // erases the last elements only)
+  std::vector<ast_node::ptr> rest;
+  rest.reserve (size () - 1);
+  size_t i = 0;
+  for_each ([&] (const ast_node::ptr& v)
+  {
+    if (i++ != index)
+      rest.push_back (v);
+  });
+
+  m_trie = nullptr;
+  m_children.clear ();
+  for (auto && v : rest)
+    add_child (v);
+}
+
+///////////////////////////////
+void
+ast_node_container_base::unshare ()
+{
+  assert (m_children.empty () && !m_trie);
+
+  small_vector<ast_node::ptr, INLINE_CHILDREN> elements;
+  elements.reserve (m_shared_size);
+  for_each ([&] (const ast_node::ptr& v) { elements.push_back (v); });
+
+  m_shared_begin = nullptr;
+  m_shared_size = 0;
+  m_shared_owner = nullptr;
+  m_storage = nullptr;
+  m_next = nullptr;
+  m_flat = nullptr;
+
+  m_children.reserve (elements.size ());
+  for (auto && v : elements)
+    m_children.push_back (std::move (v));
+}
+
+///////////////////////////////
+void
+ast_node_container_base::share_all (const ast_node_container_base& other)
+{
+  if (other.m_shared_begin)
+  {
+    share (other);
+    return;
+  }
+
+  // the elements of a long vector are not contiguous
+  if (other.m_trie)
+  {
+    reserve (other.size ());
+    other.for_each ([&] (const ast_node::ptr& v) { add_child (v); });
+    return;
+  }
+
+  if (other.m_children.empty ())
+    return;
+
+  m_shared_begin = other.m_children.data ();
+  m_shared_size = other.m_children.size ();
+  m_shared_owner = sp<const ast_node> (&other);
+}
+
+///////////////////////////////
+const ast_node::ptr*
+ast_node_container_base::flatten () const
+{
+  if (!m_flat)
+  {
+    auto block = storage::make (m_shared_size);
+    ast_node::ptr* slots = block->take_before (block->end (), m_shared_size);
+    size_t i = 0;
+    for_each ([&] (const ast_node::ptr& v) { slots[i++] = v; });
+    m_flat = std::move (block);
+  }
+
+  return m_flat->end () - m_shared_size;
+}
+
+///////////////////////////////
+sp<ast_node_list>
+ast_node_container_base::rest () const
+{
+  auto retVal = mal::make_list ();
+  const size_t count = size ();
+  if (count <= 1)
+    return retVal;
+
+  // the elements of a long vector are not contiguous
+  if (m_trie)
+  {
+    retVal->reserve (count - 1);
+    size_t i = 0;
+    for_each ([&] (const ast_node::ptr& v)
+    {
+      if (i++ != 0)
+        retVal->add_child (v);
+    });
+    return retVal;
+  }
+
+  // the rest of a one element range is the list it was consed onto
+  if (m_next && shared_range () == 1)
+  {
+    retVal->share_all (*m_next);
+    return retVal;
+  }
+
+  retVal->share_all (*this);
+  ++retVal->m_shared_begin;
+  --retVal->m_shared_size;
+  return retVal;
+}
+
+///////////////////////////////
+sp<ast_node_list>
+ast_node_container_base::cons (ast_node::ptr first) const
+{
+  auto retVal = mal::make_list ();
+  if (m_storage)
+  {
+    if (auto slot = m_storage->take_before (m_shared_begin, 1))
+    {
+      *slot = std::move (first);
+      retVal->share (*this);
+      retVal->m_shared_begin = slot;
+      ++retVal->m_shared_size;
+      return retVal;
+    }
+  }
+
+  // a new block, the elements of this list follow its range. A list
+  // growing by cons gets one twice the size of the block it filled, any
+  // other - consed onto before, read, built by list - a small one
+  static constexpr size_t MIN_BLOCK_SIZE = 8;
+  size_t capacity = MIN_BLOCK_SIZE;
+  if (m_storage && m_storage->grow_from (m_shared_begin))
+    capacity = 2 * m_storage->capacity ();
+
+  auto block = storage::make (capacity);
+  ast_node::ptr* slot = block->take_before (block->end (), 1);
+  *slot = std::move (first);
+
+  retVal->m_shared_begin = slot;
+  retVal->m_shared_size = size () + 1;
+  retVal->m_storage = std::move (block);
+  if (!empty ())
+    retVal->m_next = sp<const ast_node_container_base> (this);
+  return retVal;
+}
+
 ///////////////////////////////
 /// ast_node_list class
 ///////////////////////////////
@@ -8,9 +199,9 @@ std::string
 ast_node_list::to_string (bool print_readable) const // override
 {
   std::string retVal = "(";
-  for (size_t i = 0, e = m_children.size (); i < e; ++i)
+  for (size_t i = 0, e = size (); i < e; ++i)
   {
-    auto &&p = m_children [i];
+    auto &&p = (*this) [i];
     if (i != 0)
       retVal += " ";
     retVal += p->to_string (print_readable);
@@ -27,13 +218,14 @@ std::string
 ast_node_vector::to_string (bool print_readable) const // override
 {
   std::string retVal = "[";
-  for (size_t i = 0, e = m_children.size (); i < e; ++i)
+  bool first = true;
+  for_each ([&] (const ast_node::ptr& p)
   {
-    auto &&p = m_children [i];
-    if (i != 0)
+    if (!first)
       retVal += " ";
+    first = false;
     retVal += p->to_string (print_readable);
-  }
+  });
   retVal += "]";
 
   return retVal;
@@ -42,8 +234,8 @@ ast_node_vector::to_string (bool print_readable) const // override
 ///////////////////////////////
 /// ast_node_symbol class
 ///////////////////////////////
-ast_node_symbol::ast_node_symbol (std::string a_symbol)
-  : m_symbol (std::move (a_symbol))
+ast_node_symbol::ast_node_symbol (const std::string& a_symbol)
+  : ast_node_symbol (symbol_table::intern (a_symbol))
 {}
 
 ///////////////////////////////
@@ -51,7 +243,146 @@ std::string
 ast_node_symbol::to_string (bool print_readable) const // override
 {
   // FIXME
-  return m_symbol;
+  return m_symbol->name ();
+}
+
+///////////////////////////////
+/// ast_node_keyword class
+///////////////////////////////
+namespace
+{
+
+// the interned keyword nodes by name. Never destroyed, the nodes may
+// outlive the statics
+std::unordered_map<std::string, const ast_node_keyword*>&
+keyword_table ()
+{
+  static auto table = new std::unordered_map<std::string, const ast_node_keyword*> ();
+  return *table;
+}
+
+} // end of anonymous namespace
+
+///////////////////////////////
+ast_node_keyword::~ast_node_keyword ()
+{
+  if (m_interned)
+    keyword_table ().erase (m_keyword);
+}
+
+///////////////////////////////
+sp<ast_node_keyword>
+ast_node_keyword::intern (std::string val)
+{
+  auto& table = keyword_table ();
+  auto it = table.find (val);
+  if (it != table.end ())
+    return sp<ast_node_keyword> (const_cast<ast_node_keyword*> (it->second));
+
+  auto retVal = make_sp<ast_node_keyword> (val);
+  retVal->m_interned = true;
+  table.emplace (std::move (val), retVal.get ());
+  return retVal;
+}
+
+///////////////////////////////
+/// ast_node_macro_call class
+///////////////////////////////
+uint64_t ast_node_macro_call::epoch = 0;
+size_t ast_node_macro_call::cache_hits = 0;
+size_t ast_node_macro_call::cache_misses = 0;
+
+///////////////////////////////
+/// map_shape class
+///////////////////////////////
+namespace
+{
+
+// a shape and a key taken from it, the very node
+struct shape_transition
+{
+  const map_shape* shape;
+  ast_node::ptr key;
+
+  bool operator == (const shape_transition& rp) const
+  {
+    return shape == rp.shape && key == rp.key;
+  }
+};
+
+struct shape_transition_hash
+{
+  size_t operator () (const shape_transition& t) const
+  {
+    const size_t key = t.key.is_int () ? std::hash<int64_t> () (t.key.int_value ()) : std::hash<const void*> () (t.key.get ());
+    return std::hash<const void*> () (t.shape) * 31 + key;
+  }
+};
+
+// the shapes made by with_key. Never destroyed, like keyword_table
+std::unordered_map<shape_transition, const map_shape*, shape_transition_hash>&
+shape_table ()
+{
+  static auto table = new std::unordered_map<shape_transition, const map_shape*, shape_transition_hash> ();
+  return *table;
+}
+
+} // end of anonymous namespace
+
+///////////////////////////////
+constexpr size_t map_shape::MAX_KEYS;
+constexpr size_t map_shape::NO_SLOT;
+
+///////////////////////////////
+map_shape::map_shape (const_ptr parent, const ast_node::ptr& key)
+  : m_size (parent ? parent->m_size + 1 : 1)
+  , m_plain_keys ((!parent || parent->m_plain_keys) && is_plain (key))
+  , m_parent (std::move (parent))
+{
+  assert (m_size <= MAX_KEYS);
+  for (size_t i = 0; i + 1 < m_size; ++i)
+    m_keys[i] = m_parent->m_keys[i];
+  m_keys[m_size - 1] = key;
+}
+
+///////////////////////////////
+map_shape::~map_shape ()
+{
+  shape_table ().erase (shape_transition {m_parent.get (), m_keys[m_size - 1]});
+}
+
+///////////////////////////////
+map_shape::const_ptr
+map_shape::with_key (const const_ptr& shape, const ast_node::ptr& key)
+{
+  auto& table = shape_table ();
+  auto it = table.find (shape_transition {shape.get (), key});
+  if (it != table.end ())
+    return const_ptr (it->second);
+
+  const_ptr retVal (new map_shape (shape, key));
+  table.emplace (shape_transition {shape.get (), key}, retVal.get ());
+  return retVal;
+}
+
+///////////////////////////////
+/// ast_node_transient class
+///////////////////////////////
+ast_node::mutable_ptr
+ast_node_transient::copy_of (const ast_node::ptr& collection)
+{
+  switch (collection->type ())
+  {
+  case node_type_enum::VECTOR:
+    // the trie is shared until the first full tail moves into it
+    return collection->as<ast_node_vector> ()->copy ();
+  case node_type_enum::HASHMAP:
+    // the trie is shared until the first insert copies the path
+    return collection->as<ast_node_hashmap> ()->clone ();
+  default:
+    break;
+  }
+  return nullptr;
 }
 
 ///////////////////////////////
@@ -78,25 +409,261 @@ ast_node_nil::to_string (bool print_readable) const
 	return "nil";
 }
 
+///////////////////////////////
+/// argument_stack class
+///////////////////////////////
+argument_stack&
+argument_stack::instance ()
+{
+  static argument_stack retVal;
+  return retVal;
+}
+
+///////////////////////////////
+ast_node::ptr*
+argument_stack::push (size_t count)
+{
+  if (m_chunks.empty ())
+    m_chunks.push_back ({std::unique_ptr<ast_node::ptr[]> (new ast_node::ptr [CHUNK_SIZE]), CHUNK_SIZE, 0});
+
+  chunk* c = &m_chunks[m_current];
+  if (c->used + count > c->size)
+  {
+    // the rest of this chunk stays unused until the next one is empty
+    // again. A chunk above the current one is empty, one too small is
+    // replaced
+    ++m_current;
+    const size_t size = count > CHUNK_SIZE ? count : CHUNK_SIZE;
+    if (m_current == m_chunks.size ())
+      m_chunks.push_back ({std::unique_ptr<ast_node::ptr[]> (new ast_node::ptr [size]), size, 0});
+    else if (m_chunks[m_current].size < count)
+      m_chunks[m_current] = {std::unique_ptr<ast_node::ptr[]> (new ast_node::ptr [size]), size, 0};
+
+    c = &m_chunks[m_current];
+  }
+
+  ast_node::ptr* retVal = c->slots.get () + c->used;
+  c->used += count;
+  return retVal;
+}
+
+///////////////////////////////
+void
+argument_stack::pop (size_t count)
+{
+  if (count == 0)
+    return;
+
+  chunk& c = m_chunks[m_current];
+  assert (c.used >= count);
+  for (size_t i = c.used - count; i < c.used; ++i)
+    c.slots[i] = nullptr;
+
+  c.used -= count;
+  if (c.used == 0 && m_current > 0)
+    --m_current;
+}
+
 ///////////////////////////////
 /// ast_node_callable_lambda class
 ///////////////////////////////
 ast_node_callable_lambda::ast_node_callable_lambda (ast_node::ptr binds, ast_node::ptr ast, environment::const_ptr outer_env)
-  : m_binds (binds)
+  : ast_node_callable_lambda (binds, ast, outer_env, nullptr, ast)
+{}
+
+///////////////////////////////
+ast_node_callable_lambda::ast_node_callable_lambda (ast_node::ptr binds, ast_node::ptr ast, environment::const_ptr outer_env, frame_layout::const_ptr layout, ast_node::ptr body)
+  : ast_node_callable (node_type_enum::CALLABLE_LAMBDA)
+  , m_binds (binds)
   , m_ast (ast)
   , m_outer_env (outer_env)
+  , m_layout (layout)
+  , m_body (body)
 {
   const auto bind_type = m_binds->type ();
   if (bind_type != node_type_enum::LIST && bind_type != node_type_enum::VECTOR)
     raise<mal_exception_eval_not_list> (m_binds->to_string ());
 
-  m_binds_as_container = static_cast<const ast_node_container_base*> (m_binds.get ());
+  // the params are checked here, once - not by every call
+  if (!m_layout)
+    m_layout = make_layout (*static_cast<const ast_node_container_base*> (m_binds.get ()));
+}
+
+///////////////////////////////
+frame_layout::const_ptr
+ast_node_callable_lambda::make_layout (const ast_node_container_base& binds, frame_layout::const_ptr outer)
+{
+  const size_t variadic = check_params (binds);
+
+  auto retVal = make_sp<frame_layout> (std::move (outer));
+  for (size_t i = 0, e = binds.size (); i < e; ++i)
+  {
+    if (i != variadic)
+      retVal->append (binds[i]->as<ast_node_symbol> ()->id ());
+  }
+
+  retVal->set_params (variadic, variadic != binds.size ());
+  return retVal;
+}
+
+///////////////////////////////
+size_t
+ast_node_callable_lambda::check_params (const ast_node_container_base& binds)
+{
+  size_t retVal = binds.size ();
+  for (size_t i = 0, e = binds.size (); i < e; ++i)
+  {
+    auto symbol = binds[i]->as_or_zero<ast_node_symbol> ();
+    if (!symbol)
+      raise<mal_exception_eval_not_symbol> ("fn* param is not a symbol: " + binds[i]->to_string ());
+
+    if (symbol->id () == SYMBOL_VARIADIC)
+    {
+      // '&' and the name of the rest
+      if (retVal != e || i + 2 != e)
+        raise<mal_exception_eval_invalid_arg> ("fn* '&' is not followed by one param: " + binds.to_string ());
+      retVal = i;
+      continue;
+    }
+
+    for (size_t j = 0; j < i; ++j)
+    {
+      if (binds[j]->as<ast_node_symbol> ()->id () == symbol->id ())
+        raise<mal_exception_eval_invalid_arg> ("fn* param is there twice: " + binds[i]->to_string ());
+    }
+  }
+
+  return retVal;
+}
+
+///////////////////////////////
+std::string
+ast_node_callable_lambda::arity_error (size_t fixed_arity, bool variadic, size_t argc)
+{
+  if (argc == fixed_arity || (variadic && argc > fixed_arity))
+    return {};
+
+  return ("expects " + std::string (variadic ? "at least " : "") + std::to_string (fixed_arity) + " arguments, got " + std::to_string (argc));
+}
+
+///////////////////////////////
+ast_node_callable_lambda::ast_node_callable_lambda (lambda_arities::const_ptr arities, environment::const_ptr outer_env)
+  : ast_node_callable (node_type_enum::CALLABLE_LAMBDA)
+  , m_outer_env (outer_env)
+  , m_arities (arities)
+{}
+
+///////////////////////////////
+bool
+ast_node_callable_lambda::is_multi_arity (const ast_node_list& fn_form)
+{
+  if (fn_form.size () < 2)
+    return false;
+
+  auto clause = fn_form[1]->as_or_zero<ast_node_list> ();
+  return clause && !clause->empty () && (*clause)[0]->as_or_zero<ast_node_container_base> ();
+}
+
+///////////////////////////////
+std::string
+ast_node_callable_lambda::to_string (bool print_readable) const
+{
+  if (!m_arities)
+    return "#callable-lambda" + m_binds->to_string ()+ " -> " + m_ast->to_string ();
+
+  std::string retVal = "#callable-lambda";
+  for (auto&& a : m_arities->arities ())
+    retVal += "(" + a.binds->to_string () + " -> " + a.ast->to_string () + ")";
+  return retVal;
 }
 
 ///////////////////////////////
 tco
 ast_node_callable_lambda::call_tco (const call_arguments& args) const
 {
-  auto env = environment::make (*m_binds_as_container, args, m_outer_env);
-  return tco{m_ast, env, nullptr};
+  if (!m_arities)
+  {
+    auto env = environment::make (m_layout, args, m_outer_env);
+    return tco{m_body, env, nullptr};
+  }
+
+  auto arity = m_arities->select (args.size ());
+  if (!arity)
+    raise<mal_exception_eval_invalid_arg> ("no arity takes " + std::to_string (args.size ()) + " arguments");
+
+  auto env = environment::make (arity->layout, args, m_outer_env);
+  return tco{arity->body, env, nullptr};
+}
+
+///////////////////////////////
+bool
+ast_node_callable_lambda::operator == (const ast_node& rp) const
+{
+  if (type () != rp.type ())
+    return false;
+
+  auto rp_lambda = rp.as<ast_node_callable_lambda> ();
+  if (!m_arities || !rp_lambda->m_arities)
+    return !m_arities && !rp_lambda->m_arities && equals (*m_binds, *rp_lambda->m_binds) && equals (*m_ast, *rp_lambda->m_ast);
+
+  auto&& arities = m_arities->arities ();
+  auto&& rp_arities = rp_lambda->m_arities->arities ();
+  if (arities.size () != rp_arities.size ())
+    return false;
+
+  for (size_t i = 0, e = arities.size (); i < e; ++i)
+  {
+    if (!equals (*arities[i].binds, *rp_arities[i].binds) || !equals (*arities[i].ast, *rp_arities[i].ast))
+      return false;
+  }
+  return true;
+}
+
+///////////////////////////////
+uint32_t
+ast_node_callable_lambda::hash () const
+{
+  if (!m_arities)
+    return (m_binds->hash () * 1622000167 + 582512737) * m_ast->hash () + 2152752083;
+
+  uint32_t retVal = 2152752083;
+  for (auto&& a : m_arities->arities ())
+    retVal = (retVal + a.binds->hash () * 1622000167 + 582512737) * a.ast->hash () + 2152752083;
+  return retVal;
+}
+
+///////////////////////////////
+/// lambda_arities class
+///////////////////////////////
+void
+lambda_arities::add (ast_node::ptr binds, ast_node::ptr ast, frame_layout::const_ptr layout, ast_node::ptr body)
+{
+  m_dispatch.add (layout->fixed_arity (), layout->is_variadic ());
+  m_arities.push_back ({binds, ast, layout, body});
+}
+
+///////////////////////////////
+/// arity_dispatch class
+///////////////////////////////
+void
+arity_dispatch::add (size_t fixed_arity, bool variadic)
+{
+  const int index = m_count++;
+  if (variadic)
+  {
+    if (m_variadic >= 0)
+      raise<mal_exception_eval_invalid_arg> ("more than one variadic arity");
+
+    m_variadic = index;
+    m_variadic_fixed_arity = fixed_arity;
+    return;
+  }
+
+  if (fixed_arity >= m_by_argc.size ())
+    m_by_argc.resize (fixed_arity + 1, -1);
+
+  if (m_by_argc[fixed_arity] >= 0)
+    raise<mal_exception_eval_invalid_arg> ("arity " + std::to_string (fixed_arity) + " defined twice");
+
+  m_by_argc[fixed_arity] = index;
 }
@@ -4,9 +4,13 @@
 #include "ast.h"
 #include "environment.h"
 #include "exceptions.h"
+#include "hash_trie.h"
+#include "list_storage.h"
+#include "small_vector.h"
+#include "symbol_table.h"
+#include "vector_trie.h"
 
 #include <vector>
-#include <deque>
 #include <functional>
 #include <string>
 
@@ -15,10 +19,9 @@ template <node_type_enum NODE_TYPE>
 class ast_node_base : public ast_node
 {
 public:
-  node_type_enum type () const override
-  {
-    return NODE_TYPE;
-  }
+  ast_node_base ()
+    : ast_node (NODE_TYPE)
+  {}
 
   static constexpr bool IS_VALID_TYPE (node_type_enum t)
   {
@@ -50,11 +53,70 @@ public:
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_invalid> ();
+    return make_sp<ast_node_invalid> ();
   }
 };
 
 
+///////////////////////////////
+// a thrown value on its way to a try*. stepA returns the raised node in
+// place of a value and keeps the thrown one aside, so throw/catch* does
+// not unwind the C++ stack. Code which cannot pass the raised node on
+// rethrows the value as the C++ exception it used to be (value_or_throw).
+class ast_node_raised final : public ast_node_base<node_type_enum::RAISED>
+{
+public:
+  std::string to_string (bool print_readable) const override
+  {
+    return "#raised";
+  }
+
+  bool operator == (const ast_node& rp) const override
+  {
+    return this == std::addressof (rp);
+  }
+
+  uint32_t hash () const override
+  {
+    const uint32_t retVal = reinterpret_cast<uint64_t> (this) * 2052828881 + 541325663;
+    return retVal;
+  }
+
+  // keeps the value until take, returns the raised node
+  static const ast_node::ptr& raise (ast_node::ptr value)
+  {
+    s_value = std::move (value);
+    return s_node;
+  }
+
+  static bool is (const ast_node::ptr& node)
+  {
+    return node == s_node;
+  }
+
+  static ast_node::ptr take ()
+  {
+    return std::move (s_value);
+  }
+
+  static const ast_node::ptr& value_or_throw (const ast_node::ptr& node)
+  {
+    if (node == s_node)
+      throw take ();
+    return node;
+  }
+
+protected:
+  mutable_ptr clone () const override
+  {
+    return mutable_ptr (const_cast<ast_node_raised*> (this));
+  }
+
+private:
+  static ast_node::ptr s_node;
+  static ast_node::ptr s_value;
+};
+
 ///////////////////////////////
 class ast_node_atom : public ast_node_base<node_type_enum::ATOM>
 {
@@ -90,23 +152,98 @@ public:
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_atom> (m_value);
+    return make_sp<ast_node_atom> (m_value);
   }
 
 private:
   mutable ast_node::ptr m_value;
 };
 
+///////////////////////////////
+// a vector or hash-map conj!, assoc! and dissoc! change in place. It
+// owns a copy of the collection it was made from that nothing else sees,
+// until persistent! hands the copy over - the transient can not be used
+// after that
+class ast_node_transient : public ast_node_base<node_type_enum::TRANSIENT>
+{
+public:
+  explicit ast_node_transient (ast_node::mutable_ptr collection)
+    : m_collection (std::move (collection))
+  {}
+
+  // a copy of a vector or hash-map for a transient to own, sharing the
+  // tries. nullptr for any other collection
+  static ast_node::mutable_ptr copy_of (const ast_node::ptr& collection);
+
+  std::string to_string (bool print_readable) const override
+  {
+    return m_collection ? "(transient " + m_collection->to_string (print_readable) + ")" : "(transient)";
+  }
+
+  bool operator == (const ast_node& rp) const override
+  {
+    return this == std::addressof (rp);
+  }
+
+  // the collection to change, raises once persistent! took it. Actually
+  // it's non-const method
+  ast_node* edit () const
+  {
+    if (!m_collection)
+      raise<mal_exception_eval_not_transient> ("transient used after persistent!");
+    return m_collection.get ();
+  }
+
+  ast_node::ptr persist () const
+  {
+    edit ();
+    ast_node::ptr retVal = std::move (m_collection);
+    m_collection = nullptr;
+    return retVal;
+  }
+
+  uint32_t hash () const override
+  {
+    const uint32_t retVal = reinterpret_cast<uint64_t> (this) * 1893737443 + 811742947;
+    return retVal;
+  }
+
+protected:
+  mutable_ptr clone () const override
+  {
+    return make_sp<ast_node_transient> (m_collection ? copy_of (m_collection) : nullptr);
+  }
+
+private:
+  mutable ast_node::mutable_ptr m_collection;
+};
+
 ///////////////////////////////
 class ast_node_symbol : public ast_node_base <node_type_enum::SYMBOL>
 {
 public:
-  ast_node_symbol (std::string a_symbol);
+  ast_node_symbol (const std::string& a_symbol);
+  explicit ast_node_symbol (const interned_symbol& a_symbol)
+    : m_symbol (&a_symbol)
+  {
+    symbol_table::add_ref (m_symbol->id ());
+  }
+
+  ~ast_node_symbol () override
+  {
+    symbol_table::release (m_symbol->id ());
+  }
+
   std::string to_string (bool print_readable) const override;
 
   const std::string& symbol () const
   {
-    return m_symbol;
+    return m_symbol->name ();
+  }
+
+  symbol_id id () const
+  {
+    return m_symbol->id ();
   }
 
   bool operator == (const ast_node& rp) const override
@@ -119,17 +256,17 @@ public:
 
   uint32_t hash () const override
   {
-    return std::hash<std::string> () (m_symbol);
+    return m_symbol->hash ();
   }
 
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_symbol> (m_symbol);
+    return make_sp<ast_node_symbol> (*m_symbol);
   }
 
 private:
-  std::string m_symbol;
+  const interned_symbol* m_symbol;
 };
 
 ///////////////////////////////
@@ -173,7 +310,7 @@ public:
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_string> (m_value);
+    return make_sp<ast_node_string> (m_value);
   }
 
 private:
@@ -198,6 +335,16 @@ public:
   ast_node_keyword (std::string val)
     : m_keyword (std::move (val))
   {}
+  ~ast_node_keyword () override;
+
+  // the one node of the keyword while any is alive, so equal keywords
+  // are mostly the same node - a hash-map looks them up by pointer
+  static sp<ast_node_keyword> intern (std::string val);
+
+  bool is_interned () const
+  {
+    return m_interned;
+  }
 
   std::string to_string (bool print_readable) const override
   {
@@ -212,10 +359,15 @@ public:
 
   bool operator == (const ast_node& rp) const override
   {
+    if (this == std::addressof (rp))
+      return true;
     if (!IS_VALID_TYPE (rp.type ()))
       return false;
 
-    return m_keyword == rp.as<ast_node_keyword> ()->m_keyword;
+    auto rp_keyword = rp.as<ast_node_keyword> ();
+    if (m_interned && rp_keyword->m_interned)
+      return false;
+    return m_keyword == rp_keyword->m_keyword;
   }
 
   uint32_t hash () const override
@@ -226,12 +378,14 @@ public:
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_keyword> (m_keyword);
+    return make_sp<ast_node_keyword> (m_keyword);
   }
 
 private:
   //
   std::string m_keyword;
+  // a clone (with-meta) is not
+  bool m_interned = false;
 };
 
 ///////////////////////////////
@@ -262,7 +416,7 @@ public:
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_int> (m_value);
+    return make_sp<ast_node_int> (m_value);
   }
 
 private:
@@ -304,7 +458,7 @@ public:
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_bool<VALUE> > ();
+    return make_sp<ast_node_bool<VALUE> > ();
   }
 
 };
@@ -332,7 +486,7 @@ public:
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_nil> ();
+    return make_sp<ast_node_nil> ();
   }
 };
 
@@ -340,9 +494,24 @@ protected:
 class ast_node_container_base : public ast_node
 {
 public:
+  using trie = vector_trie<ast_node::ptr>;
+  using storage = list_storage<ast_node::ptr>;
+
+  // most forms and argument lists are short, keep them without an
+  // extra allocation
+  static constexpr size_t INLINE_CHILDREN = 3;
+
+  explicit ast_node_container_base (node_type_enum type)
+    : ast_node (type)
+  {}
+
+  ~ast_node_container_base ();
+
   size_t size () const
   {
-    return m_children.size ();
+    if (m_shared_begin)
+      return m_shared_size;
+    return trie_size () + m_children.size ();
   }
 
   bool empty () const
@@ -352,27 +521,89 @@ public:
 
   void add_child (ast_node::ptr child)
   {
+    if (m_shared_begin)
+      unshare ();
     m_children.push_back (child);
+    if (type () == node_type_enum::VECTOR && m_children.size () == trie::WIDTH)
+      flush_tail ();
   }
 
-  void replace (size_t index, ast_node::ptr child)
+  void reserve (size_t capacity)
   {
-    assert (index < size ());
-    m_children[index] = child;
+    if (type () == node_type_enum::VECTOR && capacity > trie::WIDTH)
+      capacity = trie::WIDTH;
+    m_children.reserve (capacity);
   }
 
-  void erase (size_t index)
+  void replace (size_t index, ast_node::ptr child)
   {
     assert (index < size ());
-    m_children.erase (m_children.begin () + index);
+    if (m_shared_begin)
+      unshare ();
+    const size_t in_trie = trie_size ();
+    if (index < in_trie)
+      m_trie = m_trie->set (index, child);
+    else
+      m_children[index - in_trie] = child;
   }
 
+  void erase (size_t index);
+
   ast_node::ptr operator [] (size_t index) const
   {
     assert (index < size ());
+    if (m_shared_begin)
+    {
+      if (!m_next || index < shared_range ())
+        return m_shared_begin[index];
+      return flatten ()[index];
+    }
+    if (m_trie)
+    {
+      const size_t in_trie = m_trie->size ();
+      if (index < in_trie)
+        return (*m_trie)[index];
+      index -= in_trie;
+    }
     return m_children[index];
   }
 
+  // contiguous only while the elements are in the tail - always for a
+  // list, for a vector of less than trie::WIDTH
+  const ast_node::ptr* data () const
+  {
+    assert (!m_trie);
+    if (!m_shared_begin)
+      return m_children.data ();
+    return m_next ? flatten () : m_shared_begin;
+  }
+
+  // fn (const ast_node::ptr&) for every element, in order
+  template <typename Fn>
+  void for_each (const Fn& fn) const
+  {
+    const ast_node_container_base* c = this;
+    for (; c->m_next; c = c->m_next.get ())
+    {
+      for (size_t i = 0, e = c->shared_range (); i < e; ++i)
+        fn (c->m_shared_begin[i]);
+    }
+
+    for (size_t i = 0; i < c->m_shared_size; ++i)
+      fn (c->m_shared_begin[i]);
+    if (c->m_trie)
+      c->m_trie->for_each (fn);
+    for (auto && p : c->m_children)
+      fn (p);
+  }
+
+  // the list without the first element, sharing the elements with this
+  // one. An empty list for an empty one
+  sp<ast_node_list> rest () const;
+  // the list of first followed by the elements of this one, sharing them
+  // (see list_storage). Constant time
+  sp<ast_node_list> cons (ast_node::ptr first) const;
+
   template <typename Fn>
   ast_node::ptr map (const Fn& fn) const
   {
@@ -392,10 +623,10 @@ public:
   uint32_t hash () const override
   {
     uint32_t retVal = 1722983309;
-    for (auto && p : m_children)
+    for_each ([&] (const ast_node::ptr& p)
     {
       retVal = (retVal + p->hash ()) * 824928359 + 1722983309;
-    }
+    });
     return retVal;
   }
 
@@ -412,23 +643,92 @@ public:
     bool retVal = true;
     for (size_t i = 0, e = size (); i < e && retVal; ++i)
     {
-      retVal = retVal && equals (*(m_children[i]), *(rp_container->m_children[i]));
+      retVal = retVal && equals (*((*this)[i]), *((*rp_container)[i]));
     }
 
     return retVal;
   }
 
 protected:
-  std::deque<ast_node::ptr> m_children;
+  // the elements of a list; of a vector those after the trie
+  small_vector<ast_node::ptr, INLINE_CHILDREN> m_children;
+  // the full leaves of a vector, shared with the vectors it was copied
+  // from and to. nullptr for a list
+  trie::const_ptr m_trie;
+
+  // a list rest or cons made, of m_shared_size elements: those from
+  // m_shared_begin - the end of a list or vector tail m_shared_owner
+  // holds, or a range in m_storage - followed by the elements of m_next,
+  // if any. m_children is empty then, m_shared_begin nullptr otherwise
+  const ast_node::ptr* m_shared_begin = nullptr;
+  size_t m_shared_size = 0;
+  ast_node::ptr m_shared_owner;
+  storage::const_ptr m_storage;
+  sp<const ast_node_container_base> m_next;
+  // all the elements in a row, once data or indexing past the range
+  // needed them
+  mutable storage::const_ptr m_flat;
+
+  void share (const ast_node_container_base& other)
+  {
+    m_shared_begin = other.m_shared_begin;
+    m_shared_size = other.m_shared_size;
+    m_shared_owner = other.m_shared_owner;
+    m_storage = other.m_storage;
+    m_next = other.m_next;
+  }
+
+  // the number of elements from m_shared_begin
+  size_t shared_range () const
+  {
+    return m_next ? m_shared_size - m_next->size () : m_shared_size;
+  }
+
+  // shares all the elements of a list, a vector copies its elements
+  void share_all (const ast_node_container_base& other);
+
+  const ast_node::ptr* flatten () const;
+
+  // the shared elements are copied to m_children, before a change
+  void unshare ();
+
+  size_t trie_size () const
+  {
+    return m_trie ? m_trie->size () : 0;
+  }
+
+  // a full tail moves to the trie
+  void flush_tail ()
+  {
+    m_trie = trie::push_leaf (m_trie, m_children.data ());
+    m_children.clear ();
+  }
 
 private:
   template <typename Fn>
   void map_impl (const Fn& fn)
   {
-    for (auto && v : m_children)
+    if (m_shared_begin)
+      unshare ();
+
+    if (!m_trie)
     {
-      v = fn (v);
+      for (auto && v : m_children)
+      {
+        v = fn (v);
+      }
+      return;
     }
+
+    // built again, the leaves are shared with the source
+    std::vector<ast_node::ptr> source;
+    source.reserve (size ());
+    for_each ([&] (const ast_node::ptr& v) { source.push_back (v); });
+
+    m_trie = nullptr;
+    m_children.clear ();
+    for (auto && v : source)
+      add_child (fn (v));
   }
 };
 
@@ -437,8 +737,15 @@ class call_arguments
 {
 public:
   call_arguments (const ast_node_container_base* owner, size_t offset, size_t count)
-    : m_owner (owner)
-    , m_offset (offset)
+    : m_args (owner->data () + offset)
+    , m_count (count)
+  {
+    assert (offset + count <= owner->size ());
+  }
+
+  // count values starting at args, e.g. registers of the vm
+  call_arguments (const ast_node::ptr* args, size_t count)
+    : m_args (args)
     , m_count (count)
   {}
 
@@ -447,14 +754,82 @@ public:
     return m_count;
   }
 
-  ast_node::ptr operator [] (size_t index) const
+  const ast_node::ptr& operator [] (size_t index) const
+  {
+    assert (index < m_count);
+    return m_args[index];
+  }
+
+private:
+  const ast_node::ptr* m_args;
+  size_t m_count;
+};
+
+///////////////////////////////
+// the arguments of the calls in progress, evaluated into one reusable
+// buffer instead of a list per call. It grows in chunks which never move,
+// so the arguments of a call stay put while the calls it makes push
+// theirs. Process-wide, not thread safe, strictly last in first out -
+// use argument_frame.
+class argument_stack
+{
+public:
+  static argument_stack& instance ();
+
+  // count contiguous empty slots
+  ast_node::ptr* push (size_t count);
+  // the slots of the last push, cleared
+  void pop (size_t count);
+
+private:
+  argument_stack () = default;
+  argument_stack (const argument_stack&) = delete;
+  argument_stack& operator = (const argument_stack&) = delete;
+
+  static constexpr size_t CHUNK_SIZE = 1024;
+
+  struct chunk
+  {
+    std::unique_ptr<ast_node::ptr[]> slots;
+    size_t size;
+    size_t used;
+  };
+
+  std::vector<chunk> m_chunks;
+  size_t m_current = 0;
+};
+
+///////////////////////////////
+// slots for the arguments of one call, released with the scope
+class argument_frame
+{
+public:
+  explicit argument_frame (size_t count)
+    : m_args (argument_stack::instance ().push (count))
+    , m_count (count)
+  {}
+
+  ~argument_frame ()
+  {
+    argument_stack::instance ().pop (m_count);
+  }
+
+  ast_node::ptr& operator [] (size_t index)
+  {
+    assert (index < m_count);
+    return m_args[index];
+  }
+
+  operator call_arguments () const
   {
-    return (*m_owner) [index + m_offset];
+    return call_arguments (m_args, m_count);
   }
 
 private:
-  const ast_node_container_base* m_owner;
-  size_t m_offset;
+  argument_frame (const argument_frame&) = delete;
+  argument_frame& operator = (const argument_frame&) = delete;
+
+  ast_node::ptr* m_args;
   size_t m_count;
 };
 
@@ -463,15 +838,24 @@ template <node_type_enum NODE_TYPE, typename derived>
 class ast_node_container_crtp : public ast_node_container_base
 {
 public:
-  node_type_enum type () const override
+  ast_node_container_crtp ()
+    : ast_node_container_base (NODE_TYPE)
+  {}
+
+  // the base takes a list or a vector, a cast to the derived class only
+  // its own type
+  static constexpr bool IS_VALID_TYPE (node_type_enum t)
   {
-    return NODE_TYPE;
+    return t == NODE_TYPE;
   }
 
 protected:
   mutable_ptr clone () const override
   {
-    auto new_list = std::make_shared<derived> ();
+    auto new_list = make_sp<derived> ();
+    new_list->m_trie = m_trie;
+    new_list->share (*this);
+    new_list->m_children.reserve (m_children.size ());
     for (auto &&v : m_children)
     {
       new_list->m_children.push_back (v);
@@ -485,14 +869,33 @@ protected:
 class ast_node_list : public ast_node_container_crtp <node_type_enum::LIST, ast_node_list>
 {
 public:
+  using ast_node_container_crtp::ast_node_container_crtp;
   using ast_node::to_string;
   std::string to_string (bool print_readable) const override;
+
+  // what an evaluator analyzed the form into, so evaluating the same
+  // form again does not repeat the analysis. Must not refer back to
+  // the form
+  const ast_node::ptr& code () const
+  {
+    return m_code;
+  }
+
+  void set_code (ast_node::ptr code) const
+  {
+    m_code = std::move (code);
+  }
+
+private:
+  mutable ast_node::ptr m_code;
 };
 
 ///////////////////////////////
 class ast_node_ht_list : public ast_node_container_crtp <node_type_enum::HT_LIST, ast_node_ht_list>
 {
 public:
+  using ast_node_container_crtp::ast_node_container_crtp;
+
   std::string to_string (bool print_readable) const override
   {
     std::string retVal = "{";
@@ -526,10 +929,26 @@ public:
 };
 
 ///////////////////////////////
+// a persistent vector: the elements are in a trie of full leaves and a
+// tail after them (see vector_trie), so conj and nth are near constant
+// time however long the vector is
 class ast_node_vector : public ast_node_container_crtp <node_type_enum::VECTOR, ast_node_vector>
 {
 public:
+  using ast_node_container_crtp::ast_node_container_crtp;
   std::string to_string (bool print_readably) const override;
+
+  // a vector of the same elements, without the meta. Only the tail is
+  // copied, the trie is shared
+  sp<ast_node_vector> copy () const
+  {
+    auto retVal = make_sp<ast_node_vector> ();
+    retVal->m_trie = m_trie;
+    retVal->m_children.reserve (m_children.size ());
+    for (auto && v : m_children)
+      retVal->m_children.push_back (v);
+    return retVal;
+  }
 };
 
 ///////////////////////////////
@@ -540,19 +959,55 @@ using tco = std::tuple <ast, environment::ptr, ast>;
 class ast_node_callable : public ast_node
 {
 public:
+  explicit ast_node_callable (node_type_enum type)
+    : ast_node (type)
+  {}
+
   virtual tco call_tco (const call_arguments&) const = 0;
 
   static constexpr bool IS_VALID_TYPE (node_type_enum t)
   {
-    return (t == node_type_enum::CALLABLE_BUILTIN) || (t == node_type_enum::CALLABLE_LAMBDA) || (t == node_type_enum::HASHMAP);
+    return (t == node_type_enum::CALLABLE_BUILTIN) || (t == node_type_enum::CALLABLE_LAMBDA) || (t == node_type_enum::CALLABLE_VM_CLOSURE) || (t == node_type_enum::HASHMAP);
   }
 };
 
 
+///////////////////////////////
+// core builtins a call site of two arguments runs inline, without the
+// argument view, the tco or the type checks, when both arguments are
+// immediate integers (apply_binary_op) - or for get, when the first is a
+// hash-map (apply_get)
+enum class binary_op : uint8_t
+{
+  NONE = 0,
+  PLUS,
+  MINUS,
+  MUL,
+  DIV,
+  LESS,
+  LESS_OR_EQ,
+  GREATER,
+  GREATER_OR_EQ,
+  EQUAL,
+  GET
+};
+
 ///////////////////////////////
 class ast_node_callable_builtin_base : public ast_node_callable
 {
 public:
+  binary_op inline_op () const
+  {
+    return m_inline_op;
+  }
+
+  // no side effects, the value depends on the arguments only - a call on
+  // constants may be computed ahead (fold_pure_call)
+  bool is_pure () const
+  {
+    return m_pure;
+  }
+
   bool operator == (const ast_node& rp) const override
   {
     if (type() != rp.type ())
@@ -567,8 +1022,11 @@ public:
   }
 
 protected:
-  ast_node_callable_builtin_base (std::string signature)
-    : m_signature (std::move (signature))
+  ast_node_callable_builtin_base (std::string signature, bool pure, binary_op inline_op)
+    : ast_node_callable (node_type_enum::CALLABLE_BUILTIN)
+    , m_signature (std::move (signature))
+    , m_pure (pure)
+    , m_inline_op (inline_op)
   {}
 
   const std::string& signature () const
@@ -578,16 +1036,102 @@ protected:
 
 private:
   std::string m_signature;
+  bool m_pure;
+  binary_op m_inline_op;
 };
 
+///////////////////////////////
+// a pure builtin, nullptr for any other value
+inline const ast_node_callable_builtin_base*
+as_pure_builtin (const ast_node::ptr& value)
+{
+  if (!value || value.is_int () || value->type () != node_type_enum::CALLABLE_BUILTIN)
+    return nullptr;
+
+  auto builtin = static_cast<const ast_node_callable_builtin_base*> (value.get ());
+  return builtin->is_pure () ? builtin : nullptr;
+}
+
+///////////////////////////////
+// the value of a call of a pure builtin on constants, computed by the
+// analysis or the compiler. false if the call fails - it is left to
+// report the error when it runs
+inline bool
+fold_pure_call (const ast_node_callable_builtin_base& builtin, const call_arguments& args, ast_node::ptr& retVal)
+{
+  assert (builtin.is_pure ());
+  try
+  {
+    retVal = std::get<2> (builtin.call_tco (args));
+  }
+  catch (const mal_exception&)
+  {
+    return false;
+  }
+  return !!retVal;
+}
+
+///////////////////////////////
+// the value of the builtin for op, false if it has to be called - an
+// argument is not an immediate integer, or a division by zero
+inline bool
+apply_binary_op (binary_op op, const ast_node::ptr& lhs, const ast_node::ptr& rhs, ast_node::ptr& retVal)
+{
+  if (!lhs.is_int () || !rhs.is_int ())
+    return false;
+
+  // immediates have 63 bits, a sum or difference fits
+  const int64_t first = lhs.int_value ();
+  const int64_t second = rhs.int_value ();
+  switch (op)
+  {
+  case binary_op::PLUS:
+    retVal = ast_node_ptr::make_int (first + second);
+    return true;
+  case binary_op::MINUS:
+    retVal = ast_node_ptr::make_int (first - second);
+    return true;
+  case binary_op::MUL:
+    // wraps like the builtin
+    retVal = ast_node_ptr::make_int (static_cast<int64_t> (static_cast<uint64_t> (first) * static_cast<uint64_t> (second)));
+    return true;
+  case binary_op::DIV:
+    if (second == 0)
+      return false;
+    retVal = ast_node_ptr::make_int (first / second);
+    return true;
+  case binary_op::LESS:
+    retVal = first < second ? ast_node::true_node : ast_node::false_node;
+    return true;
+  case binary_op::LESS_OR_EQ:
+    retVal = first <= second ? ast_node::true_node : ast_node::false_node;
+    return true;
+  case binary_op::GREATER:
+    retVal = first > second ? ast_node::true_node : ast_node::false_node;
+    return true;
+  case binary_op::GREATER_OR_EQ:
+    retVal = first >= second ? ast_node::true_node : ast_node::false_node;
+    return true;
+  case binary_op::EQUAL:
+    retVal = first == second ? ast_node::true_node : ast_node::false_node;
+    return true;
+  case binary_op::NONE:
+  case binary_op::GET:
+    break;
+  }
+  return false;
+}
+
 ///////////////////////////////
 //   using builtin_fn = ast_node::ptr (*) (const call_arguments&);
+// or, for a builtin ending in a call (apply, eval), returning tco - the
+// caller continues with the tree, the call is a tail call
 template <typename builtin_fn>
 class ast_node_callable_builtin : public ast_node_callable_builtin_base
 {
 public:
-  ast_node_callable_builtin (std::string signature, builtin_fn fn)
-    : ast_node_callable_builtin_base (std::move (signature))
+  ast_node_callable_builtin (std::string signature, builtin_fn fn, bool pure = false, binary_op inline_op = binary_op::NONE)
+    : ast_node_callable_builtin_base (std::move (signature), pure, inline_op)
     , m_fn (fn)
   {}
 
@@ -598,12 +1142,7 @@ public:
 
   tco call_tco (const call_arguments &args) const override
   {
-    return tco{nullptr, nullptr, m_fn (args)};
-  }
-
-  node_type_enum type () const override
-  {
-    return node_type_enum::CALLABLE_BUILTIN;
+    return as_tco (m_fn (args));
   }
 
   static constexpr bool IS_VALID_TYPE (node_type_enum t)
@@ -614,46 +1153,137 @@ public:
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_callable_builtin<builtin_fn> > (signature (), m_fn);
+    return make_sp<ast_node_callable_builtin<builtin_fn> > (signature (), m_fn, is_pure (), inline_op ());
   }
 
 private:
+  static tco as_tco (ast_node::ptr value)
+  {
+    return tco{nullptr, nullptr, value};
+  }
+
+  static tco as_tco (tco continuation)
+  {
+    return continuation;
+  }
+
   builtin_fn m_fn;
 };
 
 ///////////////////////////////
-class ast_node_callable_lambda : public ast_node_callable
+// picks the arity of a multi-arity fn* a call takes by the argument count,
+// a table lookup. An arity of fixed params wins over the variadic one
+class arity_dispatch
 {
 public:
-  ast_node_callable_lambda (ast_node::ptr binds, ast_node::ptr ast, environment::const_ptr outer_env);
+  // the arities are indexed in the order of add. Raises if the fixed
+  // arity is there already, or a second one is variadic
+  void add (size_t fixed_arity, bool variadic);
 
-  std::string to_string (bool print_readable) const override
+  // -1 if no arity takes argc arguments
+  int select (size_t argc) const
   {
-//    return "#callable-lambda" ;
-    return "#callable-lambda" + m_binds->to_string ()+ " -> " + m_ast->to_string ();
+    if (argc < m_by_argc.size () && m_by_argc[argc] >= 0)
+      return m_by_argc[argc];
+
+    return (m_variadic >= 0 && argc >= m_variadic_fixed_arity) ? m_variadic : -1;
   }
 
-  tco call_tco (const call_arguments&) const override;
+private:
+  std::vector<int> m_by_argc;
+  int m_variadic = -1;
+  size_t m_variadic_fixed_arity = 0;
+  int m_count = 0;
+};
 
-  bool operator == (const ast_node& rp) const override
+///////////////////////////////
+// the clauses of a multi-arity fn*, (fn* ([a] ..) ([a b] ..) ([a & r] ..)),
+// shared by its closures. Immutable once built
+class lambda_arities
+{
+public:
+  using ptr = sp<lambda_arities>;
+  using const_ptr = sp<const lambda_arities>;
+
+  struct arity
   {
-    if (type () != rp.type ())
-      return false;
+    ast_node::ptr binds;
+    ast_node::ptr ast;
+    frame_layout::const_ptr layout;
+    // what the call continues with, e.g. ast analyzed against layout
+    ast_node::ptr body;
+  };
+
+  lambda_arities () = default;
+
+  // raises if the arity clashes with one added before
+  void add (ast_node::ptr binds, ast_node::ptr ast, frame_layout::const_ptr layout, ast_node::ptr body);
 
-    auto rp_lambda = rp.as<ast_node_callable_lambda> ();
-    return equals (*m_binds, *rp_lambda->m_binds) && equals (*m_ast, *rp_lambda->m_ast);
+  // nullptr if no arity takes argc arguments
+  const arity* select (size_t argc) const
+  {
+    const int index = m_dispatch.select (argc);
+    return index < 0 ? nullptr : &m_arities[index];
   }
 
-  node_type_enum type () const override
+  const std::vector<arity>& arities () const
   {
-    return node_type_enum::CALLABLE_LAMBDA;
+    return m_arities;
   }
 
-  uint32_t hash () const override
+private:
+  lambda_arities (const lambda_arities&) = delete;
+  lambda_arities& operator = (const lambda_arities&) = delete;
+
+  friend void intrusive_add_ref (const lambda_arities* arities)
+  {
+    ++arities->m_refcount;
+  }
+
+  friend void intrusive_release (const lambda_arities* arities)
   {
-    return (m_binds->hash () * 1622000167 + 582512737) * m_ast->hash () + 2152752083;
+    if (--arities->m_refcount == 0)
+      delete arities;
   }
 
+  mutable uint32_t m_refcount = 0;
+  std::vector<arity> m_arities;
+  arity_dispatch m_dispatch;
+};
+
+///////////////////////////////
+class ast_node_callable_lambda : public ast_node_callable
+{
+public:
+  ast_node_callable_lambda (ast_node::ptr binds, ast_node::ptr ast, environment::const_ptr outer_env);
+  // body is what the call continues with, e.g. ast analyzed against layout
+  ast_node_callable_lambda (ast_node::ptr binds, ast_node::ptr ast, environment::const_ptr outer_env, frame_layout::const_ptr layout, ast_node::ptr body);
+  // a multi-arity fn*
+  ast_node_callable_lambda (lambda_arities::const_ptr arities, environment::const_ptr outer_env);
+
+  // slot layout of the call frames - the binds without '&', with the
+  // params set. Raises if the binds are not params, see check_params
+  static frame_layout::const_ptr make_layout (const ast_node_container_base& binds, frame_layout::const_ptr outer = nullptr);
+
+  // the index of '&' in binds, binds.size () if there is none. Raises
+  // unless every bind is a symbol, none is there twice and '&' is followed
+  // by the one name of the rest
+  static size_t check_params (const ast_node_container_base& binds);
+
+  // the error of a call of argc arguments to params taking fixed_arity
+  // and a rest if variadic, empty if they take them
+  static std::string arity_error (size_t fixed_arity, bool variadic, size_t argc);
+
+  // (fn* ([a] ..) ..) - the form after fn* is a clause, not the params
+  static bool is_multi_arity (const ast_node_list& fn_form);
+
+  std::string to_string (bool print_readable) const override;
+
+  tco call_tco (const call_arguments&) const override;
+
+  bool operator == (const ast_node& rp) const override;
+  uint32_t hash () const override;
+
   static constexpr bool IS_VALID_TYPE (node_type_enum t)
   {
     return node_type_enum::CALLABLE_LAMBDA == t;
@@ -662,15 +1292,23 @@ public:
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_callable_lambda> (m_binds, m_ast, m_outer_env);
+    if (m_arities)
+      return make_sp<ast_node_callable_lambda> (m_arities, m_outer_env);
+
+    return make_sp<ast_node_callable_lambda> (m_binds, m_ast, m_outer_env, m_layout, m_body);
   }
 
 private:
+  // nullptr for a multi-arity fn*
   ast_node::ptr m_binds;
-  const ast_node_container_base* m_binds_as_container;
 
   ast_node::ptr m_ast;
   environment::const_ptr m_outer_env;
+
+  frame_layout::const_ptr m_layout;
+  ast_node::ptr m_body;
+
+  lambda_arities::const_ptr m_arities;
 };
 
 ///////////////////////////////
@@ -706,10 +1344,18 @@ public:
     return m_callable_node;
   }
 
+  // advanced by every def! or defmacro! which (re)binds a macro. Call
+  // sites of both evaluators keep their expansion and look the macro up
+  // again only after it changed
+  static uint64_t epoch;
+  // runs of a kept expansion and expansions done, (macro-cache-stats)
+  static size_t cache_hits;
+  static size_t cache_misses;
+
 protected:
   mutable_ptr clone () const override
   {
-    return std::make_shared<ast_node_macro_call> (m_callable_node);
+    return make_sp<ast_node_macro_call> (m_callable_node);
   }
 
 private:
@@ -718,22 +1364,127 @@ private:
 };
 
 ///////////////////////////////
+// the keys of a small hash-map, in the order they came in. Maps built
+// with the same keys in the same order share one shape and keep only
+// their values, by slot. A shape is made from the one without its last
+// key - taking the same key from the same shape again finds the shape
+// made before, for as long as any map has it
+class map_shape
+{
+public:
+  using const_ptr = sp<const map_shape>;
+
+  static constexpr size_t MAX_KEYS = 8;
+  static constexpr size_t NO_SLOT = size_t (-1);
+
+  // the shape of the keys of shape and then key, which it has not.
+  // nullptr is the shape without keys
+  static const_ptr with_key (const const_ptr& shape, const ast_node::ptr& key);
+
+  size_t size () const
+  {
+    return m_size;
+  }
+
+  const ast_node::ptr& key (size_t slot) const
+  {
+    assert (slot < m_size);
+    return m_keys[slot];
+  }
+
+  // NO_SLOT if there is no such key. Keywords are interned and small
+  // integers immediate, so the key is likely the very node stored - a
+  // scan by pointer comes before the one comparing keys
+  size_t slot_of (const ast_node::ptr& key) const
+  {
+    for (size_t i = 0; i < m_size; ++i)
+    {
+      if (m_keys[i] == key)
+        return i;
+    }
+
+    if (!key || (m_plain_keys && is_plain (key)))
+      return NO_SLOT;
+
+    for (size_t i = 0; i < m_size; ++i)
+    {
+      if (*m_keys[i] == *key)
+        return i;
+    }
+    return NO_SLOT;
+  }
+
+  // equal to another plain key only if it is the same
+  static bool is_plain (const ast_node::ptr& key)
+  {
+    if (key.is_int ())
+      return true;
+    return key && key.get ()->type () == node_type_enum::KEYWORD && key.get ()->as<ast_node_keyword> ()->is_interned ();
+  }
+
+private:
+  map_shape (const_ptr parent, const ast_node::ptr& key);
+  ~map_shape ();
+
+  map_shape (const map_shape&) = delete;
+  map_shape& operator = (const map_shape&) = delete;
+
+  friend void intrusive_add_ref (const map_shape* shape)
+  {
+    ++shape->m_refcount;
+  }
+
+  friend void intrusive_release (const map_shape* shape)
+  {
+    if (--shape->m_refcount == 0)
+      delete shape;
+  }
+
+  mutable uint32_t m_refcount = 0;
+  uint32_t m_size;
+  // all keys are plain, so a plain key not found by pointer is not there
+  bool m_plain_keys;
+  // kept alive while the shape made from it is - the transition to this
+  // one is found by its address
+  const_ptr m_parent;
+  ast_node::ptr m_keys[MAX_KEYS];
+};
+
+///////////////////////////////
+// the slot a call site of get found its key in, for the maps of one
+// shape - the next map of that shape has the value there, no lookup
+struct map_slot_cache
+{
+  map_shape::const_ptr shape;
+  ast_node::ptr key;
+  size_t slot = map_shape::NO_SLOT;
+};
+
+///////////////////////////////
+// a hash-map of up to ARRAY_MAP_SIZE entries keeps its keys in a
+// map_shape it shares with other maps, and its values in a flat array
+// by slot. One growing beyond moves them to a hash_trie, which is
+// persistent. Calling a hash-map with a key looks the key up
 class ast_node_hashmap : public ast_node_callable
 {
 public:
-  ast_node_hashmap () {}
+  static constexpr size_t ARRAY_MAP_SIZE = map_shape::MAX_KEYS;
+
+  ast_node_hashmap ()
+    : ast_node_callable (node_type_enum::HASHMAP)
+  {}
 
   std::string to_string (bool print_readable) const override
   {
     std::string retVal = "{";
     size_t i = 0;
-    for (auto && p : m_hashtable)
+    for_each ([&] (const ast_node::ptr& k, const ast_node::ptr& v)
     {
       if (i != 0)
         retVal += " ";
-      retVal += p.first->to_string (print_readable) + " " + p.second->to_string (print_readable);
+      retVal += k->to_string (print_readable) + " " + v->to_string (print_readable);
       ++i;
-    }
+    });
     retVal += "}";
 
     return retVal;
@@ -745,8 +1496,7 @@ public:
     if (args.size () != 1)
       raise<mal_exception_eval_invalid_arg> ("");
 
-    auto it = m_hashtable.find (args [0]);
-    return tco{nullptr, nullptr, it != m_hashtable.end () ? it->second : ast_node::nil_node};
+    return tco{nullptr, nullptr, get (args [0])};
   }
 
   bool operator == (const ast_node& rp) const override
@@ -756,56 +1506,121 @@ public:
 
     auto rp_hashmap = rp.as<ast_node_hashmap> ();
 
-    if (m_hashtable.size () != rp_hashmap->m_hashtable.size ())
+    if (size () != rp_hashmap->size ())
       return false;
 
-    for (auto it1 = m_hashtable.begin(), e = m_hashtable.end (); it1 != e; ++it1)
+    bool retVal = true;
+    for_each ([&] (const ast_node::ptr& k, const ast_node::ptr& v)
     {
-      auto it2 = rp_hashmap->m_hashtable.find (it1->first);
-      if (it2 == rp_hashmap->m_hashtable.end ())
-        return false;
+      if (!retVal)
+        return;
 
-      if (*it1->second != *it2->second)
-        return false;
-    }
-    return true;
-  }
-
-  node_type_enum type () const override
-  {
-    return node_type_enum::HASHMAP;
+      auto found = rp_hashmap->find (k);
+      retVal = found && *v == **found;
+    });
+    return retVal;
   }
 
+  // a sum over the entries - equal maps may hold them in different order
   uint32_t hash () const override
   {
     uint32_t retVal = 582512737;
-    for (auto && p : m_hashtable)
+    for_each ([&] (const ast_node::ptr& k, const ast_node::ptr& v)
     {
-      retVal = (retVal + p.first->hash ()) * 1622000167 + 2152752083;
-      retVal = (retVal + p.second->hash ()) * 1622000167 + 2152752083;
-    }
+      retVal += (k->hash () * 1622000167 + v->hash ()) * 2152752083;
+    });
     return retVal;
   }
 
+  size_t size () const
+  {
+    return m_map.size () + m_values.size ();
+  }
+
   void insert (ast_node::ptr key, ast_node::ptr value)
   {
-    m_hashtable [key] = value;
+    if (m_map.size () == 0)
+    {
+      const size_t slot = m_shape ? m_shape->slot_of (key) : map_shape::NO_SLOT;
+      if (slot != map_shape::NO_SLOT)
+      {
+        m_values[slot] = std::move (value);
+        return;
+      }
+
+      if (m_values.size () < ARRAY_MAP_SIZE)
+      {
+        m_shape = map_shape::with_key (m_shape, key);
+        m_values.push_back (std::move (value));
+        return;
+      }
+
+      for (size_t i = 0, e = m_values.size (); i < e; ++i)
+        m_map.insert (m_shape->key (i), m_values[i]);
+      m_values.clear ();
+      m_shape = nullptr;
+    }
+
+    m_map.insert (key, value);
   }
 
   void erase (ast_node::ptr key)
   {
-    m_hashtable.erase (key);
+    if (m_map.size () != 0)
+    {
+      m_map.erase (key);
+      return;
+    }
+
+    const size_t slot = m_shape ? m_shape->slot_of (key) : map_shape::NO_SLOT;
+    if (slot == map_shape::NO_SLOT)
+      return;
+
+    // the shape of the keys left
+    map_shape::const_ptr shape;
+    for (size_t i = 0, e = m_values.size (); i < e; ++i)
+    {
+      if (i != slot)
+        shape = map_shape::with_key (shape, m_shape->key (i));
+    }
+    m_shape = shape;
+    m_values.erase (m_values.begin () + slot);
+  }
+
+  // nullptr if there is no such key
+  const ast_node::ptr* find (const ast_node::ptr& key) const
+  {
+    if (m_map.size () != 0)
+      return m_map.find (key);
+
+    const size_t slot = m_shape ? m_shape->slot_of (key) : map_shape::NO_SLOT;
+    return slot != map_shape::NO_SLOT ? &m_values[slot] : nullptr;
   }
 
   ast_node::ptr get (ast_node::ptr key) const
   {
-    auto it = m_hashtable.find (key);
-    return it != m_hashtable.end () ? it->second : ast_node::nil_node;
+    auto found = find (key);
+    return found ? *found : ast_node::nil_node;
+  }
+
+  // get, at the slot cache tells while this map has its shape
+  ast_node::ptr get (const ast_node::ptr& key, map_slot_cache& cache) const
+  {
+    if (m_shape != cache.shape || !m_shape || key != cache.key)
+    {
+      if (!m_shape)
+        return get (key);
+
+      cache.shape = m_shape;
+      cache.key = key;
+      cache.slot = m_shape->slot_of (key);
+    }
+    return cache.slot != map_shape::NO_SLOT ? m_values[cache.slot] : ast_node::nil_node;
   }
 
   bool has (ast_node::ptr key) const
   {
-    return m_hashtable.count (key) != 0;
+    return find (key) != nullptr;
   }
 
   static constexpr bool IS_VALID_TYPE (node_type_enum t)
@@ -815,24 +1630,27 @@ public:
 
   mutable_ptr clone () const override
   {
-    auto retVal = std::make_shared<ast_node_hashmap> ();
-    retVal->m_hashtable = m_hashtable;
+    auto retVal = make_sp<ast_node_hashmap> ();
+    retVal->m_map = m_map;
+    retVal->m_shape = m_shape;
+    retVal->m_values.reserve (m_values.size ());
+    for (auto && v : m_values)
+      retVal->m_values.push_back (v);
     return retVal;
   }
 
   template <typename Visitor>
   void for_each (Visitor && v) const
   {
-    for (auto && p : m_hashtable)
-    {
-      v (p.first, p.second);
-    }
+    for (size_t i = 0, e = m_values.size (); i < e; ++i)
+      v (m_shape->key (i), m_values[i]);
+    m_map.for_each (v);
   }
 
 private:
   struct ast_node_hash
   {
-    uint32_t operator () (ast_node::ptr v) const
+    uint32_t operator () (const ast_node::ptr& v) const
     {
       return v ? v->hash () : 0;
     }
@@ -840,7 +1658,7 @@ private:
 
   struct ast_node_eq
   {
-    bool operator () (ast_node::ptr v1, ast_node::ptr v2) const
+    bool operator () (const ast_node::ptr& v1, const ast_node::ptr& v2) const
     {
       return v1 == v2 ? true :
              v1 && v2 ? *v1 == *v2 : false;
@@ -848,44 +1666,106 @@ private:
 
   };
 
-  std::unordered_map <ast_node::ptr, ast_node::ptr, ast_node_hash, ast_node_eq> m_hashtable;
+  // the keys while the map is small, nullptr once the entries are in
+  // m_map
+  map_shape::const_ptr m_shape;
+  // by slot of m_shape. Records of up to four keys fit inline
+  small_vector<ast_node::ptr, 4> m_values;
+  // persistent, a clone shares it - assoc and dissoc copy only the path
+  // to the changed entry
+  hash_trie<ast_node::ptr, ast_node::ptr, ast_node_hash, ast_node_eq> m_map;
 };
 
+///////////////////////////////
+// the value of get on map and key, through the slot cache of the call
+// site. false if the builtin has to be called - map is not a hash-map
+inline bool
+apply_get (const ast_node::ptr& map, const ast_node::ptr& key, map_slot_cache& cache, ast_node::ptr& retVal)
+{
+  if (map.is_int () || !map || map.get ()->type () != node_type_enum::HASHMAP)
+    return false;
+
+  retVal = static_cast<const ast_node_hashmap*> (map.get ())->get (key, cache);
+  return true;
+}
+
+///////////////////////////////
+// a form the evaluators may take as its value: a string, keyword,
+// number, true, false or nil, or a vector or hash-map the reader found
+// to hold only such forms. The value is the form itself, not a copy
+inline bool
+is_constant_literal (const ast_node::ptr& form)
+{
+  if (form.is_int ())
+    return true;
+
+  switch (form->type ())
+  {
+  case node_type_enum::STRING:
+  case node_type_enum::KEYWORD:
+  case node_type_enum::INT:
+  case node_type_enum::BOOL:
+  case node_type_enum::NIL:
+    return true;
+
+  case node_type_enum::VECTOR:
+  case node_type_enum::HASHMAP:
+    return form->has_flag (ast_node::FLAG_CONSTANT);
+
+  default:
+    break;
+  }
+  return false;
+}
+
 namespace mal
 {
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_list> 
+  inline sp<ast_node_list> 
   make_list () 
   {
-    return std::make_shared<ast_node_list> ();
+    return make_sp<ast_node_list> ();
+  }
+
+  ///////////////////////////////
+  // the arguments from offset on, e.g. the rest of a variadic call
+  inline sp<ast_node_list>
+  make_list (const call_arguments& args, size_t offset)
+  {
+    auto retVal = make_sp<ast_node_list> ();
+    retVal->reserve (args.size () - offset);
+    for (size_t i = offset, e = args.size (); i < e; ++i)
+      retVal->add_child (args[i]);
+
+    return retVal;
   }
 
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_vector> 
+  inline sp<ast_node_vector> 
   make_vector () 
   {
-    return std::make_shared<ast_node_vector> ();
+    return make_sp<ast_node_vector> ();
   }
 
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_ht_list> 
+  inline sp<ast_node_ht_list> 
   make_ht_list () 
   {
-    return std::make_shared<ast_node_ht_list> ();
+    return make_sp<ast_node_ht_list> ();
   }
 
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_hashmap>
+  inline sp<ast_node_hashmap>
   make_hashmap ()
   {
-    return std::make_shared<ast_node_hashmap> ();
+    return make_sp<ast_node_hashmap> ();
   }
 
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_hashmap>
+  inline sp<ast_node_hashmap>
   make_hashmap (const ast_node_container_base* seq)
   {
-    auto retVal = std::make_shared<ast_node_hashmap> ();
+    auto retVal = make_sp<ast_node_hashmap> ();
 
     const size_t count = seq->size ();
     if (count % 2 != 0)
@@ -900,10 +1780,10 @@ namespace mal
   }
 
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_hashmap>
+  inline sp<ast_node_hashmap>
   make_hashmap (const call_arguments& args)
   {
-    auto retVal = std::make_shared<ast_node_hashmap> ();
+    auto retVal = make_sp<ast_node_hashmap> ();
 
     const size_t count = args.size ();
     if (count % 2 != 0)
@@ -918,31 +1798,32 @@ namespace mal
   }
 
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_symbol> 
-  make_symbol (std::string value) 
+  inline sp<ast_node_symbol> 
+  make_symbol (const std::string& value) 
   {
-    return std::make_shared<ast_node_symbol> (std::move (value));
+    return make_sp<ast_node_symbol> (value);
   }
 
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_keyword> 
+  inline sp<ast_node_keyword> 
   make_keyword (std::string value) 
   {
-    return std::make_shared<ast_node_keyword> (std::move (value));
+    return ast_node_keyword::intern (std::move (value));
   }
 
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_string> 
+  inline sp<ast_node_string> 
   make_string (std::string value) 
   {
-    return std::make_shared<ast_node_string> (std::move (value));
+    return make_sp<ast_node_string> (std::move (value));
   }
 
   ///////////////////////////////
-  inline std::shared_ptr<ast_node_int> 
+  // immediate unless the value is out of the immediate range
+  inline ast_node::ptr
   make_int (int64_t value) 
   {
-    return std::make_shared<ast_node_int> (value);
+    return ast_node_ptr::make_int (value);
   }
 }
 
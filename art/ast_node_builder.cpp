@@ -1,5 +1,22 @@
 #include "ast_node_builder.h"
 
+namespace
+{
+
+///////////////////////////////
+bool
+all_constant_literals (const ast_node_container_base* container)
+{
+  for (size_t i = 0, e = container->size (); i < e; ++i)
+  {
+    if (!is_constant_literal ((*container)[i]))
+      return false;
+  }
+  return true;
+}
+
+} // end of anonymous namespace
+
 ///////////////////////////////
 /// ast_builder class
 ///////////////////////////////
@@ -21,7 +38,7 @@ ast_builder::add_reader_macro (const reader_macro_fn& reader_macro)
 ast_builder&
 ast_builder::open_list ()
 {
-  auto child = mal::make_list ();
+  auto child = make_sp<ast_node_list> ();
   ast_node_list* child_ref = child.get ();
 
   back_node ()->add_child (child);
@@ -42,7 +59,7 @@ ast_builder::close_list ()
 ast_builder&
 ast_builder::open_vector ()
 {
-  auto child = mal::make_vector ();
+  auto child = make_sp<ast_node_vector> ();
   ast_node_vector* child_ref = child.get ();
 
   back_node ()->add_child (child);
@@ -54,8 +71,12 @@ ast_builder::open_vector ()
 ast_builder& 
 ast_builder::close_vector ()
 {
-  back_node ()->as_or_throw<ast_node_vector, mal_exception_parse_error> ();
+  auto vector = back_node ()->as_or_throw<ast_node_vector, mal_exception_parse_error> ();
   pop_node ();
+
+  // the reader macros of the elements are applied by now
+  if (all_constant_literals (vector))
+    vector->mark_constant ();
   return *this;
 }
 
@@ -63,7 +84,7 @@ ast_builder::close_vector ()
 ast_builder& 
 ast_builder::add_symbol (std::string value)
 {
-  ast_node::ptr child { new ast_node_symbol {std::move (value)} };
+  ast_node::ptr child = make_sp<ast_node_symbol> (symbol_table::intern (value));
   back_node ()->add_child (child);
   return *this;
 }
@@ -72,7 +93,7 @@ ast_builder::add_symbol (std::string value)
 ast_builder& 
 ast_builder::add_keyword (std::string keyword)
 {
-  ast_node::ptr child { new ast_node_keyword {std::move (keyword)} };
+  ast_node::ptr child = mal::make_keyword (std::move (keyword));
   back_node ()->add_child (child);
   return *this;
 }
@@ -81,8 +102,7 @@ ast_builder::add_keyword (std::string keyword)
 ast_builder& 
 ast_builder::add_int (int64_t value)
 {
-  ast_node::ptr child { new ast_node_int { value } };
-  back_node ()->add_child (child);
+  back_node ()->add_child (mal::make_int (value));
   return *this;
 }
 
@@ -114,7 +134,7 @@ ast_builder::add_node (ast_node::ptr node)
 ast_builder&
 ast_builder::add_string (std::string str)
 {
-  ast_node::ptr child { new ast_node_string {std::move (str)} };
+  ast_node::ptr child = make_sp<ast_node_string> (std::move (str));
   back_node ()->add_child (child);
   return *this;
 }
@@ -150,11 +170,14 @@ ast_builder::open_hashmap ()
   add_reader_macro (
     [] (ast_node_container_base* listToModify, size_t listIdx) -> void
     {
-      auto newNode = mal::make_hashmap ((*listToModify) [listIdx]->as_or_throw<ast_node_ht_list, mal_exception_parse_error> ());
+      auto elements = (*listToModify) [listIdx]->as_or_throw<ast_node_ht_list, mal_exception_parse_error> ();
+      auto newNode = mal::make_hashmap (elements);
+      if (all_constant_literals (elements))
+        newNode->mark_constant ();
       listToModify->replace (listIdx, newNode);
     });
 
-  auto child = mal::make_ht_list ();
+  auto child = make_sp<ast_node_ht_list> ();
   auto child_ref = child.get ();
 
   back_node ()->add_child (child);
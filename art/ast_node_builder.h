@@ -51,6 +51,9 @@ public:
   }
 
 private:
+  ast_builder (const ast_builder&) = delete;
+  ast_builder& operator = (const ast_builder&) = delete;
+
   //
   ast_node_container_base* back_node ()
   {
@@ -64,11 +67,11 @@ private:
   struct builder_stack_entry
   {
     ast_node_container_base* m_builder = {};
-    std::deque <std::pair<reader_macro_fn, size_t>> m_reader_macros = {};
+    std::vector <std::pair<reader_macro_fn, size_t>> m_reader_macros = {};
   };
 
   std::unique_ptr<ast_node_list> m_meta_root;
-  std::deque<builder_stack_entry> m_current_stack;
+  std::vector<builder_stack_entry> m_current_stack;
 
   std::string m_picewise_string;
 };
@@ -0,0 +1,131 @@
+#include "MAL.h"
+#include "exceptions.h"
+#include "ast.h"
+#include "ast_details.h"
+#include "reader.h"
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+///////////////////////////////
+// reader benchmark: parses the given mal files and reports nodes/sec and
+// peak RSS.
+//
+//   ./bench_reader [--rounds N] ../tests/*.mal
+///////////////////////////////
+namespace
+{
+
+///////////////////////////////
+size_t
+count_nodes (ast_node::ptr node)
+{
+  size_t retVal = 1;
+  if (auto container = node->as_or_zero<ast_node_container_base> ())
+  {
+    for (size_t i = 0, e = container->size (); i < e; ++i)
+      retVal += count_nodes ((*container)[i]);
+  }
+  else if (auto hashmap = node->as_or_zero<ast_node_hashmap> ())
+  {
+    hashmap->for_each ([&] (ast_node::ptr k, ast_node::ptr v) { retVal += count_nodes (k) + count_nodes (v); });
+  }
+  return retVal;
+}
+
+///////////////////////////////
+// test files mix forms with expected output and deliberately broken input,
+// so keep only the lines which parse by themselves and glue them into one form
+std::string
+load_corpus_file (const std::string& file_name)
+{
+  std::ifstream infile (file_name);
+  std::string retVal = "(do";
+  std::string line;
+  while (std::getline (infile, line))
+  {
+    if (line.empty () || line[0] == ';')
+      continue;
+
+    try
+    {
+      if (read_str (line)->type () == node_type_enum::INVALID)
+        continue;
+    }
+    catch (const mal_exception&)
+    {
+      continue;
+    }
+    retVal += "\n" + line;
+  }
+  retVal += ")";
+  return retVal;
+}
+
+///////////////////////////////
+long
+peak_rss_kb ()
+{
+  rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+} // end of anonymous namespace
+
+///////////////////////////////
+int
+main (int argc, char** argv)
+{
+  size_t rounds = 200;
+  std::vector<std::string> corpus;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::strcmp (argv[i], "--rounds") == 0 && i + 1 < argc)
+      rounds = std::stoul (argv[++i]);
+    else
+      corpus.push_back (load_corpus_file (argv[i]));
+  }
+
+  if (corpus.empty ())
+  {
+    std::fprintf (stderr, "usage: %s [--rounds N] file.mal ...\n", argv[0]);
+    return 1;
+  }
+
+  const long rss_before = peak_rss_kb ();
+
+  // all trees stay alive until the end, so peak RSS reflects what the
+  // reader leaves behind as well as what it churns through
+  std::vector<ast_node::ptr> trees;
+  trees.reserve (rounds * corpus.size ());
+
+  size_t nodes = 0;
+  const auto start = std::chrono::steady_clock::now ();
+  for (size_t r = 0; r < rounds; ++r)
+  {
+    for (auto&& text : corpus)
+    {
+      trees.push_back (read_str (text));
+    }
+  }
+  const auto finish = std::chrono::steady_clock::now ();
+
+  for (size_t i = 0; i < corpus.size (); ++i)
+    nodes += count_nodes (trees[i]);
+  nodes *= rounds;
+
+  const double seconds = std::chrono::duration<double> (finish - start).count ();
+  std::printf ("nodes: %zu in %.3f s, %.0f nodes/sec\n", nodes, seconds, nodes / seconds);
+  std::printf ("peak RSS: %ld KB (%ld KB before parsing)\n", peak_rss_kb (), rss_before);
+
+  return 0;
+}
@@ -5,6 +5,7 @@
 #include <fstream>
 #include <streambuf>
 #include <chrono>
+#include <limits>
 
 namespace
 {
@@ -20,7 +21,11 @@ ast_node_from_bool (bool f)
 inline int64_t
 arg_to_int (const call_arguments& args, size_t i)
 {
-  return args[i]->as_or_throw<ast_node_int, mal_exception_eval_not_int> ()->value ();
+  const ast_node::ptr& arg = args[i];
+  if (arg.is_int ())
+    return arg.int_value ();
+
+  return arg->as_or_throw<ast_node_int, mal_exception_eval_not_int> ()->value ();
 }
 
 ///////////////////////////////
@@ -47,7 +52,7 @@ builtin_plus (const call_arguments& args)
   for (size_t i = 0; i < args_size; ++i)
     retVal += arg_to_int(args, i);
 
-  return std::make_shared<ast_node_int> (retVal);
+  return mal::make_int (retVal);
 }
 
 ///////////////////////////////
@@ -59,7 +64,7 @@ builtin_minus (const call_arguments& args)
     raise<mal_exception_eval_invalid_arg> ();
 
   int64_t retVal = (args_size == 1) ? -arg_to_int (args, 0) : arg_to_int (args, 0) - arg_to_int (args, 1);
-  return std::make_shared<ast_node_int> (retVal);
+  return mal::make_int (retVal);
 }
 
 ///////////////////////////////
@@ -70,8 +75,16 @@ builtin_div (const call_arguments& args)
   if (args_size != 2)
     raise<mal_exception_eval_invalid_arg> ();
 
-  int64_t retVal = arg_to_int(args, 0) / arg_to_int(args, 1);
-  return std::make_shared<ast_node_int> (retVal);
+  // an error, not a crash - a call on constants runs at analysis time
+  const int64_t dividend = arg_to_int (args, 0);
+  const int64_t divisor = arg_to_int (args, 1);
+  if (divisor == 0)
+    raise<mal_exception_eval_invalid_arg> ("division by zero");
+  if (dividend == std::numeric_limits<int64_t>::min () && divisor == -1)
+    raise<mal_exception_eval_invalid_arg> ("integer overflow");
+
+  int64_t retVal = dividend / divisor;
+  return mal::make_int (retVal);
 }
 
 ///////////////////////////////
@@ -86,7 +99,7 @@ builtin_mul (const call_arguments& args)
   for (size_t i = 0; i < args_size; ++i)
     retVal *= arg_to_int(args, i);
 
-  return std::make_shared<ast_node_int> (retVal);
+  return mal::make_int (retVal);
 }
 
 ///////////////////////////////
@@ -140,7 +153,7 @@ builtin_count (const call_arguments& args)
     count = arg_list->size ();
   }
 
-  return std::make_shared<ast_node_int> (count);
+  return mal::make_int (count);
 
 }
 
@@ -197,7 +210,7 @@ builtin_pr_str (const call_arguments& args)
     retVal += pr_str (args[i], true);
   }
 
-  return std::make_shared<ast_node_string> (std::move (retVal));
+  return make_sp<ast_node_string> (std::move (retVal));
 }
 
 ///////////////////////////////
@@ -212,7 +225,7 @@ builtin_str (const call_arguments& args)
     retVal += pr_str (args[i], false);
   }
 
-  return std::make_shared<ast_node_string> (std::move (retVal));
+  return make_sp<ast_node_string> (std::move (retVal));
 }
 
 ///////////////////////////////
@@ -259,8 +272,7 @@ builtin_read_string (const call_arguments& args)
   if (args_size !=  1)
     raise<mal_exception_eval_invalid_arg> ();
 
-  auto strVal = args[0]->as_or_throw<ast_node_string, mal_exception_eval_not_string> ();
-  return read_str (strVal->value ());
+  return read_str (args[0]->as_or_throw<ast_node_string, mal_exception_eval_not_string> ()->value ());
 }
 
 ///////////////////////////////
@@ -285,7 +297,7 @@ builtin_slurp (const call_arguments& args)
   allText.assign((std::istreambuf_iterator<char>(infile)),
                   std::istreambuf_iterator<char>());
 
-  return std::make_shared<ast_node_string> (std::move (allText));
+  return make_sp<ast_node_string> (std::move (allText));
 }
 
 ///////////////////////////////
@@ -296,7 +308,7 @@ builtin_atom (const call_arguments& args)
   if (args_size !=  1)
     raise<mal_exception_eval_invalid_arg> ();
 
-  return std::make_shared<ast_node_atom> (args[0]);
+  return make_sp<ast_node_atom> (args[0]);
 }
 
 ///////////////////////////////
@@ -344,14 +356,8 @@ builtin_cons (const call_arguments& args)
   if (args_size !=  2)
     raise<mal_exception_eval_invalid_arg> ();
 
-  auto retVal = mal::make_list ();
-  retVal->add_child (args [0]);
   auto l = args[1]->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ();
-  for (size_t j = 0, je = l->size (); j < je; ++j)
-  {
-    retVal->add_child ((*l) [j]);
-  }
-  return retVal;
+  return l->cons (args [0]);
 }
 
 ///////////////////////////////
@@ -364,10 +370,7 @@ builtin_concat (const call_arguments& args)
   for (size_t i = 0; i < args_size; ++i)
   {
     auto l = args[i]->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ();
-    for (size_t j = 0, je = l->size (); j < je; ++j)
-    {
-      retVal->add_child ((*l) [j]);
-    }
+    l->for_each ([&] (const ast_node::ptr& v) { retVal->add_child (v); });
   }
   return retVal;
 }
@@ -417,20 +420,11 @@ builtin_rest (const call_arguments& args)
   if (args_size != 1)
     raise<mal_exception_eval_invalid_arg> ();
 
-  auto retVal = mal::make_list ();
   auto first = args[0];
-  if (first != ast_node::nil_node)
-  {
-    auto l = first->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ();
-    const auto lSize = l->size ();
-
-    for (size_t i = 1; i < lSize; ++i)
-    {
-      retVal->add_child ((*l) [i]);
-    }
-  }
+  if (first == ast_node::nil_node)
+    return mal::make_list ();
 
-  return retVal;
+  return first->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ()->rest ();
 }
 
 ///////////////////////////////
@@ -583,6 +577,10 @@ builtin_get (const call_arguments& args)
   if (hashmap->type () == node_type_enum::NIL)
     return ast_node::nil_node;
 
+  // a transient map is read while it is built
+  if (hashmap->type () == node_type_enum::TRANSIENT)
+    return hashmap->as<ast_node_transient> ()->edit ()->as_or_throw<ast_node_hashmap, mal_exception_eval_not_hashmap> ()->get (args[1]);
+
   return hashmap->as_or_throw<ast_node_hashmap, mal_exception_eval_not_hashmap> ()->get (args[1]);
 }
 
@@ -710,11 +708,8 @@ builtin_conj (const call_arguments& args)
     }
     case node_type_enum::VECTOR:
     {
-      auto retVal = mal::make_vector ();
-      for (size_t i = 0, e = firstSeq->size (); i < e; ++i)
-      {
-        retVal->add_child ((*firstSeq)[i]);
-      }
+      // shares the trie of the source, only its tail is copied
+      auto retVal = firstSeq->as<ast_node_vector> ()->copy ();
       for (size_t i = 1; i < args_size; ++i)
       {
         retVal->add_child (args[i]);
@@ -727,6 +722,87 @@ builtin_conj (const call_arguments& args)
   return ast_node::nil_node;
 }
 
+///////////////////////////////
+ast_node::ptr
+builtin_transient (const call_arguments& args)
+{
+  const auto args_size = args.size ();
+  if (args_size != 1)
+    raise<mal_exception_eval_invalid_arg> ();
+
+  auto collection = ast_node_transient::copy_of (args[0]);
+  if (!collection)
+    raise<mal_exception_eval_invalid_arg> ("transient of a vector or hash-map");
+
+  return make_sp<ast_node_transient> (std::move (collection));
+}
+
+///////////////////////////////
+ast_node::ptr
+builtin_conj_transient (const call_arguments& args)
+{
+  const auto args_size = args.size ();
+  if (args_size < 1)
+    raise<mal_exception_eval_invalid_arg> ();
+
+  auto vector = args[0]->as_or_throw<ast_node_transient, mal_exception_eval_not_transient> ()->edit ()->as_or_throw<ast_node_vector, mal_exception_eval_invalid_arg> ();
+  for (size_t i = 1; i < args_size; ++i)
+  {
+    vector->add_child (args[i]);
+  }
+
+  return args[0];
+}
+
+///////////////////////////////
+ast_node::ptr
+builtin_assoc_transient (const call_arguments& args)
+{
+  const auto args_size = args.size ();
+  if (args_size < 1)
+    raise<mal_exception_eval_invalid_arg> ();
+
+  auto hashmap = args[0]->as_or_throw<ast_node_transient, mal_exception_eval_not_transient> ()->edit ()->as_or_throw<ast_node_hashmap, mal_exception_eval_not_hashmap> ();
+
+  if (args_size % 2 == 0)
+    raise<mal_exception_parse_error> ("odd number of elements in hashmap");
+
+  for (size_t i = 1; i < args_size; i += 2)
+  {
+    hashmap->insert (args[i], args[i + 1]);
+  }
+
+  return args[0];
+}
+
+///////////////////////////////
+ast_node::ptr
+builtin_dissoc_transient (const call_arguments& args)
+{
+  const auto args_size = args.size ();
+  if (args_size < 1)
+    raise<mal_exception_eval_invalid_arg> ();
+
+  auto hashmap = args[0]->as_or_throw<ast_node_transient, mal_exception_eval_not_transient> ()->edit ()->as_or_throw<ast_node_hashmap, mal_exception_eval_not_hashmap> ();
+  for (size_t i = 1; i < args_size; ++i)
+  {
+    hashmap->erase (args[i]);
+  }
+
+  return args[0];
+}
+
+///////////////////////////////
+ast_node::ptr
+builtin_persistent (const call_arguments& args)
+{
+  const auto args_size = args.size ();
+  if (args_size != 1)
+    raise<mal_exception_eval_invalid_arg> ();
+
+  return args[0]->as_or_throw<ast_node_transient, mal_exception_eval_not_transient> ()->persist ();
+}
+
 ///////////////////////////////
 ast_node::ptr
 builtin_is_string (const call_arguments& args)
@@ -764,8 +840,8 @@ builtin_seq (const call_arguments& args)
         break;
 
       auto retVal = mal::make_list ();
-      for (size_t i = 0, e = seq->size (); i < e; ++i)
-        retVal->add_child ((*seq)[i]);
+      retVal->reserve (seq->size ());
+      seq->for_each ([&] (const ast_node::ptr& v) { retVal->add_child (v); });
       return retVal;
     }
     case node_type_enum::STRING:
@@ -791,7 +867,23 @@ builtin_seq (const call_arguments& args)
 }
 
 ///////////////////////////////
+// the value of a call, a tree the callable continues with is evaluated
 ast_node::ptr
+call_to_value (const ast_node_callable* callable_node, const call_arguments& args)
+{
+  ast retVal;
+  ast tree;
+  environment::ptr a_env;
+  std::tie (tree, a_env, retVal) = callable_node->call_tco (args);
+  if (retVal)
+    return ast_node_raised::value_or_throw (retVal);
+
+  return ast_node_raised::value_or_throw (EVAL (tree, a_env));
+}
+
+///////////////////////////////
+// a tail call - EVAL of the caller continues with the callee
+tco
 builtin_apply (const call_arguments& args)
 {
   const auto args_size = args.size ();
@@ -805,26 +897,21 @@ builtin_apply (const call_arguments& args)
   }
   auto callable_node = firstNode->as_or_throw<ast_node_callable, mal_exception_eval_not_callable> ();
 
-  auto args_list = mal::make_list ();
+  auto last_list = args [args_size - 1]->as_or_throw <ast_node_container_base, mal_exception_eval_not_list> ();
+  const size_t last_list_size = last_list->size ();
+
+  argument_frame call_args (args_size - 2 + last_list_size);
   for (size_t i = 1; i < args_size - 1; ++i)
   {
-    args_list->add_child (args[i]);
+    call_args[i - 1] = args[i];
   }
 
-  auto last_list = args [args_size - 1]->as_or_throw <ast_node_container_base, mal_exception_eval_not_list> ();
-  for (size_t  i = 0, e = last_list->size (); i < e; ++i)
+  for (size_t  i = 0; i < last_list_size; ++i)
   {
-    args_list->add_child ((*last_list)[i]);
+    call_args[args_size - 2 + i] = (*last_list)[i];
   }
 
-  ast retVal;
-  ast tree;
-  environment::ptr a_env;
-  std::tie (tree, a_env, retVal) = callable_node->call_tco (call_arguments {args_list.get (), 0, args_list->size ()});
-  if (retVal)
-    return retVal;
-
-  return EVAL (tree, a_env);
+  return callable_node->call_tco (call_args);
 }
 
 ///////////////////////////////
@@ -844,19 +931,12 @@ builtin_map (const call_arguments& args)
   auto callable_node = firstNode->as_or_throw<ast_node_callable, mal_exception_eval_not_callable> ();
   auto last_list = args [1]->as_or_throw <ast_node_container_base, mal_exception_eval_not_list> ();
 
+  // one slot, reused for every element
+  argument_frame call_args (1);
   auto fn = [&] (ast_node::ptr v) 
   {
-    auto args_list = mal::make_list ();
-    args_list->add_child (v);
-
-    ast retVal;
-    ast tree;
-    environment::ptr a_env;
-    std::tie (tree, a_env, retVal) = callable_node->call_tco (call_arguments {args_list.get (), 0, args_list->size ()});
-    if (retVal)
-      return retVal;
-
-    return EVAL (tree, a_env);
+    call_args[0] = v;
+    return call_to_value (callable_node, call_args);
   };
 
   auto retVal = mal::make_list ();
@@ -884,19 +964,14 @@ builtin_swap (const call_arguments& args)
   }
   auto callable_node = secondNode->as_or_throw<ast_node_callable, mal_exception_eval_not_callable> ();
 
-  auto args_list = mal::make_list ();
-  args_list->add_child (atom_node->get_value ());
+  argument_frame call_args (args_size - 1);
+  call_args[0] = atom_node->get_value ();
   for (size_t i = 2; i < args_size; ++i)
   {
-    args_list->add_child (args[i]);
+    call_args[i - 1] = args[i];
   }
 
-  ast retVal;
-  ast tree;
-  environment::ptr a_env;
-  std::tie (tree, a_env, retVal) = callable_node->call_tco (call_arguments {args_list.get (), 0, args_list->size ()});
-
-  auto newVal = retVal ? retVal : EVAL (tree, a_env);
+  auto newVal = call_to_value (callable_node, call_args);
   atom_node->set_value (newVal);
   return newVal;
 }
@@ -923,13 +998,14 @@ builtin_readline (const call_arguments& args)
 }
 
 ///////////////////////////////
-ast_node::ptr
+// a tail call as well - the form is evaluated by EVAL of the caller
+tco
 builtin_eval (const call_arguments& args, environment::ptr env)
 {
   const auto args_size = args.size ();
   if (args_size !=  1)
     raise<mal_exception_eval_invalid_arg> ();
-  return EVAL (args[0], env);
+  return tco {args[0], env, nullptr};
 }
 
 } // end of anonymous namespace
@@ -937,24 +1013,24 @@ builtin_eval (const call_arguments& args, environment::ptr env)
 ///////////////////////////////
 core::core (environment::ptr root_env)
 {
-  env_add_builtin ("+", builtin_plus);
-  env_add_builtin ("-", builtin_minus);
-  env_add_builtin ("*", builtin_mul);
-  env_add_builtin ("/", builtin_div);
-
-  env_add_builtin ("list", builtin_list);
-  env_add_builtin ("list?", builtin_is_list);
-  env_add_builtin ("empty?", builtin_is_empty);
-  env_add_builtin ("count", builtin_count);
-  env_add_builtin ("=", builtin_compare);
-
-  env_add_builtin ("<", builtin_less);
-  env_add_builtin ("<=", builtin_less_or_eq);
-  env_add_builtin (">", builtin_greater);
-  env_add_builtin (">=", builtin_greater_or_eq);
-
-  env_add_builtin ("pr-str", builtin_pr_str);
-  env_add_builtin ("str", builtin_str);
+  env_add_pure_builtin ("+", builtin_plus, binary_op::PLUS);
+  env_add_pure_builtin ("-", builtin_minus, binary_op::MINUS);
+  env_add_pure_builtin ("*", builtin_mul, binary_op::MUL);
+  env_add_pure_builtin ("/", builtin_div, binary_op::DIV);
+
+  env_add_pure_builtin ("list", builtin_list);
+  env_add_pure_builtin ("list?", builtin_is_list);
+  env_add_pure_builtin ("empty?", builtin_is_empty);
+  env_add_pure_builtin ("count", builtin_count);
+  env_add_pure_builtin ("=", builtin_compare, binary_op::EQUAL);
+
+  env_add_pure_builtin ("<", builtin_less, binary_op::LESS);
+  env_add_pure_builtin ("<=", builtin_less_or_eq, binary_op::LESS_OR_EQ);
+  env_add_pure_builtin (">", builtin_greater, binary_op::GREATER);
+  env_add_pure_builtin (">=", builtin_greater_or_eq, binary_op::GREATER_OR_EQ);
+
+  env_add_pure_builtin ("pr-str", builtin_pr_str);
+  env_add_pure_builtin ("str", builtin_str);
   env_add_builtin ("prn", builtin_prn);
   env_add_builtin ("println", builtin_println);
 
@@ -962,43 +1038,49 @@ core::core (environment::ptr root_env)
   env_add_builtin ("slurp", builtin_slurp);
 
   env_add_builtin ("atom", builtin_atom);
-  env_add_builtin ("atom?", builtin_is_atom);
+  env_add_pure_builtin ("atom?", builtin_is_atom);
   env_add_builtin ("deref", builtin_deref);
   env_add_builtin ("reset!", builtin_reset);
 
-  env_add_builtin ("cons", builtin_cons);
-  env_add_builtin ("concat", builtin_concat);
+  env_add_pure_builtin ("cons", builtin_cons);
+  env_add_pure_builtin ("concat", builtin_concat);
 
-  env_add_builtin ("nth", builtin_nth);
-  env_add_builtin ("first", builtin_first);
-  env_add_builtin ("rest", builtin_rest);
+  env_add_pure_builtin ("nth", builtin_nth);
+  env_add_pure_builtin ("first", builtin_first);
+  env_add_pure_builtin ("rest", builtin_rest);
 
   env_add_builtin ("throw", builtin_throw);
-  env_add_builtin ("symbol?", builtin_is_symbol);
-  env_add_builtin ("symbol", builtin_symbol);
-  env_add_builtin ("keyword", builtin_keyword);
-  env_add_builtin ("keyword?", builtin_is_keyword);
-  env_add_builtin ("vector", builtin_vector);
-  env_add_builtin ("vector?", builtin_is_vector);
-  env_add_builtin ("hash-map", builtin_hashmap);
-  env_add_builtin ("map?", builtin_is_hashmap);
-  env_add_builtin ("assoc", builtin_assoc);
-  env_add_builtin ("dissoc", builtin_dissoc);
-  env_add_builtin ("get", builtin_get);
-  env_add_builtin ("contains?", builtin_is_contains);
-  env_add_builtin ("keys", builtin_keys);
-  env_add_builtin ("vals", builtin_vals);
-  env_add_builtin ("vals", builtin_vals);
-  env_add_builtin ("sequential?", builtin_is_sequential);
-
-  env_add_builtin ("meta", builtin_meta);
-  env_add_builtin ("with-meta", builtin_with_meta);
+  env_add_pure_builtin ("symbol?", builtin_is_symbol);
+  env_add_pure_builtin ("symbol", builtin_symbol);
+  env_add_pure_builtin ("keyword", builtin_keyword);
+  env_add_pure_builtin ("keyword?", builtin_is_keyword);
+  env_add_pure_builtin ("vector", builtin_vector);
+  env_add_pure_builtin ("vector?", builtin_is_vector);
+  env_add_pure_builtin ("hash-map", builtin_hashmap);
+  env_add_pure_builtin ("map?", builtin_is_hashmap);
+  env_add_pure_builtin ("assoc", builtin_assoc);
+  env_add_pure_builtin ("dissoc", builtin_dissoc);
+  env_add_pure_builtin ("get", builtin_get, binary_op::GET);
+  env_add_pure_builtin ("contains?", builtin_is_contains);
+  env_add_pure_builtin ("keys", builtin_keys);
+  env_add_pure_builtin ("vals", builtin_vals);
+  env_add_pure_builtin ("vals", builtin_vals);
+  env_add_pure_builtin ("sequential?", builtin_is_sequential);
+
+  env_add_pure_builtin ("meta", builtin_meta);
+  env_add_pure_builtin ("with-meta", builtin_with_meta);
   env_add_builtin ("time-ms", builtin_timems);
-  env_add_builtin ("conj", builtin_conj);
-  env_add_builtin ("string?", builtin_is_string);
-  env_add_builtin ("seq", builtin_seq);
+  env_add_pure_builtin ("conj", builtin_conj);
+  env_add_pure_builtin ("string?", builtin_is_string);
+  env_add_pure_builtin ("seq", builtin_seq);
 
 
+  env_add_builtin ("transient", builtin_transient);
+  env_add_builtin ("conj!", builtin_conj_transient);
+  env_add_builtin ("assoc!", builtin_assoc_transient);
+  env_add_builtin ("dissoc!", builtin_dissoc_transient);
+  env_add_builtin ("persistent!", builtin_persistent);
+
   env_add_builtin ("apply", builtin_apply);
   env_add_builtin ("map", builtin_map);
   env_add_builtin ("swap!", builtin_swap);
@@ -1011,3 +1093,12 @@ core::core (environment::ptr root_env)
   }
 }
 
+
+///////////////////////////////
+core::~core ()
+{
+  for (auto&& c : m_content)
+  {
+    symbol_table::release (c.first);
+  }
+}
@@ -13,8 +13,9 @@
 class core
 {
 public:
-  using symbol_lookup_map = std::unordered_map <std::string, ast_node::ptr>;
+  using symbol_lookup_map = std::unordered_map <symbol_id, ast_node::ptr>;
   explicit core (environment::ptr root_env);
+  ~core ();
 
   const symbol_lookup_map& content () const 
   {
@@ -22,11 +23,29 @@ public:
   }
 
 private:
+  core (const core&) = delete;
+  core& operator = (const core&) = delete;
+
   //
   template <typename builtin_fn>
   void env_add_builtin (const std::string& symbol, builtin_fn fn)
   {
-  	m_content[symbol] = std::make_unique<ast_node_callable_builtin<builtin_fn>> (symbol, fn);
+    env_add (symbol, make_sp<ast_node_callable_builtin<builtin_fn>> (symbol, fn));
+  }
+
+  // see ast_node_callable_builtin_base::is_pure
+  template <typename builtin_fn>
+  void env_add_pure_builtin (const std::string& symbol, builtin_fn fn, binary_op inline_op = binary_op::NONE)
+  {
+    env_add (symbol, make_sp<ast_node_callable_builtin<builtin_fn>> (symbol, fn, true, inline_op));
+  }
+
+  void env_add (const std::string& symbol, ast_node::ptr value)
+  {
+    const symbol_id id = symbol_table::intern (symbol).id ();
+    if (m_content.count (id) == 0)
+      symbol_table::add_ref (id);
+    m_content[id] = value;
   }
 
   symbol_lookup_map m_content;
@@ -4,98 +4,247 @@
 
 #include <iostream>
 
+///////////////////////////////
+/// frame_layout class
+///////////////////////////////
+frame_layout::~frame_layout ()
+{
+  for (auto symbol : m_symbols)
+    symbol_table::release (symbol);
+}
+
+///////////////////////////////
+size_t
+frame_layout::add (symbol_id symbol)
+{
+  const int slot = slot_of (symbol);
+  if (slot >= 0)
+    return slot;
+
+  append (symbol);
+  return m_symbols.size () - 1;
+}
+
+///////////////////////////////
+void
+frame_layout::append (symbol_id symbol)
+{
+  symbol_table::add_ref (symbol);
+  m_symbols.push_back (symbol);
+}
+
+///////////////////////////////
+void
+frame_layout::destroy (const frame_layout* layout)
+{
+  delete layout;
+}
+
 ///////////////////////////////
 /// environment class
+///////////////////////////////
+std::vector<bool> environment::s_bound_nested;
+
 ///////////////////////////////
 environment::environment (hide_me, environment::const_ptr outer)
   : m_outer (outer)
 {}
 
 ///////////////////////////////
-environment::environment (hide_me, const ast_node_container_base& binds, const call_arguments& exprs, environment::const_ptr outer)
-  : m_outer (outer)
+environment::environment (hide_me, frame_layout::const_ptr layout, environment::const_ptr outer)
+  : m_slot_count (layout->size ())
+  , m_layout (std::move (layout))
+  , m_outer (outer)
 {
-  auto assign_variadic_param = [&] (size_t bind_index) 
-  {
-    assert (bind_index > 0);
+  for (size_t i = 0; i < m_slot_count; ++i)
+    new (slots () + i) ast_node::ptr ();
+}
 
-    if (bind_index + 1 != binds.size ())
-      raise<mal_exception_eval_invalid_arg> ();
+///////////////////////////////
+// the params were checked by fn*, the arguments are copied into the
+// slots. Raises before any slot is constructed
+environment::environment (hide_me, frame_layout::const_ptr layout, const call_arguments& args, environment::const_ptr outer)
+  : m_slot_count (layout->size ())
+  , m_layout (std::move (layout))
+  , m_outer (outer)
+{
+  const size_t fixed_arity = m_layout->fixed_arity ();
+  const size_t argc = args.size ();
+  auto error = ast_node_callable_lambda::arity_error (fixed_arity, m_layout->is_variadic (), argc);
+  if (!error.empty ())
+    raise<mal_exception_eval_invalid_arg> (std::move (error));
+
+  ast_node::ptr rest;
+  if (m_layout->is_variadic ())
+    rest = mal::make_list (args, fixed_arity);
+
+  size_t slot = 0;
+  for (; slot < fixed_arity; ++slot)
+    new (slots () + slot) ast_node::ptr (args[slot]);
+  if (rest)
+    new (slots () + slot++) ast_node::ptr (std::move (rest));
+  for (; slot < m_slot_count; ++slot)
+    new (slots () + slot) ast_node::ptr ();
+}
 
-    auto symbol = binds[bind_index]->template as_or_throw<ast_node_symbol, mal_exception_eval_not_symbol> ()->symbol ();
-    if (symbol == "&")
-      raise<mal_exception_eval_invalid_arg> ();
+///////////////////////////////
+environment::~environment ()
+{
+  for (auto && kv : m_data)
+    symbol_table::release (kv.first);
 
-    auto list = mal::make_list ();
-    for (size_t i = bind_index - 1, e = exprs.size (); i < e; ++i)
-    {
-      list->add_child (exprs[i]);
-    }
+  for (size_t i = 0; i < m_slot_count; ++i)
+    slots ()[i].~ast_node_ptr ();
+}
 
-    m_data[symbol] = list;
-  };
+///////////////////////////////
+// out of line - inlined, the delete trips gcc's -Wuse-after-free
+void
+environment::destroy (const environment* env)
+{
+  env->~environment ();
+  ::operator delete (const_cast<environment*> (env));
+}
 
-  //
-  for (size_t i = 0, e = binds.size (); i < e; ++i)
+///////////////////////////////
+// the binding in this frame only, nullptr if there is none
+const ast_node::ptr*
+environment::lookup_local (symbol_id symbol) const
+{
+  if (m_layout)
   {
-    auto symbol = binds[i]->template as_or_throw<ast_node_symbol, mal_exception_eval_not_symbol> ()->symbol ();
-
-    if (symbol == "&")
-    {
-      assign_variadic_param (i + 1);
-      return;
-    }
-    m_data[symbol] = exprs[i];
+    const int slot = m_layout->slot_of (symbol);
+    if (slot >= 0 && slots ()[slot])
+      return slots () + slot;
   }
 
-  if (binds.size () != exprs.size ())
-    raise<mal_exception_eval_invalid_arg> ();
+  if (m_data.empty ())
+    return nullptr;
+
+  auto it = m_data.find (symbol);
+  return it != m_data.end () ? &it->second : nullptr;
 }
 
 ///////////////////////////////
 environment::const_ptr
-environment::find (const std::string &symbol) const
+environment::find (symbol_id symbol) const
 {
-  if (m_data.count (symbol) > 0)
-    return shared_from_this ();
-  if (m_outer)
-    return m_outer->find (symbol);
+  for (const environment* env = this; env; env = env->m_outer.get ())
+  {
+    if (env->lookup_local (symbol))
+      return environment::const_ptr (env);
+  }
 
   return nullptr;
 }
 
 ///////////////////////////////
 void
-environment::set (const std::string& symbol, ast_node::ptr val)
+environment::set (symbol_id symbol, ast_node::ptr val)
 {
-  m_data[symbol] = val;
+  const int slot = m_layout ? m_layout->slot_of (symbol) : -1;
+  if (slot >= 0)
+    set_slot (slot, std::move (val));
+  else
+    bind (symbol, std::move (val));
 }
 
 ///////////////////////////////
-ast_node::ptr
-environment::get (const std::string& symbol) const
+void
+environment::bind (symbol_id symbol, ast_node::ptr val)
 {
   auto it = m_data.find (symbol);
   if (it != m_data.end ())
-    return it->second;
+  {
+    it->second = std::move (val);
+    return;
+  }
 
   if (m_outer)
-    return m_outer->get (symbol);
+  {
+    if (symbol >= s_bound_nested.size ())
+      s_bound_nested.resize (symbol + 1);
+    s_bound_nested[symbol] = true;
+  }
 
-  return nullptr;
+  symbol_table::add_ref (symbol);
+  m_data.emplace (symbol, std::move (val));
+}
+
+///////////////////////////////
+const ast_node::ptr*
+environment::root_cell (symbol_id symbol, environment::const_ptr& root) const
+{
+  const environment* env = this;
+  while (env->m_outer)
+    env = env->m_outer.get ();
+
+  auto it = env->m_data.find (symbol);
+  if (it == env->m_data.end ())
+    return nullptr;
+
+  root = environment::const_ptr (env);
+  return &it->second;
 }
 
 ///////////////////////////////
 ast_node::ptr
-environment::get_or_throw (const std::string& symbol) const
+environment::get (symbol_id symbol) const
 {
-  auto it = m_data.find (symbol);
-  if (it != m_data.end ())
-    return it->second;
+  for (const environment* env = this; env; env = env->m_outer.get ())
+  {
+    if (auto retVal = env->lookup_local (symbol))
+      return *retVal;
+  }
 
-  if (m_outer)
-    return m_outer->get_or_throw (symbol);
+  return nullptr;
+}
+
+///////////////////////////////
+ast_node::ptr
+environment::get_or_throw (symbol_id symbol) const
+{
+  for (const environment* env = this; env; env = env->m_outer.get ())
+  {
+    if (auto retVal = env->lookup_local (symbol))
+      return *retVal;
+  }
 
-  raise<mal_exception_eval_no_symbol> ("'" + symbol + "' not found");
+  raise<mal_exception_eval_no_symbol> ("'" + symbol_table::get (symbol).name () + "' not found");
   return nullptr;
 }
+
+///////////////////////////////
+environment::const_ptr
+environment::find (const std::string &symbol) const
+{
+  // not interned - nobody can have it bound
+  auto interned = symbol_table::find (symbol);
+  return interned ? find (interned->id ()) : nullptr;
+}
+
+///////////////////////////////
+void
+environment::set (const std::string& symbol, ast_node::ptr val)
+{
+  set (symbol_table::intern (symbol).id (), std::move (val));
+}
+
+///////////////////////////////
+ast_node::ptr
+environment::get (const std::string& symbol) const
+{
+  auto interned = symbol_table::find (symbol);
+  return interned ? get (interned->id ()) : nullptr;
+}
+
+///////////////////////////////
+ast_node::ptr
+environment::get_or_throw (const std::string& symbol) const
+{
+  auto interned = symbol_table::find (symbol);
+  if (!interned)
+    raise<mal_exception_eval_no_symbol> ("'" + symbol + "' not found");
+
+  return get_or_throw (interned->id ());
+}
@@ -3,53 +3,262 @@
 #include "MAL.h"
 #include "ast.h"
 #include "exceptions.h"
+#include "symbol_table.h"
 
 #include <unordered_map>
 #include <map>
-#include <memory>
+#include <vector>
 
 ///////////////////////////////
-class environment : public std::enable_shared_from_this<environment>
+// names of the slots of a frame, shared by all frames of one fn*, let* or
+// catch*. Holds a reference to every symbol it names. The layouts of the
+// lexically enclosing frames are chained through outer - the scope the
+// evaluator resolves locals in.
+class frame_layout
+{
+public:
+  using ptr = sp<frame_layout>;
+  using const_ptr = sp<const frame_layout>;
+
+  explicit frame_layout (const_ptr outer = nullptr)
+    : m_outer (std::move (outer))
+  {}
+  ~frame_layout ();
+
+  // returns the slot, a name already present keeps its slot
+  size_t add (symbol_id symbol);
+  // a new slot even if the name is present, lookups find the last one
+  void append (symbol_id symbol);
+
+  // -1 if there is no such name. Linear - layouts are short
+  int slot_of (symbol_id symbol) const
+  {
+    for (size_t i = m_symbols.size (); i > 0; --i)
+    {
+      if (m_symbols[i - 1] == symbol)
+        return static_cast<int> (i - 1);
+    }
+    return -1;
+  }
+
+  size_t size () const
+  {
+    return m_symbols.size ();
+  }
+
+  symbol_id operator [] (size_t slot) const
+  {
+    return m_symbols[slot];
+  }
+
+  // nullptr at the top level
+  const const_ptr& outer () const
+  {
+    return m_outer;
+  }
+
+  // the layout of a fn* call binds the arguments: the first fixed_arity
+  // slots take one each, a variadic fn* takes the rest as a list in the
+  // slot after them
+  void set_params (size_t fixed_arity, bool variadic)
+  {
+    m_fixed_arity = fixed_arity;
+    m_variadic = variadic;
+  }
+
+  size_t fixed_arity () const
+  {
+    return m_fixed_arity;
+  }
+
+  bool is_variadic () const
+  {
+    return m_variadic;
+  }
+
+  // a fn* analyzed inside the scope may keep a frame of the layout, so a
+  // loop must not rebind that frame in place (see code_loop)
+  void mark_captured () const
+  {
+    m_captured = true;
+  }
+
+  bool is_captured () const
+  {
+    return m_captured;
+  }
+
+private:
+  frame_layout (const frame_layout&) = delete;
+  frame_layout& operator = (const frame_layout&) = delete;
+
+  friend void intrusive_add_ref (const frame_layout* layout)
+  {
+    ++layout->m_refcount;
+  }
+
+  friend void intrusive_release (const frame_layout* layout)
+  {
+    if (--layout->m_refcount == 0)
+      destroy (layout);
+  }
+
+  static void destroy (const frame_layout* layout);
+
+  mutable uint32_t m_refcount = 0;
+  std::vector<symbol_id> m_symbols;
+  const_ptr m_outer;
+
+  size_t m_fixed_arity = 0;
+  bool m_variadic = false;
+  mutable bool m_captured = false;
+};
+
+///////////////////////////////
+// a frame is either a map frame (the root, catch* handlers) or a slot
+// frame with a fixed layout (fn* calls, let*). Slots are allocated
+// together with the frame. Slot frames still have the map for names
+// def!'ed inside them which are not part of the layout.
+class environment
 {
 private:
     struct hide_me {};
 
 public:
 
-  using ptr = std::shared_ptr<environment>;
-  using const_ptr = std::shared_ptr<const environment>;
+  using ptr = sp<environment>;
+  using const_ptr = sp<const environment>;
   //
   environment (hide_me, environment::const_ptr outer);
-  environment (hide_me, const ast_node_container_base& binds, const call_arguments& exprs, environment::const_ptr outer);
+  environment (hide_me, frame_layout::const_ptr layout, environment::const_ptr outer);
+  environment (hide_me, frame_layout::const_ptr layout, const call_arguments& args, environment::const_ptr outer);
 
 
   //
+  environment::const_ptr find (symbol_id symbol) const;
+  void set (symbol_id symbol, ast_node::ptr val);
+
+  ast_node::ptr get (symbol_id symbol) const;
+  ast_node::ptr get_or_throw (symbol_id symbol) const;
+
+  // by name
   environment::const_ptr find (const std::string &symbol) const;
   void set (const std::string& symbol, ast_node::ptr val);
 
   ast_node::ptr get (const std::string& symbol) const;
   ast_node::ptr get_or_throw (const std::string& symbol) const;
 
+  // binding cells of the root frame - the frame without outer. def! there
+  // updates the cell in place, so a pointer to it stays valid while the
+  // root lives. nullptr if the name is not bound at the root
+  const ast_node::ptr* root_cell (symbol_id symbol, environment::const_ptr& root) const;
+
+  // a frame below the root has bound the name in its map (def! inside a
+  // fn* or let*), so it may hide the root cell
+  static bool is_bound_nested (symbol_id symbol)
+  {
+    return symbol < s_bound_nested.size () && s_bound_nested[symbol];
+  }
+
+  // lexical addressing. An unset slot (a let* binding not evaluated yet)
+  // is nullptr
+  const ast_node::ptr& get_slot (size_t depth, size_t slot) const
+  {
+    const environment* env = this;
+    for (; depth > 0; --depth)
+      env = env->m_outer.get ();
+
+    assert (slot < env->m_slot_count);
+    return env->slots ()[slot];
+  }
+
+  void set_slot (size_t slot, ast_node::ptr val)
+  {
+    assert (slot < m_slot_count);
+    slots ()[slot] = std::move (val);
+  }
+
   //
   static environment::ptr make (environment::const_ptr outer = nullptr)
   {
-    return std::make_shared<environment> (hide_me{}, outer);
+    return make_frame (0, hide_me{}, outer);
+  }
+
+  static environment::ptr make (frame_layout::const_ptr layout, environment::const_ptr outer)
+  {
+    const size_t slot_count = layout->size ();
+    return make_frame (slot_count, hide_me{}, std::move (layout), outer);
   }
 
-  static environment::ptr make (const ast_node_container_base& binds, const call_arguments& exprs, environment::const_ptr outer = nullptr)
+  // the frame of a fn* call, see frame_layout::set_params
+  static environment::ptr make (frame_layout::const_ptr layout, const call_arguments& args, environment::const_ptr outer)
   {
-    return std::make_shared<environment> (hide_me{}, binds, exprs, outer);
+    const size_t slot_count = layout->size ();
+    return make_frame (slot_count, hide_me{}, std::move (layout), args, outer);
   }
 
 private:
+  ~environment ();
+
   environment(const environment&) = delete;
   environment& operator = (const environment&) = delete;
 
-  using symbol_lookup_map = std::unordered_map <std::string, ast_node::ptr>;
+  friend void intrusive_add_ref (const environment* env)
+  {
+    ++env->m_refcount;
+  }
+
+  friend void intrusive_release (const environment* env)
+  {
+    if (--env->m_refcount == 0)
+      destroy (env);
+  }
+
+  // one allocation for the frame and its slots
+  template <typename... Args>
+  static environment::ptr make_frame (size_t slot_count, Args&&... args)
+  {
+    void* storage = ::operator new (sizeof (environment) + slot_count * sizeof (ast_node::ptr));
+    try
+    {
+      return environment::ptr (new (storage) environment (std::forward<Args> (args)...));
+    }
+    catch (...)
+    {
+      ::operator delete (storage);
+      throw;
+    }
+  }
+
+  static void destroy (const environment* env);
+
+  ast_node::ptr* slots ()
+  {
+    return reinterpret_cast<ast_node::ptr*> (this + 1);
+  }
+  const ast_node::ptr* slots () const
+  {
+    return reinterpret_cast<const ast_node::ptr*> (this + 1);
+  }
+
+  // keys hold a reference to their symbol
+  void bind (symbol_id symbol, ast_node::ptr val);
+  const ast_node::ptr* lookup_local (symbol_id symbol) const;
+
+  // by symbol id, never cleared - a stale entry only costs a slow lookup
+  static std::vector<bool> s_bound_nested;
+
+  mutable uint32_t m_refcount = 0;
+  uint32_t m_slot_count = 0;
+
+  using symbol_lookup_map = std::unordered_map <symbol_id, ast_node::ptr>;
   symbol_lookup_map m_data;
+  frame_layout::const_ptr m_layout;
   environment::const_ptr m_outer;
 };
 
+static_assert (sizeof (environment) % alignof (ast_node::ptr) == 0, "slots follow the environment");
+
 ///////////////////////////////
 ast
 EVAL (ast tree, environment::ptr a_env); // fwd decl
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <string>
 
 ///////////////////////////////
@@ -14,12 +15,17 @@ enum class mal_exception_enum : uint32_t
   EVAL_ERROR_NOT_STRING,
   EVAL_ERROR_INVALID_ARGUMENT,
   EVAL_ERROR_NOT_HASHMAP,
+  EVAL_ERROR_NOT_TRANSIENT,
   EVAL_ERROR_NO_SYMBOL,
+  EVAL_ERROR_STACK_OVERFLOW,
   STOP
 };
 
 ///////////////////////////////
 template <typename T> void raise (std::string message = "");
+// the message is formatted when it is read - most errors caught inside
+// the evaluators never are
+template <typename T> void raise_deferred (std::function<std::string ()> format);
 
 ///////////////////////////////
 class mal_exception
@@ -27,6 +33,11 @@ class mal_exception
 public:
   const std::string& what () const 
   {
+    if (m_format)
+    {
+      m_message = m_format ();
+      m_format = nullptr;
+    }
     return m_message;
   }
 
@@ -34,10 +45,14 @@ protected:
   mal_exception (std::string message = "")
     : m_message (std::move (message))
   {}
+  mal_exception (std::function<std::string ()> format)
+    : m_format (std::move (format))
+  {}
   ~mal_exception () = default;
 
 private:
-  std::string m_message;
+  mutable std::string m_message;
+  mutable std::function<std::string ()> m_format;
 };
 
 ///////////////////////////////
@@ -45,6 +60,7 @@ template <mal_exception_enum t>
 class mal_exception_impl : public mal_exception
 {
 friend void raise<mal_exception_impl<t>> (std::string message);
+friend void raise_deferred<mal_exception_impl<t>> (std::function<std::string ()> format);
 public:
   ~mal_exception_impl () = default;
 
@@ -52,6 +68,9 @@ private:
   mal_exception_impl (std::string message = "")
     : mal_exception (std::move (message))
   {}
+  mal_exception_impl (std::function<std::string ()> format)
+    : mal_exception (std::move (format))
+  {}
 
   std::string m_message;
 };
@@ -67,6 +86,8 @@ using mal_exception_eval_not_symbol = mal_exception_impl<mal_exception_enum::EVA
 using mal_exception_eval_invalid_arg = mal_exception_impl<mal_exception_enum::EVAL_ERROR_INVALID_ARGUMENT>;
 using mal_exception_eval_no_symbol = mal_exception_impl<mal_exception_enum::EVAL_ERROR_NO_SYMBOL>;
 using mal_exception_eval_not_hashmap = mal_exception_impl<mal_exception_enum::EVAL_ERROR_NOT_HASHMAP>;
+using mal_exception_eval_not_transient = mal_exception_impl<mal_exception_enum::EVAL_ERROR_NOT_TRANSIENT>;
+using mal_exception_eval_stack_overflow = mal_exception_impl<mal_exception_enum::EVAL_ERROR_STACK_OVERFLOW>;
 using mal_exception_stop = mal_exception_impl<mal_exception_enum::STOP>;
 
 ///////////////////////////////
@@ -75,3 +96,10 @@ void raise (std::string message)
 {
   throw T (std::move (message));
 }
+
+///////////////////////////////
+template <typename T>
+void raise_deferred (std::function<std::string ()> format)
+{
+  throw T (std::move (format));
+}
@@ -0,0 +1,424 @@
+#pragma once
+
+#include "pointer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include <assert.h>
+
+///////////////////////////////
+// persistent hash array mapped trie. Each level takes the next BITS bits
+// of the hash: a node keeps a bitmap of the slots holding an entry and one
+// of the slots holding a child, with both arrays compressed to the bits
+// set. Keys whose hashes are equal in all bits share a collision node
+// below the last level. A node another trie may reach is never changed -
+// an update copies the path from the root and shares everything else, so
+// a copy of the map is one reference. Only a path this trie alone holds,
+// every node on it referred to once, is changed in place by insert: the
+// path copied by the last update, while no copy was made since. The shape
+// depends on the keys only, not on the order they came in.
+//
+// Hash and Eq are default constructible function objects, Hash returns
+// uint32_t.
+template <typename K, typename V, typename Hash, typename Eq>
+class hash_trie
+{
+public:
+  static constexpr uint32_t BITS = 5;
+  static constexpr uint32_t MASK = (uint32_t (1) << BITS) - 1;
+
+  size_t size () const
+  {
+    return m_size;
+  }
+
+  // nullptr if there is no such key
+  const V* find (const K& key) const
+  {
+    const uint32_t hash = Hash () (key);
+    const node* n = m_root.get ();
+    for (uint32_t shift = 0; n; shift += BITS)
+    {
+      if (shift >= HASH_BITS)
+      {
+        for (uint32_t i = 0; i < n->entry_count; ++i)
+        {
+          if (Eq () (n->entries ()[i].key, key))
+            return &n->entries ()[i].value;
+        }
+        return nullptr;
+      }
+
+      const uint32_t bit = bit_of (hash, shift);
+      if (n->datamap & bit)
+      {
+        const entry& e = n->entries ()[index_of (n->datamap, bit)];
+        return Eq () (e.key, key) ? &e.value : nullptr;
+      }
+      if (!(n->nodemap & bit))
+        return nullptr;
+
+      n = n->children ()[index_of (n->nodemap, bit)].get ();
+    }
+    return nullptr;
+  }
+
+  // adds the key or replaces its value
+  void insert (const K& key, const V& value)
+  {
+    const uint32_t hash = Hash () (key);
+    if (!m_root)
+    {
+      m_root = make_node (bit_of (hash, 0), 0, 1, 0, [&] (entry* entries, node_ptr*) { entries[0] = entry{key, value}; });
+      m_size = 1;
+      return;
+    }
+
+    bool added = false;
+    m_root = insert (m_root.get (), true, 0, hash, key, value, added);
+    if (added)
+      ++m_size;
+  }
+
+  void erase (const K& key)
+  {
+    if (!m_root)
+      return;
+
+    node_ptr root = erase (m_root.get (), 0, Hash () (key), key);
+    if (root == m_root)
+      return;
+
+    m_root = std::move (root);
+    --m_size;
+  }
+
+  // fn (const K&, const V&) for every entry
+  template <typename Fn>
+  void for_each (const Fn& fn) const
+  {
+    if (m_root)
+      for_each (m_root.get (), fn);
+  }
+
+private:
+  static constexpr uint32_t HASH_BITS = 32;
+
+  struct node;
+  using node_ptr = sp<const node>;
+
+  struct entry
+  {
+    K key;
+    V value;
+  };
+
+  // allocated together with its entries, followed by its children. A
+  // collision node has entries only, with both bitmaps empty
+  struct alignas (alignof (entry)) node
+  {
+    mutable uint32_t refcount = 0;
+    uint32_t datamap = 0;
+    uint32_t nodemap = 0;
+    uint32_t entry_count = 0;
+    uint32_t child_count = 0;
+
+    entry* entries ()
+    {
+      return reinterpret_cast<entry*> (this + 1);
+    }
+    const entry* entries () const
+    {
+      return reinterpret_cast<const entry*> (this + 1);
+    }
+
+    node_ptr* children ()
+    {
+      return reinterpret_cast<node_ptr*> (entries () + entry_count);
+    }
+    const node_ptr* children () const
+    {
+      return reinterpret_cast<const node_ptr*> (entries () + entry_count);
+    }
+
+    friend void intrusive_add_ref (const node* n)
+    {
+      ++n->refcount;
+    }
+
+    friend void intrusive_release (const node* n)
+    {
+      if (--n->refcount != 0)
+        return;
+
+      node* self = const_cast<node*> (n);
+      for (uint32_t i = 0; i < self->entry_count; ++i)
+        self->entries ()[i].~entry ();
+      for (uint32_t i = 0; i < self->child_count; ++i)
+        self->children ()[i].~node_ptr ();
+
+      self->~node ();
+      ::operator delete (self);
+    }
+  };
+
+  static_assert (sizeof (node) % alignof (node_ptr) == 0, "children follow the entries");
+
+  static uint32_t bit_of (uint32_t hash, uint32_t shift)
+  {
+    return uint32_t (1) << ((hash >> shift) & MASK);
+  }
+
+  // position in the compressed array of the slot of bit
+  static uint32_t index_of (uint32_t map, uint32_t bit)
+  {
+    return __builtin_popcount (map & (bit - 1));
+  }
+
+  // one allocation, fill (entry*, node_ptr*) sets the entries and children
+  template <typename Fill>
+  static node_ptr make_node (uint32_t datamap, uint32_t nodemap, uint32_t entry_count, uint32_t child_count, const Fill& fill)
+  {
+    void* storage = ::operator new (sizeof (node) + entry_count * sizeof (entry) + child_count * sizeof (node_ptr));
+    node* n = new (storage) node;
+    n->datamap = datamap;
+    n->nodemap = nodemap;
+    n->entry_count = entry_count;
+    n->child_count = child_count;
+    for (uint32_t i = 0; i < entry_count; ++i)
+      new (&n->entries ()[i]) entry ();
+    for (uint32_t i = 0; i < child_count; ++i)
+      new (&n->children ()[i]) node_ptr ();
+
+    fill (n->entries (), n->children ());
+    return node_ptr (n);
+  }
+
+  // n with the entries and children copied, the entry at index changed
+  static node_ptr with_value (const node* n, uint32_t index, const V& value)
+  {
+    return make_node (n->datamap, n->nodemap, n->entry_count, n->child_count, [&] (entry* entries, node_ptr* children)
+    {
+      for (uint32_t i = 0; i < n->entry_count; ++i)
+        entries[i] = n->entries ()[i];
+      for (uint32_t i = 0; i < n->child_count; ++i)
+        children[i] = n->children ()[i];
+      entries[index].value = value;
+    });
+  }
+
+  // n itself, the entry at index changed in place - no other trie has n
+  static node_ptr set_value (const node* n, uint32_t index, const V& value)
+  {
+    const_cast<node*> (n)->entries ()[index].value = value;
+    return node_ptr (n);
+  }
+
+  static node_ptr with_child (const node* n, uint32_t index, node_ptr child)
+  {
+    return make_node (n->datamap, n->nodemap, n->entry_count, n->child_count, [&] (entry* entries, node_ptr* children)
+    {
+      for (uint32_t i = 0; i < n->entry_count; ++i)
+        entries[i] = n->entries ()[i];
+      for (uint32_t i = 0; i < n->child_count; ++i)
+        children[i] = n->children ()[i];
+      children[index] = std::move (child);
+    });
+  }
+
+  // a new entry in the slot of bit - bit 0 appends to a collision node
+  static node_ptr with_entry (const node* n, uint32_t bit, const K& key, const V& value)
+  {
+    const uint32_t index = bit ? index_of (n->datamap, bit) : n->entry_count;
+    return make_node (n->datamap | bit, n->nodemap, n->entry_count + 1, n->child_count, [&] (entry* entries, node_ptr* children)
+    {
+      for (uint32_t i = 0; i < index; ++i)
+        entries[i] = n->entries ()[i];
+      entries[index] = entry{key, value};
+      for (uint32_t i = index; i < n->entry_count; ++i)
+        entries[i + 1] = n->entries ()[i];
+      for (uint32_t i = 0; i < n->child_count; ++i)
+        children[i] = n->children ()[i];
+    });
+  }
+
+  // bit 0 removes from a collision node
+  static node_ptr without_entry (const node* n, uint32_t bit, uint32_t index)
+  {
+    return make_node (n->datamap & ~bit, n->nodemap, n->entry_count - 1, n->child_count, [&] (entry* entries, node_ptr* children)
+    {
+      for (uint32_t i = 0; i < index; ++i)
+        entries[i] = n->entries ()[i];
+      for (uint32_t i = index + 1; i < n->entry_count; ++i)
+        entries[i - 1] = n->entries ()[i];
+      for (uint32_t i = 0; i < n->child_count; ++i)
+        children[i] = n->children ()[i];
+    });
+  }
+
+  // the entry in the slot of bit moves down into child
+  static node_ptr entry_to_child (const node* n, uint32_t bit, node_ptr child)
+  {
+    const uint32_t entry_index = index_of (n->datamap, bit);
+    const uint32_t child_index = index_of (n->nodemap, bit);
+    return make_node (n->datamap & ~bit, n->nodemap | bit, n->entry_count - 1, n->child_count + 1, [&] (entry* entries, node_ptr* children)
+    {
+      for (uint32_t i = 0; i < entry_index; ++i)
+        entries[i] = n->entries ()[i];
+      for (uint32_t i = entry_index + 1; i < n->entry_count; ++i)
+        entries[i - 1] = n->entries ()[i];
+      for (uint32_t i = 0; i < child_index; ++i)
+        children[i] = n->children ()[i];
+      children[child_index] = std::move (child);
+      for (uint32_t i = child_index; i < n->child_count; ++i)
+        children[i + 1] = n->children ()[i];
+    });
+  }
+
+  // the child in the slot of bit is left with one entry, which moves up
+  static node_ptr child_to_entry (const node* n, uint32_t bit, const entry& e)
+  {
+    const uint32_t entry_index = index_of (n->datamap, bit);
+    const uint32_t child_index = index_of (n->nodemap, bit);
+    return make_node (n->datamap | bit, n->nodemap & ~bit, n->entry_count + 1, n->child_count - 1, [&] (entry* entries, node_ptr* children)
+    {
+      for (uint32_t i = 0; i < entry_index; ++i)
+        entries[i] = n->entries ()[i];
+      entries[entry_index] = e;
+      for (uint32_t i = entry_index; i < n->entry_count; ++i)
+        entries[i + 1] = n->entries ()[i];
+      for (uint32_t i = 0; i < child_index; ++i)
+        children[i] = n->children ()[i];
+      for (uint32_t i = child_index + 1; i < n->child_count; ++i)
+        children[i - 1] = n->children ()[i];
+    });
+  }
+
+  // a node at shift holding two entries of different keys
+  static node_ptr merge (const entry& e1, uint32_t hash1, const entry& e2, uint32_t hash2, uint32_t shift)
+  {
+    if (shift >= HASH_BITS)
+      return make_node (0, 0, 2, 0, [&] (entry* entries, node_ptr*) { entries[0] = e1; entries[1] = e2; });
+
+    const uint32_t bit1 = bit_of (hash1, shift);
+    const uint32_t bit2 = bit_of (hash2, shift);
+    if (bit1 == bit2)
+    {
+      node_ptr child = merge (e1, hash1, e2, hash2, shift + BITS);
+      return make_node (0, bit1, 0, 1, [&] (entry*, node_ptr* children) { children[0] = std::move (child); });
+    }
+
+    return make_node (bit1 | bit2, 0, 2, 0, [&] (entry* entries, node_ptr*)
+    {
+      entries[bit1 < bit2 ? 0 : 1] = e1;
+      entries[bit1 < bit2 ? 1 : 0] = e2;
+    });
+  }
+
+  // owned if the node above n is referred to once, up to the root
+  static node_ptr insert (const node* n, bool owned, uint32_t shift, uint32_t hash, const K& key, const V& value, bool& added)
+  {
+    owned = owned && n->refcount == 1;
+    if (shift >= HASH_BITS)
+    {
+      for (uint32_t i = 0; i < n->entry_count; ++i)
+      {
+        if (Eq () (n->entries ()[i].key, key))
+          return owned ? set_value (n, i, value) : with_value (n, i, value);
+      }
+      added = true;
+      return with_entry (n, 0, key, value);
+    }
+
+    const uint32_t bit = bit_of (hash, shift);
+    if (n->datamap & bit)
+    {
+      const uint32_t index = index_of (n->datamap, bit);
+      const entry& e = n->entries ()[index];
+      if (Eq () (e.key, key))
+        return owned ? set_value (n, index, value) : with_value (n, index, value);
+
+      added = true;
+      return entry_to_child (n, bit, merge (e, Hash () (e.key), entry{key, value}, hash, shift + BITS));
+    }
+
+    if (n->nodemap & bit)
+    {
+      const uint32_t index = index_of (n->nodemap, bit);
+      node_ptr child = insert (n->children ()[index].get (), owned, shift + BITS, hash, key, value, added);
+      if (!owned)
+        return with_child (n, index, std::move (child));
+
+      const_cast<node*> (n)->children ()[index] = std::move (child);
+      return node_ptr (n);
+    }
+
+    added = true;
+    return with_entry (n, bit, key, value);
+  }
+
+  // n itself if there is no such key, nullptr if nothing is left of it.
+  // A node below the root is left with two entries at least - one with a
+  // single entry is folded into its parent
+  static node_ptr erase (const node* n, uint32_t shift, uint32_t hash, const K& key)
+  {
+    if (shift >= HASH_BITS)
+    {
+      for (uint32_t i = 0; i < n->entry_count; ++i)
+      {
+        if (Eq () (n->entries ()[i].key, key))
+          return n->entry_count == 1 ? nullptr : without_entry (n, 0, i);
+      }
+      return node_ptr (n);
+    }
+
+    const uint32_t bit = bit_of (hash, shift);
+    if (n->datamap & bit)
+    {
+      const uint32_t index = index_of (n->datamap, bit);
+      if (!Eq () (n->entries ()[index].key, key))
+        return node_ptr (n);
+
+      if (n->entry_count == 1 && n->child_count == 0)
+        return nullptr;
+      return without_entry (n, bit, index);
+    }
+
+    if (n->nodemap & bit)
+    {
+      const uint32_t index = index_of (n->nodemap, bit);
+      const node* child = n->children ()[index].get ();
+      node_ptr rest = erase (child, shift + BITS, hash, key);
+      if (rest.get () == child)
+        return node_ptr (n);
+
+      assert (rest);
+      if (rest->entry_count == 1 && rest->child_count == 0)
+        return child_to_entry (n, bit, rest->entries ()[0]);
+      return with_child (n, index, std::move (rest));
+    }
+
+    return node_ptr (n);
+  }
+
+  template <typename Fn>
+  static void for_each (const node* n, const Fn& fn)
+  {
+    for (uint32_t i = 0; i < n->entry_count; ++i)
+      fn (n->entries ()[i].key, n->entries ()[i].value);
+    for (uint32_t i = 0; i < n->child_count; ++i)
+      for_each (n->children ()[i].get (), fn);
+  }
+
+  node_ptr m_root;
+  size_t m_size = 0;
+};
+
+template <typename K, typename V, typename Hash, typename Eq>
+constexpr uint32_t hash_trie<K, V, Hash, Eq>::BITS;
+template <typename K, typename V, typename Hash, typename Eq>
+constexpr uint32_t hash_trie<K, V, Hash, Eq>::MASK;
+template <typename K, typename V, typename Hash, typename Eq>
+constexpr uint32_t hash_trie<K, V, Hash, Eq>::HASH_BITS;
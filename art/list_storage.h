@@ -0,0 +1,112 @@
+#pragma once
+
+#include "pointer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include <assert.h>
+
+///////////////////////////////
+// a block of elements filled from the back, shared by the lists cons and
+// rest make - each of them is a range of the block, the elements after
+// the range are those of the list it was consed onto. The slots before
+// the first element taken are free: a cons onto the range starting right
+// there takes the slot before it in place. Any other cons starts a new
+// block, so cons never copies. A slot is set once, when it is taken, and
+// never changes after - the elements a block holds for lists gone since
+// are at most as many as its capacity.
+template <typename T>
+class list_storage
+{
+public:
+  using ptr = sp<list_storage>;
+  using const_ptr = sp<const list_storage>;
+
+  // capacity free slots
+  static ptr make (size_t capacity)
+  {
+    static_assert (sizeof (list_storage) % alignof (T) == 0, "slots follow the storage");
+    void* storage = ::operator new (sizeof (list_storage) + capacity * sizeof (T));
+    auto retVal = new (storage) list_storage (capacity);
+    for (size_t i = 0; i < capacity; ++i)
+      new (&retVal->slots ()[i]) T ();
+    return ptr (retVal);
+  }
+
+  const T* end () const
+  {
+    return slots () + m_capacity;
+  }
+
+  size_t capacity () const
+  {
+    return m_capacity;
+  }
+
+  // a full block, begin the first slot of the range of the newest list:
+  // true for the first cons onto it, which starts a larger block then
+  bool grow_from (const T* begin) const
+  {
+    if (m_first != 0 || begin != slots () || m_grown)
+      return false;
+
+    m_grown = true;
+    return true;
+  }
+
+  // the count slots right before begin, taken for the caller to set.
+  // nullptr if a range took them before or there are not as many
+  T* take_before (const T* begin, size_t count) const
+  {
+    assert (begin >= slots () + m_first && begin <= end ());
+    if (begin != slots () + m_first || m_first < count)
+      return nullptr;
+
+    m_first -= count;
+    return const_cast<T*> (slots ()) + m_first;
+  }
+
+private:
+  explicit list_storage (size_t capacity)
+    : m_capacity (capacity)
+    , m_first (capacity)
+  {}
+
+  list_storage (const list_storage&) = delete;
+  list_storage& operator = (const list_storage&) = delete;
+
+  friend void intrusive_add_ref (const list_storage* storage)
+  {
+    ++storage->m_refcount;
+  }
+
+  friend void intrusive_release (const list_storage* storage)
+  {
+    if (--storage->m_refcount != 0)
+      return;
+
+    auto self = const_cast<list_storage*> (storage);
+    for (size_t i = 0; i < self->m_capacity; ++i)
+      self->slots ()[i].~T ();
+
+    self->~list_storage ();
+    ::operator delete (self);
+  }
+
+  T* slots ()
+  {
+    return reinterpret_cast<T*> (this + 1);
+  }
+  const T* slots () const
+  {
+    return reinterpret_cast<const T*> (this + 1);
+  }
+
+  mutable uint32_t m_refcount = 0;
+  const size_t m_capacity;
+  // the first slot taken, m_capacity while none is
+  mutable size_t m_first;
+  mutable bool m_grown = false;
+};
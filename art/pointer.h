@@ -1,14 +1,66 @@
 #pragma once
 
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
 ///////////////////////////////
+// intrusive smart pointer. The pointee keeps its own (non-atomic) counter,
+// found through the free functions
+//   void intrusive_add_ref (const T*);
+//   void intrusive_release (const T*);
+// so a copy is a plain increment and the pointer is a single word.
 template <typename T>
 class sp
 {
 public:
+	sp () = default;
+
+	sp (std::nullptr_t)
+	{}
+
 	sp (T* p)
 		: m_pointee (p)
+	{
+		if (m_pointee)
+			intrusive_add_ref (m_pointee);
+	}
+
+	sp (const sp& other)
+		: sp (other.m_pointee)
+	{}
+
+	sp (sp&& other) noexcept
+		: m_pointee (other.detach ())
 	{}
 
+	template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	sp (const sp<U>& other)
+		: sp (other.get ())
+	{}
+
+	template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	sp (sp<U>&& other) noexcept
+		: m_pointee (other.detach ())
+	{}
+
+	~sp ()
+	{
+		if (m_pointee)
+			intrusive_release (m_pointee);
+	}
+
+	sp& operator = (sp other) noexcept
+	{
+		std::swap (m_pointee, other.m_pointee);
+		return *this;
+	}
+
+	T* get () const
+	{
+		return m_pointee;
+	}
+
 	T* operator -> () const
 	{
 		return m_pointee;
@@ -19,11 +71,60 @@ public:
 		return *m_pointee;
 	}
 
-	operator T* () const
+	explicit operator bool () const
 	{
-		return m_pointee;
+		return m_pointee != nullptr;
+	}
+
+	void reset ()
+	{
+		sp ().swap (*this);
+	}
+
+	void swap (sp& other) noexcept
+	{
+		std::swap (m_pointee, other.m_pointee);
+	}
+
+	// gives up the reference without releasing it
+	T* detach () noexcept
+	{
+		T* retVal = m_pointee;
+		m_pointee = nullptr;
+		return retVal;
 	}
 
 private:
 	T* m_pointee = nullptr;
 };
+
+template <typename T, typename U>
+bool operator == (const sp<T>& lhs, const sp<U>& rhs)
+{
+	return lhs.get () == rhs.get ();
+}
+
+template <typename T, typename U>
+bool operator != (const sp<T>& lhs, const sp<U>& rhs)
+{
+	return lhs.get () != rhs.get ();
+}
+
+template <typename T>
+bool operator == (const sp<T>& lhs, std::nullptr_t)
+{
+	return !lhs;
+}
+
+template <typename T>
+bool operator != (const sp<T>& lhs, std::nullptr_t)
+{
+	return !!lhs;
+}
+
+///////////////////////////////
+template <typename T, typename... Args>
+sp<T> make_sp (Args&&... args)
+{
+	return sp<T> (new T (std::forward<Args> (args)...));
+}
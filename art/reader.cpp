@@ -118,12 +118,12 @@ private:
   //
   void expand_normal_parse_fn (char ch)
   {
-    auto make_basic_reader_macro = [] (const std::string &symbolName)
+    auto make_basic_reader_macro = [this] (const std::string &symbolName)
     {
-      return [symbolName] (ast_node_container_base* listToModify, size_t listIdx) -> void
+      return [this, symbolName] (ast_node_container_base* listToModify, size_t listIdx) -> void
         {
-          auto newNode = mal::make_list ();
-          newNode->add_child (mal::make_symbol (symbolName));
+          auto newNode = make_sp<ast_node_list> ();
+          newNode->add_child (make_sp<ast_node_symbol> (symbolName));
           newNode->add_child ((*listToModify) [listIdx]);
           listToModify->replace (listIdx, newNode);
         };
@@ -134,13 +134,13 @@ private:
       case '^':
       {
         m_last_delim_position = m_current_position;
-        auto with_meta_fn = [] (ast_node_container_base* listToModify, size_t listIdx) -> void
+        auto with_meta_fn = [this] (ast_node_container_base* listToModify, size_t listIdx) -> void
         {
           if (listIdx + 1 >= listToModify->size ())
             raise<mal_exception_parse_error> (listToModify->to_string ());
 
-          auto newNode = mal::make_list ();
-          newNode->add_child (mal::make_symbol ("with-meta"));
+          auto newNode = make_sp<ast_node_list> ();
+          newNode->add_child (make_sp<ast_node_symbol> ("with-meta"));
           newNode->add_child ((*listToModify) [listIdx + 1]);
           newNode->add_child ((*listToModify) [listIdx]);
           listToModify->replace (listIdx, newNode);
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <assert.h>
+
+///////////////////////////////
+// contiguous sequence with inline storage for the first INLINE_COUNT
+// elements; heap storage is allocated only when it grows beyond.
+template <typename T, size_t INLINE_COUNT>
+class small_vector
+{
+public:
+  using value_type = T;
+  using iterator = T*;
+  using const_iterator = const T*;
+
+  small_vector () = default;
+
+  small_vector (const small_vector& other)
+  {
+    reserve (other.m_size);
+    for (auto && v : other)
+      push_back (v);
+  }
+
+  ~small_vector ()
+  {
+    clear ();
+    release_storage ();
+  }
+
+  size_t size () const
+  {
+    return m_size;
+  }
+
+  bool empty () const
+  {
+    return m_size == 0;
+  }
+
+  size_t capacity () const
+  {
+    return m_capacity;
+  }
+
+  T* data ()
+  {
+    return m_data;
+  }
+  const T* data () const
+  {
+    return m_data;
+  }
+
+  iterator begin ()
+  {
+    return m_data;
+  }
+  iterator end ()
+  {
+    return m_data + m_size;
+  }
+  const_iterator begin () const
+  {
+    return m_data;
+  }
+  const_iterator end () const
+  {
+    return m_data + m_size;
+  }
+
+  T& operator [] (size_t index)
+  {
+    assert (index < m_size);
+    return m_data[index];
+  }
+  const T& operator [] (size_t index) const
+  {
+    assert (index < m_size);
+    return m_data[index];
+  }
+
+  T& back ()
+  {
+    assert (m_size > 0);
+    return m_data[m_size - 1];
+  }
+
+  void push_back (T value)
+  {
+    if (m_size == m_capacity)
+      grow (m_capacity * 2);
+
+    new (m_data + m_size) T (std::move (value));
+    ++m_size;
+  }
+
+  void pop_back ()
+  {
+    assert (m_size > 0);
+    --m_size;
+    m_data[m_size].~T ();
+  }
+
+  iterator erase (iterator pos)
+  {
+    assert (pos >= begin () && pos < end ());
+    std::move (pos + 1, end (), pos);
+    pop_back ();
+    return pos;
+  }
+
+  void clear ()
+  {
+    for (size_t i = 0; i < m_size; ++i)
+      m_data[i].~T ();
+    m_size = 0;
+  }
+
+  void reserve (size_t capacity)
+  {
+    if (capacity > m_capacity)
+      grow (capacity);
+  }
+
+private:
+  small_vector& operator = (const small_vector&) = delete;
+
+  T* inline_data ()
+  {
+    return reinterpret_cast<T*> (&m_inline);
+  }
+
+  void grow (size_t capacity)
+  {
+    T* new_data = static_cast<T*> (::operator new (capacity * sizeof (T)));
+    for (size_t i = 0; i < m_size; ++i)
+    {
+      new (new_data + i) T (std::move (m_data[i]));
+      m_data[i].~T ();
+    }
+    release_storage ();
+
+    m_data = new_data;
+    m_capacity = static_cast<uint32_t> (capacity);
+  }
+
+  void release_storage ()
+  {
+    if (m_data != inline_data ())
+      ::operator delete (m_data);
+  }
+
+  T* m_data = inline_data ();
+  uint32_t m_size = 0;
+  uint32_t m_capacity = INLINE_COUNT;
+  typename std::aligned_storage<sizeof (T) * INLINE_COUNT, alignof (T)>::type m_inline;
+};
@@ -0,0 +1,41 @@
+#include "stack_guard.h"
+#include "exceptions.h"
+
+#include <sys/resource.h>
+
+namespace
+{
+  // if the size is not limited
+  constexpr uintptr_t DEFAULT_STACK_SIZE = 8 * 1024 * 1024;
+  constexpr uintptr_t MIN_RESERVE = 256 * 1024;
+
+  ///////////////////////////////
+  // a quarter of the stack is kept for unwinding. The stack grows down
+  // from about where static initialization runs
+  uintptr_t
+  stack_limit ()
+  {
+    uintptr_t size = DEFAULT_STACK_SIZE;
+    rlimit rl;
+    if (getrlimit (RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+      size = rl.rlim_cur;
+
+    uintptr_t reserve = size / 4;
+    if (reserve < MIN_RESERVE && size >= 2 * MIN_RESERVE)
+      reserve = MIN_RESERVE;
+
+    const uintptr_t usable = size - reserve;
+    const uintptr_t top = reinterpret_cast<uintptr_t> (__builtin_frame_address (0));
+    return top > usable ? top - usable : 0;
+  }
+}
+
+///////////////////////////////
+uintptr_t stack_guard::limit = stack_limit ();
+
+///////////////////////////////
+void
+stack_guard::overflow ()
+{
+  raise<mal_exception_eval_stack_overflow> ("stack overflow");
+}
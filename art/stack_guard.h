@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+///////////////////////////////
+// the evaluators recurse on the C++ stack for calls which are not tail
+// calls (and the vm for builtins and macros calling back into it). The
+// guard raises a mal error while enough of the stack is left to unwind
+// and to run the catch* handlers, instead of letting the process crash.
+namespace stack_guard
+{
+  // the lowest address the stack may grow to, set when the program starts
+  extern uintptr_t limit;
+
+  inline bool exhausted ()
+  {
+    return reinterpret_cast<uintptr_t> (__builtin_frame_address (0)) < limit;
+  }
+
+  // raises mal_exception_eval_stack_overflow
+  void overflow ();
+
+  inline void check ()
+  {
+    if (exhausted ())
+      overflow ();
+  }
+}
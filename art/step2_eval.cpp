@@ -12,6 +12,7 @@
 #include <cstdio>
 #include <iostream>
 #include <string>
+#include <tuple>
 
 static const char* PROMPT = "user> ";
 
@@ -59,7 +60,13 @@ apply (const ast_node_list* callable_list)
 
     auto && callable_node = (*callable_list)[0]->as_or_throw<ast_node_callable, mal_exception_eval_not_callable> ();
 
-    return std::get<2> (callable_node->call_tco (call_arguments (callable_list, 1, list_size - 1)));
+    ast tree;
+    environment::ptr env;
+    ast retVal;
+    std::tie (tree, env, retVal) = callable_node->call_tco (call_arguments (callable_list, 1, list_size - 1));
+
+    // apply and eval continue with a tree
+    return retVal ? retVal : EVAL (tree, env);
 }
 
 ///////////////////////////////
@@ -91,13 +98,17 @@ EVAL (ast tree, environment::ptr a_env)
 ast
 eval_ast (ast node, environment::ptr a_env)
 {
+    // a literal of constants is its own value, see is_constant_literal
+    if (is_constant_literal (node))
+        return node;
+
     switch (node->type ())
     {
     case node_type_enum::SYMBOL:
         {
             // as_or_throw ?
             const auto& node_symbol = node->as<ast_node_symbol> ();
-            return a_env->get_or_throw (node_symbol->symbol ());
+            return a_env->get_or_throw (node_symbol->id ());
         }
     case node_type_enum::LIST:
         {
@@ -12,6 +12,7 @@
 #include <cstdio>
 #include <iostream>
 #include <string>
+#include <tuple>
 
 ///////////////////////////////
 std::string 
@@ -57,7 +58,13 @@ apply (const ast_node_list* callable_list)
 
   auto && callable_node = (*callable_list)[0]->as_or_throw<ast_node_callable, mal_exception_eval_not_callable> ();
 
-  return std::get<2> (callable_node->call_tco (call_arguments (callable_list, 1, list_size - 1)));
+  ast tree;
+  environment::ptr env;
+  ast retVal;
+  std::tie (tree, env, retVal) = callable_node->call_tco (call_arguments (callable_list, 1, list_size - 1));
+
+  // apply and eval continue with a tree
+  return retVal ? retVal : EVAL (tree, env);
 }
 
 ///////////////////////////////
@@ -85,7 +92,7 @@ EVAL (ast tree, environment::ptr a_env)
   {
     // not as_or_throw - we know the type
     const auto first_symbol = first->as<ast_node_symbol> ();
-    const auto& symbol = first_symbol->symbol ();
+    const auto symbol = first_symbol->id ();
 
     //
     auto fn_handle_def = [root_list, &a_env]()
@@ -93,7 +100,7 @@ EVAL (ast tree, environment::ptr a_env)
       if (root_list->size () != 3)
         raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
 
-      const auto& key = (*root_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol ();
+      const auto key = (*root_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
 
       ast_node::ptr value = EVAL ((*root_list)[2], a_env);
       a_env->set (key, value);
@@ -128,7 +135,7 @@ EVAL (ast tree, environment::ptr a_env)
       
       for (size_t i = 0, e = let_bindings->size(); i < e; i += 2)
       {
-        const auto& key = (*let_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol ();
+        const auto key = (*let_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
         ast_node::ptr value = EVAL ((*let_bindings)[i + 1], let_env);
 
         let_env->set (key, value);
@@ -138,11 +145,11 @@ EVAL (ast tree, environment::ptr a_env)
     };
 
 
-    if (symbol == "def!")
+    if (symbol == SYMBOL_DEF)
     {
       return fn_handle_def ();
     }
-    else if (symbol == "let*")
+    else if (symbol == SYMBOL_LET)
     {
       return fn_handle_let ();
     }
@@ -159,6 +166,10 @@ EVAL (ast tree, environment::ptr a_env)
 ast
 eval_ast (ast tree, environment::ptr a_env)
 {
+  // a literal of constants is its own value, see is_constant_literal
+  if (is_constant_literal (tree))
+    return tree;
+
   auto fn_handle_container = [&a_env](const ast_node_container_base* container)
   {
     // TODO - add here optimization to do not clone underlying node if the current pointer is unique!
@@ -171,7 +182,7 @@ eval_ast (ast tree, environment::ptr a_env)
     {
       // not as_or_throw - we know the type
       const auto& node_symbol = tree->as<ast_node_symbol> ();
-      return a_env->get_or_throw (node_symbol->symbol ());
+      return a_env->get_or_throw (node_symbol->id ());
 
     }
   case node_type_enum::LIST:
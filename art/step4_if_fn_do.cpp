@@ -104,7 +104,7 @@ EVAL (ast tree, environment::ptr a_env)
     if (root_list->size () != 3)
       raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
 
-    const auto& key = (*root_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol ();
+    const auto key = (*root_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
 
     ast_node::ptr value = EVAL ((*root_list)[2], a_env);
     a_env->set (key, value);
@@ -137,7 +137,7 @@ EVAL (ast tree, environment::ptr a_env)
     
     for (size_t i = 0, e = let_bindings->size(); i < e; i += 2)
     {
-      const auto& key = (*let_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol ();
+      const auto key = (*let_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
       ast_node::ptr value = EVAL ((*let_bindings)[i + 1], let_env);
 
       let_env->set (key, value);
@@ -186,7 +186,7 @@ EVAL (ast tree, environment::ptr a_env)
     auto&& bindsNode = (*root_list)[1];
     auto&& astNode = (*root_list)[2];
 
-    ast_node::ptr retVal = std::make_shared<ast_node_callable_lambda> (bindsNode, astNode, a_env);
+    ast_node::ptr retVal = make_sp<ast_node_callable_lambda> (bindsNode, astNode, a_env);
     return retVal;
   };
 
@@ -196,25 +196,25 @@ EVAL (ast tree, environment::ptr a_env)
     // apply special symbols
     // not as_or_throw - we know the type
     const auto first_symbol = first->as<ast_node_symbol> ();
-    const auto& symbol = first_symbol->symbol ();
+    const auto symbol = first_symbol->id ();
 
-    if (symbol == "def!")
+    if (symbol == SYMBOL_DEF)
     {
       return fn_handle_def ();
     }
-    else if (symbol == "let*")
+    else if (symbol == SYMBOL_LET)
     {
       return fn_handle_let ();
     }
-    else if (symbol == "do")
+    else if (symbol == SYMBOL_DO)
     {
       return fn_handle_do ();
     }
-    else if (symbol == "if")
+    else if (symbol == SYMBOL_IF)
     {
       return fn_handle_if ();
     }
-    else if (symbol == "fn*")
+    else if (symbol == SYMBOL_FN)
     {
       return fn_handle_fn ();
     }
@@ -228,13 +228,17 @@ EVAL (ast tree, environment::ptr a_env)
 ast
 eval_ast (ast tree, environment::ptr a_env)
 {
+  // a literal of constants is its own value, see is_constant_literal
+  if (is_constant_literal (tree))
+    return tree;
+
   switch (tree->type ())
   {
   case node_type_enum::SYMBOL:
     {
       // not as_or_throw - we know the type
       const auto& node_symbol = tree->as<ast_node_symbol> ();
-      return a_env->get_or_throw (node_symbol->symbol ());
+      return a_env->get_or_throw (node_symbol->id ());
 
     }
   case node_type_enum::LIST:
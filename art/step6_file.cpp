@@ -80,7 +80,7 @@ EVAL (ast tree, environment::ptr a_env)
       if (root_list->size () != 3)
         raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
 
-      const auto& key = (*root_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol ();
+      const auto key = (*root_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
 
       ast_node::ptr value = EVAL ((*root_list)[2], a_env);
       a_env->set (key, value);
@@ -113,13 +113,13 @@ EVAL (ast tree, environment::ptr a_env)
       
       for (size_t i = 0, e = let_bindings->size(); i < e; i += 2)
       {
-        const auto& key = (*let_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol ();
+        const auto key = (*let_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
         ast_node::ptr value = EVAL ((*let_bindings)[i + 1], let_env);
 
         let_env->set (key, value);
       }
 
-      return {(*root_list)[2], let_env};
+      return tco {(*root_list)[2], let_env, nullptr};
     };
 
     // tco
@@ -149,7 +149,7 @@ EVAL (ast tree, environment::ptr a_env)
         /*retVal = */EVAL ((*root_list)[i], a_env);
       }
 
-      return {(*root_list)[list_size - 1], a_env};
+      return tco {(*root_list)[list_size - 1], a_env, nullptr};
     };
 
     // tco
@@ -163,9 +163,9 @@ EVAL (ast tree, environment::ptr a_env)
       const bool cond = !(condNode == ast_node::nil_node) && !(condNode == ast_node::false_node);
 
       if (cond)
-        return {(*root_list)[2], a_env};
+        return tco {(*root_list)[2], a_env, nullptr};
       else if (list_size == 4)
-        return {(*root_list)[3], a_env};
+        return tco {(*root_list)[3], a_env, nullptr};
 
       return tco {nullptr, nullptr, ast_node::nil_node};
     };
@@ -179,7 +179,7 @@ EVAL (ast tree, environment::ptr a_env)
       auto&& bindsNode = (*root_list)[1];
       auto&& astNode = (*root_list)[2];
 
-      ast_node::ptr retVal = std::make_shared<ast_node_callable_lambda> (bindsNode, astNode, a_env);
+      ast_node::ptr retVal = make_sp<ast_node_callable_lambda> (bindsNode, astNode, a_env);
       return retVal;
     };
 
@@ -189,23 +189,23 @@ EVAL (ast tree, environment::ptr a_env)
       // apply special symbols
       // not as_or_throw - we know the type
       const auto first_symbol = first->as<ast_node_symbol> ();
-      const auto& symbol = first_symbol->symbol ();
+      const auto symbol = first_symbol->id ();
 
-      if (symbol == "def!")
+      if (symbol == SYMBOL_DEF)
       {
         return fn_handle_def ();
       }
-      else if (symbol == "let*")
+      else if (symbol == SYMBOL_LET)
       {
         std::tie (tree, a_env, std::ignore) = fn_handle_let_tco ();
         continue;
       }
-      else if (symbol == "do")
+      else if (symbol == SYMBOL_DO)
       {
         std::tie (tree, a_env, std::ignore) = fn_handle_do_tco ();
         continue;
       }
-      else if (symbol == "if")
+      else if (symbol == SYMBOL_IF)
       {
         ast retVal;
         std::tie (tree, a_env, retVal) = fn_handle_if_tco ();
@@ -213,7 +213,7 @@ EVAL (ast tree, environment::ptr a_env)
           return retVal;
         continue;
       }
-      else if (symbol == "fn*")
+      else if (symbol == SYMBOL_FN)
       {
         return fn_handle_fn ();
       }
@@ -236,13 +236,17 @@ EVAL (ast tree, environment::ptr a_env)
 ast
 eval_ast (ast tree, environment::ptr a_env)
 {
+  // a literal of constants is its own value, see is_constant_literal
+  if (is_constant_literal (tree))
+    return tree;
+
   switch (tree->type ())
   {
   case node_type_enum::SYMBOL:
     {
       // not as_or_throw - we know the type
       const auto& node_symbol = tree->as<ast_node_symbol> ();
-      return a_env->get_or_throw (node_symbol->symbol ());
+      return a_env->get_or_throw (node_symbol->id ());
 
     }
   case node_type_enum::LIST:
@@ -5,6 +5,8 @@
 #include "reader.h"
 #include "environment.h"
 #include "core.h"
+#include "vm.h"
+#include "stack_guard.h"
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -49,14 +51,1212 @@ READ (const std::string& line)
   return read_str (line);
 }
 
+///////////////////////////////
+ast_node::ptr
+is_macro_call (ast tree, environment::ptr a_env)
+{
+  if (tree->type () != node_type_enum::LIST)
+    return {};
+
+  // not as_or_throw - we know the type
+  auto root_list = tree->as<ast_node_list> ();
+  if (root_list->empty ())
+    return {};
+
+  auto first = (*root_list)[0];
+  if (first->type () != node_type_enum::SYMBOL)
+    return {};
+
+  const auto first_symbol = first->as<ast_node_symbol> ();
+  auto macro_node = a_env->get (first_symbol->id ());
+
+  if (!macro_node)
+    return {};
+
+  if (!macro_node->as_or_zero<ast_node_macro_call> ())
+    return {};
+
+  return macro_node;
+}
+
 ///////////////////////////////
 ast
-eval_ast (ast tree, environment::ptr a_env); // fwd decl
+macroexpand (ast tree, environment::ptr a_env)
+{
+  ast_node::ptr macro_call;
+  while ( (macro_call = is_macro_call (tree, a_env)) != nullptr ) 
+  {
+    auto callable_list = tree->as<ast_node_list> ();
+    const size_t list_size = callable_list->size ();
+    assert (list_size > 0);
+
+    ast treeApply;
+    environment::ptr envApply;
+    ast retVal;
+    std::tie (treeApply, envApply, retVal) = macro_call->as<ast_node_macro_call> ()->callable_node ()->as<ast_node_callable> ()->call_tco (call_arguments (callable_list, 1, list_size - 1));
+
+    assert (!retVal);
+    tree = ast_node_raised::value_or_throw (EVAL (treeApply, envApply));
+  }
+  return tree;
+}
+
+///////////////////////////////
+// the evaluator. A form is analyzed once into a tree of code nodes - the
+// special forms are recognized, macro calls expanded and locals resolved
+// to their (depth, slot) in the frames - and the code then runs without
+// looking at the form again. EVAL keeps the code of a list with the list
+// (ast_node_list::code), lambdas keep the code of their body.
+//
+// A code node runs either to its value (eval) or, in a tail position, to
+// the code to continue with and its environment (eval_tco): a call of a
+// lambda in a tail position returns to the loop in EVAL instead of
+// growing the stack. Every node overrides at least one of the two.
+//
+// A throw is a value too, the raised node (ast_node_raised): a node
+// getting it from the code it runs returns it right away, up to the
+// code_try catching it.
+struct fold_guard;
+
+class ast_node_code : public ast_node_base<node_type_enum::CODE>
+{
+public:
+  using ptr = sp<const ast_node_code>;
+
+  // false if the value depends on the run. Otherwise value is what the
+  // code evaluates to while the globals in guards - the folded calls it
+  // relies on, added to them - stay bound as they are
+  virtual bool is_constant (ast_node::ptr& value, std::vector<fold_guard>& guards) const
+  {
+    return false;
+  }
+
+  virtual ast_node::ptr eval (const environment::ptr& a_env) const
+  {
+    ast tree;
+    environment::ptr env;
+    ast retVal;
+    std::tie (tree, env, retVal) = eval_tco (a_env);
+    return retVal ? retVal : EVAL (tree, env);
+  }
+
+  virtual tco eval_tco (const environment::ptr& a_env) const
+  {
+    return tco {nullptr, nullptr, eval (a_env)};
+  }
+
+  std::string to_string (bool print_readable) const override
+  {
+    return "#code";
+  }
+
+  bool operator == (const ast_node& rp) const override
+  {
+    return this == std::addressof (rp);
+  }
+
+  uint32_t hash () const override
+  {
+    const uint32_t retVal = reinterpret_cast<uint64_t> (this) * 2052828881 + 541325663;
+    return retVal;
+  }
+
+protected:
+  mutable_ptr clone () const override
+  {
+    // immutable, shared instead of copied
+    return mutable_ptr (const_cast<ast_node_code*> (this));
+  }
+};
+
+///////////////////////////////
+// the head of a folded call and the builtin it was bound to
+struct fold_guard
+{
+  ast_node_code::ptr fn;
+  ast_node::ptr builtin;
+};
+
+///////////////////////////////
+// scope is the layout of the innermost frame of the code, nullptr at the
+// top level. Errors in the form are reported when the code runs
+ast_node_code::ptr
+analyze (const ast_node::ptr& form, const frame_layout::const_ptr& scope, const environment::ptr& a_env);
+
+namespace
+{
+
+///////////////////////////////
+ast_node::ptr
+builtin_macro_cache_stats (const call_arguments& args)
+{
+  if (args.size () != 0)
+    raise<mal_exception_eval_invalid_arg> ();
+
+  auto retVal = mal::make_hashmap ();
+  retVal->insert (mal::make_keyword (":hits"), mal::make_int (ast_node_macro_call::cache_hits));
+  retVal->insert (mal::make_keyword (":misses"), mal::make_int (ast_node_macro_call::cache_misses));
+  return retVal;
+}
+
+///////////////////////////////
+// throw of stepA, the evaluators pass the value on to the try*
+ast_node::ptr
+builtin_throw (const call_arguments& args)
+{
+  if (args.size () != 1)
+    raise<mal_exception_eval_invalid_arg> ();
+
+  return ast_node_raised::raise (args[0]);
+}
+
+///////////////////////////////
+// self-evaluating forms and quote
+class code_constant final : public ast_node_code
+{
+public:
+  explicit code_constant (ast_node::ptr value)
+    : m_value (value)
+  {}
+
+  ast_node::ptr eval (const environment::ptr&) const override
+  {
+    return m_value;
+  }
+
+  bool is_constant (ast_node::ptr& value, std::vector<fold_guard>&) const override
+  {
+    value = m_value;
+    return true;
+  }
+
+private:
+  ast_node::ptr m_value;
+};
+
+///////////////////////////////
+// a form which failed the analysis, raises when evaluated
+class code_raise final : public ast_node_code
+{
+public:
+  explicit code_raise (std::exception_ptr error)
+    : m_error (error)
+  {}
+
+  ast_node::ptr eval (const environment::ptr&) const override
+  {
+    std::rethrow_exception (m_error);
+  }
+
+private:
+  std::exception_ptr m_error;
+};
+
+///////////////////////////////
+// a symbol which is not a local, looked up by name
+// a name bound at the root. The reference keeps the binding cell of the
+// root once it is there - a def! updates the cell in place - and walks
+// the frames only while a nested frame might bind the name too
+class code_global final : public ast_node_code
+{
+public:
+  explicit code_global (ast_node::ptr symbol)
+    : m_symbol (symbol)
+    , m_id (symbol->as<ast_node_symbol> ()->id ())
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    if (!environment::is_bound_nested (m_id))
+    {
+      if (!m_cell)
+        m_cell = a_env->root_cell (m_id, m_root);
+
+      if (m_cell)
+        return *m_cell;
+    }
+
+    return a_env->get_or_throw (m_id);
+  }
+
+private:
+  ast_node::ptr m_symbol;
+  symbol_id m_id;
+
+  mutable const ast_node::ptr* m_cell = nullptr;
+  // keeps the cell alive
+  mutable environment::const_ptr m_root;
+};
+
+///////////////////////////////
+class code_local final : public ast_node_code
+{
+public:
+  code_local (ast_node::ptr symbol, uint32_t depth, uint32_t slot)
+    : m_symbol (symbol)
+    , m_id (symbol->as<ast_node_symbol> ()->id ())
+    , m_depth (depth)
+    , m_slot (slot)
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    auto&& value = a_env->get_slot (m_depth, m_slot);
+    if (value)
+      return value;
+
+    // not bound yet - a let* value referring to a later binding
+    return a_env->get_or_throw (m_id);
+  }
+
+private:
+  ast_node::ptr m_symbol;
+  symbol_id m_id;
+  uint32_t m_depth;
+  uint32_t m_slot;
+};
+
+///////////////////////////////
+class code_vector final : public ast_node_code
+{
+public:
+  explicit code_vector (std::vector<ast_node_code::ptr> elements)
+    : m_elements (std::move (elements))
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    auto retVal = mal::make_vector ();
+    for (auto && element : m_elements)
+    {
+      auto value = element->eval (a_env);
+      if (ast_node_raised::is (value))
+        return value;
+
+      retVal->add_child (value);
+    }
+
+    return retVal;
+  }
+
+private:
+  std::vector<ast_node_code::ptr> m_elements;
+};
+
+///////////////////////////////
+class code_hashmap final : public ast_node_code
+{
+public:
+  using entry = std::pair<ast_node_code::ptr, ast_node_code::ptr>;
+
+  explicit code_hashmap (std::vector<entry> entries)
+    : m_entries (std::move (entries))
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    auto retVal = mal::make_hashmap ();
+    for (auto && kv : m_entries)
+    {
+      auto key = kv.first->eval (a_env);
+      if (ast_node_raised::is (key))
+        return key;
+
+      auto value = kv.second->eval (a_env);
+      if (ast_node_raised::is (value))
+        return value;
+
+      retVal->insert (key, value);
+    }
+
+    return retVal;
+  }
+
+private:
+  std::vector<entry> m_entries;
+};
+
+///////////////////////////////
+// def! and defmacro!
+class code_def final : public ast_node_code
+{
+public:
+  code_def (ast_node::ptr symbol, ast_node_code::ptr value, bool is_macro)
+    : m_symbol (symbol)
+    , m_id (symbol->as<ast_node_symbol> ()->id ())
+    , m_value (value)
+    , m_is_macro (is_macro)
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    ast_node::ptr value = m_value->eval (a_env);
+    if (ast_node_raised::is (value))
+      return value;
+
+    // (re)defining a macro outdates the expansions of the call sites
+    if (m_is_macro || is_macro (a_env->get (m_id)))
+      ++ast_node_macro_call::epoch;
+
+    if (m_is_macro && !value->as_or_zero<ast_node_macro_call> ())
+      a_env->set (m_id, make_sp<ast_node_macro_call> (value));
+    else
+      a_env->set (m_id, value);
+
+    return value;
+  }
+
+private:
+  static bool is_macro (const ast_node::ptr& node)
+  {
+    return node && node->type () == node_type_enum::MACRO_CALL;
+  }
+
+  ast_node::ptr m_symbol;
+  symbol_id m_id;
+  ast_node_code::ptr m_value;
+  bool m_is_macro;
+};
+
+///////////////////////////////
+class code_let final : public ast_node_code
+{
+public:
+  using binding = std::pair<size_t, ast_node_code::ptr>;
+
+  code_let (frame_layout::const_ptr layout, std::vector<binding> bindings, ast_node_code::ptr body)
+    : m_layout (layout)
+    , m_bindings (std::move (bindings))
+    , m_body (body)
+  {}
+
+  tco eval_tco (const environment::ptr& a_env) const override
+  {
+    auto let_env = environment::make (m_layout, a_env);
+    for (auto && b : m_bindings)
+    {
+      auto value = b.second->eval (let_env);
+      if (ast_node_raised::is (value))
+        return tco {nullptr, nullptr, value};
+
+      let_env->set_slot (b.first, value);
+    }
+
+    return m_body->eval_tco (let_env);
+  }
+
+private:
+  frame_layout::const_ptr m_layout;
+  std::vector<binding> m_bindings;
+  ast_node_code::ptr m_body;
+};
+
+///////////////////////////////
+// (loop [name value ..] body). The names are bound like let*, a recur in
+// a tail position of the body rebinds them and the body runs again - in
+// the same frame, unless a closure or def! may keep it
+// (frame_layout::is_captured)
+class code_loop final : public ast_node_code
+{
+public:
+  using binding = code_let::binding;
+
+  // the body is analyzed after, with the loop as the recur target
+  code_loop (frame_layout::const_ptr layout, std::vector<binding> bindings)
+    : m_layout (layout)
+    , m_bindings (std::move (bindings))
+  {}
+
+  void set_body (ast_node_code::ptr body)
+  {
+    m_body = body;
+  }
+
+  size_t binding_count () const
+  {
+    return m_bindings.size ();
+  }
+
+  tco eval_tco (const environment::ptr& a_env) const override;
+
+private:
+  frame_layout::const_ptr m_layout;
+  std::vector<binding> m_bindings;
+  ast_node_code::ptr m_body;
+};
+
+///////////////////////////////
+// the loop a recur being analyzed jumps to - set while the code analyzed
+// is in a tail position of its body, nullptr anywhere else
+const code_loop* recur_target = nullptr;
+
+class recur_scope
+{
+public:
+  explicit recur_scope (const code_loop* target)
+    : m_outer (recur_target)
+  {
+    recur_target = target;
+  }
+
+  ~recur_scope ()
+  {
+    recur_target = m_outer;
+  }
+
+private:
+  recur_scope (const recur_scope&) = delete;
+  recur_scope& operator = (const recur_scope&) = delete;
+
+  const code_loop* m_outer;
+};
+
+// the values of the recur the loop is returned to, in binding order
+std::vector<ast_node::ptr> recur_values;
+
+// what a recur returns to its loop instead of a value
+const ast_node::ptr& recur_marker ()
+{
+  static const ast_node::ptr marker = make_sp<code_constant> (ast_node::nil_node);
+  return marker;
+}
+
+///////////////////////////////
+class code_recur final : public ast_node_code
+{
+public:
+  explicit code_recur (std::vector<ast_node_code::ptr> args)
+    : m_args (std::move (args))
+  {}
+
+  tco eval_tco (const environment::ptr& a_env) const override
+  {
+    // all of them first - they see the names as the iteration bound them
+    argument_frame values (m_args.size ());
+    for (size_t i = 0, e = m_args.size (); i < e; ++i)
+    {
+      values[i] = m_args[i]->eval (a_env);
+      if (ast_node_raised::is (values[i]))
+        return tco {nullptr, nullptr, values[i]};
+    }
+
+    recur_values.resize (m_args.size ());
+    for (size_t i = 0, e = m_args.size (); i < e; ++i)
+      recur_values[i] = std::move (values[i]);
+
+    return tco {nullptr, nullptr, recur_marker ()};
+  }
+
+private:
+  std::vector<ast_node_code::ptr> m_args;
+};
+
+///////////////////////////////
+tco
+code_loop::eval_tco (const environment::ptr& a_env) const
+{
+  auto loop_env = environment::make (m_layout, a_env);
+  for (auto && b : m_bindings)
+  {
+    auto value = b.second->eval (loop_env);
+    if (ast_node_raised::is (value))
+      return tco {nullptr, nullptr, value};
+
+    loop_env->set_slot (b.first, value);
+  }
+
+  for (;;)
+  {
+    tco retVal = m_body->eval_tco (loop_env);
+    if (ast_node::ptr (std::get<2> (retVal)) != recur_marker ())
+      return retVal;
+
+    if (m_layout->is_captured ())
+      loop_env = environment::make (m_layout, a_env);
+
+    for (size_t i = 0, e = m_bindings.size (); i < e; ++i)
+      loop_env->set_slot (m_bindings[i].first, std::move (recur_values[i]));
+  }
+}
+
+///////////////////////////////
+class code_do final : public ast_node_code
+{
+public:
+  explicit code_do (std::vector<ast_node_code::ptr> body)
+    : m_body (std::move (body))
+  {
+    assert (!m_body.empty ());
+  }
+
+  tco eval_tco (const environment::ptr& a_env) const override
+  {
+    for (size_t i = 0, e = m_body.size () - 1; i < e; ++i)
+    {
+      auto value = m_body[i]->eval (a_env);
+      if (ast_node_raised::is (value))
+        return tco {nullptr, nullptr, value};
+    }
+
+    return m_body.back ()->eval_tco (a_env);
+  }
+
+private:
+  std::vector<ast_node_code::ptr> m_body;
+};
+
+///////////////////////////////
+class code_if final : public ast_node_code
+{
+public:
+  // no else branch - nullptr
+  code_if (ast_node_code::ptr cond, ast_node_code::ptr then_branch, ast_node_code::ptr else_branch)
+    : m_cond (cond)
+    , m_then (then_branch)
+    , m_else (else_branch)
+  {}
+
+  tco eval_tco (const environment::ptr& a_env) const override
+  {
+    ast_node::ptr condNode = m_cond->eval (a_env);
+    if (ast_node_raised::is (condNode))
+      return tco {nullptr, nullptr, condNode};
+
+    const bool cond = !(condNode == ast_node::nil_node) && !(condNode == ast_node::false_node);
+
+    if (cond)
+      return m_then->eval_tco (a_env);
+    else if (m_else)
+      return m_else->eval_tco (a_env);
+
+    return tco {nullptr, nullptr, ast_node::nil_node};
+  }
+
+private:
+  ast_node_code::ptr m_cond;
+  ast_node_code::ptr m_then;
+  ast_node_code::ptr m_else;
+};
+
+///////////////////////////////
+class code_fn final : public ast_node_code
+{
+public:
+  code_fn (ast_node::ptr binds, ast_node::ptr body, frame_layout::const_ptr layout, ast_node_code::ptr body_code)
+    : m_binds (binds)
+    , m_body (body)
+    , m_layout (layout)
+    , m_body_code (body_code)
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    return make_sp<ast_node_callable_lambda> (m_binds, m_body, a_env, m_layout, m_body_code);
+  }
+
+private:
+  ast_node::ptr m_binds;
+  ast_node::ptr m_body;
+  frame_layout::const_ptr m_layout;
+  ast_node_code::ptr m_body_code;
+};
+
+///////////////////////////////
+// a multi-arity fn*, the clauses are analyzed once for all its closures
+class code_multi_fn final : public ast_node_code
+{
+public:
+  explicit code_multi_fn (lambda_arities::const_ptr arities)
+    : m_arities (arities)
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    return make_sp<ast_node_callable_lambda> (m_arities, a_env);
+  }
+
+private:
+  lambda_arities::const_ptr m_arities;
+};
+
+///////////////////////////////
+// a quasiquoted list, its elements are quasiquoted or unquoted (spliced)
+class code_quasiquote final : public ast_node_code
+{
+public:
+  struct element
+  {
+    ast_node_code::ptr code;
+    bool splice;
+  };
+
+  explicit code_quasiquote (std::vector<element> elements)
+    : m_elements (std::move (elements))
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    auto retVal = mal::make_list ();
+    for (auto && element : m_elements)
+    {
+      auto value = element.code->eval (a_env);
+      if (ast_node_raised::is (value))
+        return value;
+
+      if (!element.splice)
+      {
+        retVal->add_child (value);
+        continue;
+      }
+
+      auto splicedList = value->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ();
+      for (size_t c = 0, ce = splicedList->size (); c < ce; ++c)
+        retVal->add_child ((*splicedList) [c]);
+    }
+
+    return retVal;
+  }
+
+private:
+  std::vector<element> m_elements;
+};
+
+///////////////////////////////
+class code_macroexpand final : public ast_node_code
+{
+public:
+  explicit code_macroexpand (ast_node::ptr form)
+    : m_form (form)
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    return macroexpand (m_form, a_env);
+  }
+
+private:
+  ast_node::ptr m_form;
+};
+
+///////////////////////////////
+class code_try final : public ast_node_code
+{
+public:
+  // catch_layout has the single slot of the exception
+  code_try (ast_node_code::ptr body, frame_layout::const_ptr catch_layout, ast_node_code::ptr catch_body)
+    : m_body (body)
+    , m_catch_layout (catch_layout)
+    , m_catch_body (catch_body)
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    try
+    {
+      auto value = m_body->eval (a_env);
+      if (!ast_node_raised::is (value))
+        return value;
+    }
+    catch (const mal_exception& ex)
+    {
+      return eval_catch (a_env, mal::make_string (ex.what ()));
+    }
+    catch (const ast_node::ptr& ex)
+    {
+      return eval_catch (a_env, ex);
+    }
+
+    return eval_catch (a_env, ast_node_raised::take ());
+  }
+
+private:
+  ast_node::ptr eval_catch (const environment::ptr& a_env, ast_node::ptr ex) const
+  {
+    auto catch_env = environment::make (m_catch_layout, a_env);
+    catch_env->set_slot (0, ex);
+    return m_catch_body->eval (catch_env);
+  }
+
+  ast_node_code::ptr m_body;
+  frame_layout::const_ptr m_catch_layout;
+  ast_node_code::ptr m_catch_body;
+};
+
+///////////////////////////////
+ast_node_code::ptr
+analyze_apply (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env);
+
+// analyze for a tail position of a loop body - a recur in the form
+// jumps to recur_target
+ast_node_code::ptr
+analyze_tail (const ast_node::ptr& form, const frame_layout::const_ptr& scope, const environment::ptr& a_env);
+
+///////////////////////////////
+// a macro call site. It keeps the code of its expansion, the macro is
+// looked up again only when a defmacro! has run since (see
+// ast_node_macro_call::epoch) and the form is expanded again only when
+// the macro has changed
+class code_macro_call final : public ast_node_code
+{
+public:
+  // form - a copy of the list, macro - what its head is bound to
+  code_macro_call (ast_node::ptr form, frame_layout::const_ptr scope, ast_node::ptr macro, const environment::ptr& a_env)
+    : m_form (form)
+    , m_scope (scope)
+    , m_recur (recur_target)
+  {
+    expand (macro, a_env);
+  }
+
+  tco eval_tco (const environment::ptr& a_env) const override
+  {
+    if (m_epoch != ast_node_macro_call::epoch)
+    {
+      m_epoch = ast_node_macro_call::epoch;
+
+      ast_node::ptr macro = is_macro_call (m_form, a_env);
+      if (macro != m_macro)
+      {
+        // not a macro any more - an ordinary call then
+        if (macro)
+          expand (macro, a_env);
+        else
+        {
+          recur_scope target (m_recur);
+          m_macro = nullptr;
+          m_code = analyze_apply (m_form->as<ast_node_list> (), m_scope, a_env);
+        }
+
+        return m_code->eval_tco (a_env);
+      }
+    }
+
+    if (m_macro)
+      ++ast_node_macro_call::cache_hits;
+
+    return m_code->eval_tco (a_env);
+  }
+
+private:
+  void expand (const ast_node::ptr& macro, const environment::ptr& a_env) const
+  {
+    ++ast_node_macro_call::cache_misses;
+    const uint64_t epoch = ast_node_macro_call::epoch;
+    auto form_list = m_form->as<ast_node_list> ();
+
+    ast tree;
+    environment::ptr env;
+    ast retVal;
+    std::tie (tree, env, retVal) = macro->as<ast_node_macro_call> ()->callable_node ()->as<ast_node_callable> ()->call_tco (call_arguments (form_list, 1, form_list->size () - 1));
+
+    ast_node::ptr expanded = ast_node_raised::value_or_throw (retVal ? retVal : EVAL (tree, env));
+
+    // the expansion takes the place of the call, a tail position of a
+    // loop body included
+    recur_scope target (m_recur);
+    m_code = analyze_tail (expanded, m_scope, a_env);
+    m_macro = macro;
+    m_epoch = epoch;
+  }
+
+  ast_node::ptr m_form;
+  frame_layout::const_ptr m_scope;
+  const code_loop* m_recur;
+
+  mutable ast_node::ptr m_macro;
+  mutable ast_node_code::ptr m_code;
+  mutable uint64_t m_epoch = 0;
+};
+
+///////////////////////////////
+// a call. A symbol in the head might be bound to a macro only by the time
+// the call runs (e.g. defmacro! earlier in the same do) - then the call
+// becomes a macro call site.
+class code_apply final : public ast_node_code
+{
+public:
+  // form - a copy of the list, nullptr if the head is not a symbol
+  code_apply (ast_node_code::ptr fn, std::vector<ast_node_code::ptr> args, ast_node::ptr form, frame_layout::const_ptr scope)
+    : m_fn (fn)
+    , m_args (std::move (args))
+    , m_form (form)
+    , m_scope (scope)
+    , m_recur (recur_target)
+  {}
+
+  tco eval_tco (const environment::ptr& a_env) const override
+  {
+    if (m_macro_call)
+      return m_macro_call->eval_tco (a_env);
+
+    ast_node::ptr fn = m_fn->eval (a_env);
+    if (ast_node_raised::is (fn))
+      return tco {nullptr, nullptr, fn};
+
+    if (m_form && fn->type () == node_type_enum::MACRO_CALL)
+    {
+      recur_scope target (m_recur);
+      m_macro_call = make_sp<code_macro_call> (m_form, m_scope, fn, a_env);
+      return m_macro_call->eval_tco (a_env);
+    }
+
+    // a lambda copies them into its frame before the call returns
+    argument_frame args (m_args.size ());
+    for (size_t i = 0, e = m_args.size (); i < e; ++i)
+    {
+      args[i] = m_args[i]->eval (a_env);
+      if (ast_node_raised::is (args[i]))
+        return tco {nullptr, nullptr, args[i]};
+    }
+
+    auto && callable_node = fn->as_or_throw<ast_node_callable, mal_exception_eval_not_callable> ();
+    return callable_node->call_tco (args);
+  }
+
+private:
+  ast_node_code::ptr m_fn;
+  std::vector<ast_node_code::ptr> m_args;
+  ast_node::ptr m_form;
+  frame_layout::const_ptr m_scope;
+  const code_loop* m_recur;
+
+  mutable ast_node_code::ptr m_macro_call;
+};
+
+///////////////////////////////
+// a call of two arguments whose head is bound to an inline core builtin
+// (+, <, = ...), see apply_binary_op. While the head still is that
+// builtin and both arguments are immediate integers the value is computed
+// here, otherwise the call is an ordinary one (call). A get on a hash-map
+// remembers the slot of its key in maps of the last shape (apply_get)
+class code_binary final : public ast_node_code
+{
+public:
+  code_binary (ast_node::ptr builtin, ast_node_code::ptr fn, ast_node_code::ptr lhs, ast_node_code::ptr rhs, ast_node_code::ptr call)
+    : m_builtin (builtin)
+    , m_op (builtin->as<ast_node_callable_builtin_base> ()->inline_op ())
+    , m_fn (fn)
+    , m_lhs (lhs)
+    , m_rhs (rhs)
+    , m_call (call)
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    ast_node::ptr retVal;
+    if (eval_builtin (a_env, retVal))
+      return retVal;
+
+    return m_call->eval (a_env);
+  }
+
+  tco eval_tco (const environment::ptr& a_env) const override
+  {
+    ast_node::ptr retVal;
+    if (eval_builtin (a_env, retVal))
+      return tco {nullptr, nullptr, retVal};
+
+    return m_call->eval_tco (a_env);
+  }
+
+private:
+  // false if the head is bound to something else now, only the head is
+  // evaluated then
+  bool eval_builtin (const environment::ptr& a_env, ast_node::ptr& retVal) const
+  {
+    if (m_fn->eval (a_env) != m_builtin)
+      return false;
+
+    ast_node::ptr lhs = m_lhs->eval (a_env);
+    if (ast_node_raised::is (lhs))
+    {
+      retVal = lhs;
+      return true;
+    }
+
+    ast_node::ptr rhs = m_rhs->eval (a_env);
+    if (ast_node_raised::is (rhs))
+    {
+      retVal = rhs;
+      return true;
+    }
+
+    if (m_op == binary_op::GET ? apply_get (lhs, rhs, m_cache, retVal) : apply_binary_op (m_op, lhs, rhs, retVal))
+      return true;
+
+    // the builtin reports what is wrong with the arguments
+    argument_frame args (2);
+    args[0] = lhs;
+    args[1] = rhs;
+    retVal = std::get<2> (m_builtin->as<ast_node_callable> ()->call_tco (args));
+    return true;
+  }
+
+  ast_node::ptr m_builtin;
+  binary_op m_op;
+  ast_node_code::ptr m_fn;
+  ast_node_code::ptr m_lhs;
+  ast_node_code::ptr m_rhs;
+  ast_node_code::ptr m_call;
+
+  // get only
+  mutable map_slot_cache m_cache;
+};
+
+///////////////////////////////
+// a call of a pure builtin on constants, computed by the analysis (see
+// fold_pure_call). The value stands while the heads of the call - its own
+// and those of the folded arguments - are bound to the same builtins,
+// otherwise the call runs (call)
+class code_folded final : public ast_node_code
+{
+public:
+  code_folded (ast_node::ptr value, std::vector<fold_guard> guards, ast_node_code::ptr call)
+    : m_value (value)
+    , m_guards (std::move (guards))
+    , m_call (call)
+  {}
+
+  ast_node::ptr eval (const environment::ptr& a_env) const override
+  {
+    if (!holds (a_env))
+      return m_call->eval (a_env);
+
+    return m_value;
+  }
+
+  tco eval_tco (const environment::ptr& a_env) const override
+  {
+    if (!holds (a_env))
+      return m_call->eval_tco (a_env);
+
+    return tco {nullptr, nullptr, m_value};
+  }
+
+  bool is_constant (ast_node::ptr& value, std::vector<fold_guard>& guards) const override
+  {
+    value = m_value;
+    guards.insert (guards.end (), m_guards.begin (), m_guards.end ());
+    return true;
+  }
+
+private:
+  bool holds (const environment::ptr& a_env) const
+  {
+    for (auto&& g : m_guards)
+    {
+      if (g.fn->eval (a_env) != g.builtin)
+        return false;
+    }
+    return true;
+  }
+
+  ast_node::ptr m_value;
+  std::vector<fold_guard> m_guards;
+  ast_node_code::ptr m_call;
+};
+
+///////////////////////////////
+// -1 if the symbol is not a local
+int
+resolve_local (symbol_id symbol, const frame_layout::const_ptr& scope, uint32_t& depth)
+{
+  depth = 0;
+  for (const frame_layout* layout = scope.get (); layout; layout = layout->outer ().get (), ++depth)
+  {
+    const int slot = layout->slot_of (symbol);
+    if (slot >= 0)
+      return slot;
+  }
+  return -1;
+}
+
+///////////////////////////////
+ast_node_code::ptr
+analyze_symbol (const ast_node::ptr& form, const frame_layout::const_ptr& scope)
+{
+  uint32_t depth = 0;
+  const int slot = resolve_local (form->as<ast_node_symbol> ()->id (), scope, depth);
+  if (slot >= 0)
+    return make_sp<code_local> (form, depth, slot);
+
+  return make_sp<code_global> (form);
+}
+
+///////////////////////////////
+ast_node_code::ptr
+analyze_def (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env, bool is_macro)
+{
+  if (root_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  auto key = (*root_list)[1];
+  key->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ();
+
+  // binds in the innermost frame, which a loop must not reuse then
+  if (scope)
+    scope->mark_captured ();
+
+  return make_sp<code_def> (key, analyze ((*root_list)[2], scope, a_env), is_macro);
+}
+
+///////////////////////////////
+ast_node_code::ptr
+analyze_let (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  if (root_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  const auto root_list_arg_1 = (*root_list)[1];
+  auto let_bindings = root_list_arg_1->as_or_zero<ast_node_container_base> ();
+  if (!let_bindings)
+    raise<mal_exception_eval_invalid_arg> (root_list_arg_1->to_string ());
+
+  if (let_bindings->size () % 2 != 0)
+    raise<mal_exception_eval_invalid_arg> (let_bindings->to_string ());
+
+  // all names first - a closure made by a value sees the later ones, and
+  // no name the frame binds can hide a root cell from code_global. A
+  // value reading a name not bound yet finds the outer one (code_local)
+  auto layout = make_sp<frame_layout> (scope);
+  for (size_t i = 0, e = let_bindings->size (); i < e; i += 2)
+    layout->add ((*let_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ());
+
+  std::vector<code_let::binding> bindings;
+  for (size_t i = 0, e = let_bindings->size (); i < e; i += 2)
+  {
+    const auto key = (*let_bindings)[i]->as<ast_node_symbol> ()->id ();
+    bindings.emplace_back (layout->slot_of (key), analyze ((*let_bindings)[i + 1], layout, a_env));
+  }
+
+  return make_sp<code_let> (layout, std::move (bindings), analyze_tail ((*root_list)[2], layout, a_env));
+}
+
+///////////////////////////////
+ast_node_code::ptr
+analyze_loop (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  if (root_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  const auto root_list_arg_1 = (*root_list)[1];
+  auto loop_bindings = root_list_arg_1->as_or_zero<ast_node_container_base> ();
+  if (!loop_bindings)
+    raise<mal_exception_eval_invalid_arg> (root_list_arg_1->to_string ());
+
+  if (loop_bindings->size () % 2 != 0)
+    raise<mal_exception_eval_invalid_arg> (loop_bindings->to_string ());
+
+  // as let*. A recur binds the names in the same order
+  auto layout = make_sp<frame_layout> (scope);
+  for (size_t i = 0, e = loop_bindings->size (); i < e; i += 2)
+    layout->add ((*loop_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ());
+
+  std::vector<code_loop::binding> bindings;
+  for (size_t i = 0, e = loop_bindings->size (); i < e; i += 2)
+  {
+    const auto key = (*loop_bindings)[i]->as<ast_node_symbol> ()->id ();
+    bindings.emplace_back (layout->slot_of (key), analyze ((*loop_bindings)[i + 1], layout, a_env));
+  }
+
+  auto loop = make_sp<code_loop> (layout, std::move (bindings));
+
+  recur_scope target (loop.get ());
+  loop->set_body (analyze_tail ((*root_list)[2], layout, a_env));
+  return loop;
+}
+
+///////////////////////////////
+ast_node_code::ptr
+analyze_recur (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  if (!recur_target)
+    raise<mal_exception_eval_invalid_arg> ("recur outside a tail position of loop: " + root_list->to_string ());
+
+  if (root_list->size () - 1 != recur_target->binding_count ())
+    raise<mal_exception_eval_invalid_arg> ("recur expects " + std::to_string (recur_target->binding_count ()) + " arguments: " + root_list->to_string ());
+
+  std::vector<ast_node_code::ptr> args;
+  for (size_t i = 1, e = root_list->size (); i < e; ++i)
+    args.push_back (analyze ((*root_list)[i], scope, a_env));
+
+  return make_sp<code_recur> (std::move (args));
+}
+
+///////////////////////////////
+ast_node_code::ptr
+analyze_do (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  const size_t list_size = root_list->size ();
+  if (list_size < 2)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  std::vector<ast_node_code::ptr> body;
+  for (size_t i = 1; i < list_size - 1; ++i)
+    body.push_back (analyze ((*root_list)[i], scope, a_env));
+  body.push_back (analyze_tail ((*root_list)[list_size - 1], scope, a_env));
+
+  return make_sp<code_do> (std::move (body));
+}
+
+///////////////////////////////
+ast_node_code::ptr
+analyze_if (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  const size_t list_size = root_list->size ();
+  if (list_size < 3 || list_size > 4)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  return make_sp<code_if> (
+      analyze ((*root_list)[1], scope, a_env),
+      analyze_tail ((*root_list)[2], scope, a_env),
+      list_size == 4 ? analyze_tail ((*root_list)[3], scope, a_env) : nullptr);
+}
+
+///////////////////////////////
+ast_node_code::ptr
+analyze_fn (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  // the closures keep the frames they are made in
+  for (const frame_layout* layout = scope.get (); layout; layout = layout->outer ().get ())
+    layout->mark_captured ();
+
+  if (ast_node_callable_lambda::is_multi_arity (*root_list))
+  {
+    // (fn* (params body) ..)
+    auto arities = make_sp<lambda_arities> ();
+    for (size_t i = 1, e = root_list->size (); i < e; ++i)
+    {
+      auto clause = (*root_list)[i]->as_or_throw<ast_node_list, mal_exception_eval_not_list> ();
+      if (clause->size () != 2)
+        raise<mal_exception_eval_invalid_arg> (clause->to_string ());
+
+      auto&& bindsNode = (*clause)[0];
+      auto&& astNode = (*clause)[1];
+
+      auto binds = bindsNode->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ();
+      auto layout = ast_node_callable_lambda::make_layout (*binds, scope);
+      arities->add (bindsNode, astNode, layout, analyze (astNode, layout, a_env));
+    }
+
+    return make_sp<code_multi_fn> (arities);
+  }
+
+  if (root_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  auto&& bindsNode = (*root_list)[1];
+  auto&& astNode = (*root_list)[2];
+
+  auto binds = bindsNode->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ();
+  auto layout = ast_node_callable_lambda::make_layout (*binds, scope);
+
+  return make_sp<code_fn> (bindsNode, astNode, layout, analyze (astNode, layout, a_env));
+}
 
 ///////////////////////////////
-// tco
-tco 
-handle_quasiquote_impl (ast_node::ptr node, environment::ptr a_env)
+ast_node_code::ptr
+analyze_quasiquote_impl (const ast_node::ptr& node, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
 {
   auto is_pair = [] (const ast_node::ptr& p) -> bool
   {
@@ -65,33 +1265,21 @@ handle_quasiquote_impl (ast_node::ptr node, environment::ptr a_env)
   };
 
   if (!is_pair (node))
-    return tco {nullptr, nullptr, node};
+    return make_sp<code_constant> (node);
 
   // it's non-empy list
   auto nodeList = node->as<ast_node_container_base> ();
   const auto nodeListSize = nodeList->size ();
   auto nodeListFirstSym = (*nodeList)[0]->as_or_zero<ast_node_symbol> ();
 
-  if (nodeListFirstSym && nodeListFirstSym->symbol () == "unquote")
+  if (nodeListFirstSym && nodeListFirstSym->id () == SYMBOL_UNQUOTE)
   {
     if (nodeListSize != 2)
       raise<mal_exception_eval_invalid_arg> (nodeList->to_string ());
-    return tco {(*nodeList)[1], a_env};
+    return analyze ((*nodeList)[1], scope, a_env);
   }
 
-  //
-  auto mapFn = [&a_env] (ast_node::ptr v) -> ast_node::ptr { 
-    ast_node::ptr retVal;
-    ast_node::ptr newNode;
-    environment::ptr newEnv;
-    std::tie (newNode, newEnv, retVal) = handle_quasiquote_impl (v, a_env);
-    if (retVal)
-      return retVal;
-
-    return EVAL (newNode, newEnv);
-  };
-
-  auto retVal = mal::make_list ();
+  std::vector<code_quasiquote::element> elements;
   for (size_t i = 0; i < nodeListSize; ++i)
   {
     auto && v = (*nodeList) [i];
@@ -101,408 +1289,319 @@ handle_quasiquote_impl (ast_node::ptr node, environment::ptr a_env)
     {
       auto childNodeList = v->as<ast_node_container_base> ();
       auto childSymCom = (*childNodeList)[0]->as_or_zero<ast_node_symbol> ();
-      if (childSymCom && childSymCom->symbol () == "splice-unquote")
+      if (childSymCom && childSymCom->id () == SYMBOL_SPLICE_UNQUOTE)
       {
-        const auto spliceUnquteSize = childNodeList->size ();
-        if (spliceUnquteSize != 2)
+        if (childNodeList->size () != 2)
           raise<mal_exception_eval_invalid_arg> (childNodeList->to_string ());
 
-        auto evaledList = EVAL ((*childNodeList)[1], a_env);
-        auto splicedList = evaledList->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ();
-
-        for (size_t c = 0, ce = splicedList->size (); c < ce; ++c)
-        {
-          auto && cv = (*splicedList) [c];
-          retVal->add_child (cv);
-        }
-
+        elements.push_back ({analyze ((*childNodeList)[1], scope, a_env), true});
         continue;
       }
     }
 
-    // or add 
-    retVal->add_child (mapFn (v));
+    elements.push_back ({analyze_quasiquote_impl (v, scope, a_env), false});
   }
 
-  return tco {nullptr, nullptr, retVal};
-};
+  return make_sp<code_quasiquote> (std::move (elements));
+}
 
 ///////////////////////////////
-tco 
-handle_quasiquote (const ast_node_list *root_list, environment::ptr a_env)
+ast_node_code::ptr
+analyze_try (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
 {
-  const size_t list_size = root_list->size ();
-  if (list_size != 2)
+  if (root_list->size () != 3)
     raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
-  return handle_quasiquote_impl ((*root_list)[1], a_env);
-};
-
-///////////////////////////////
-ast_node::ptr
-is_macro_call (ast tree, environment::ptr a_env)
-{
-  if (tree->type () != node_type_enum::LIST)
-    return {};
-
-  // not as_or_throw - we know the type
-  auto root_list = tree->as<ast_node_list> ();
-  if (root_list->empty ())
-    return {};
 
-  auto first = (*root_list)[0];
-  if (first->type () != node_type_enum::SYMBOL)
-    return {};
-
-  const auto first_symbol = first->as<ast_node_symbol> ();
-  auto macro_node = a_env->get (first_symbol->symbol ());
+  auto catch_list = (*root_list)[2]->as_or_throw<ast_node_list, mal_exception_eval_invalid_arg> ();
+  if (catch_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
 
-  if (!macro_node)
-    return {};
+  if ((*catch_list)[0]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id () != SYMBOL_CATCH)
+    raise<mal_exception_eval_invalid_arg> (catch_list->to_string ());
 
-  if (!macro_node->as_or_zero<ast_node_macro_call> ())
-    return {};
+  auto catch_layout = make_sp<frame_layout> (scope);
+  catch_layout->add ((*catch_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ());
 
-  return macro_node;
+  return make_sp<code_try> (analyze ((*root_list)[1], scope, a_env), catch_layout, analyze ((*catch_list)[2], catch_layout, a_env));
 }
 
 ///////////////////////////////
-ast
-macroexpand (ast tree, environment::ptr a_env)
+// the code of a list must not refer to the list
+ast_node::ptr
+copy_form (const ast_node_list* root_list)
 {
-  ast_node::ptr macro_call;
-  while ( (macro_call = is_macro_call (tree, a_env)) != nullptr ) 
-  {
-    auto callable_list = tree->as<ast_node_list> ();
-    const size_t list_size = callable_list->size ();
-    assert (list_size > 0);
-
-    ast treeApply;
-    environment::ptr envApply;
-    ast retVal;
-    std::tie (treeApply, envApply, retVal) = macro_call->as<ast_node_macro_call> ()->callable_node ()->as<ast_node_callable> ()->call_tco (call_arguments (callable_list, 1, list_size - 1));
+  auto retVal = mal::make_list ();
+  for (size_t i = 0, e = root_list->size (); i < e; ++i)
+    retVal->add_child ((*root_list)[i]);
 
-    assert (!retVal);
-    tree = EVAL (treeApply, envApply);
-  }
-  return tree;
+  return retVal;
 }
 
 ///////////////////////////////
-ast
-EVAL (ast tree, environment::ptr a_env)
+ast_node_code::ptr
+analyze_apply (const ast_node_list* root_list, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
 {
-  for (;;)
-  {
-    if (tree->type () != node_type_enum::LIST)
-      return eval_ast (tree, a_env);
-
-    tree = macroexpand (tree, a_env);
-
-    if (tree->type () != node_type_enum::LIST)
-      return eval_ast (tree, a_env);
-
-    // not as_or_throw - we know the type
-    auto root_list = tree->as<ast_node_list> ();
-    if (root_list->empty ())
-      return tree;
+  auto first = (*root_list)[0];
 
-    //
-    auto fn_handle_def = [root_list, &a_env]()
-    {
-      if (root_list->size () != 3)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+  std::vector<ast_node_code::ptr> args;
+  for (size_t i = 1, e = root_list->size (); i < e; ++i)
+    args.push_back (analyze ((*root_list)[i], scope, a_env));
 
-      const auto& key = (*root_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol ();
+  ast_node::ptr form;
+  if (first->type () == node_type_enum::SYMBOL)
+    form = copy_form (root_list);
 
-      ast_node::ptr value = EVAL ((*root_list)[2], a_env);
-      a_env->set (key, value);
-      return value;
-    };
+  auto fn = analyze (first, scope, a_env);
+  if (!form)
+    return make_sp<code_apply> (fn, std::move (args), form, scope);
 
-    // tco
-    auto fn_handle_let_tco = [root_list, &a_env]() -> tco
-    {
-      if (root_list->size () != 3)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+  // the global the head is bound to now
+  uint32_t depth = 0;
+  const symbol_id symbol = first->as<ast_node_symbol> ()->id ();
+  ast_node::ptr builtin = resolve_local (symbol, scope, depth) < 0 ? a_env->get (symbol) : nullptr;
 
-      const ast_node_container_base* let_bindings = nullptr;
-      const auto root_list_arg_1 = (*root_list)[1];
-      switch (root_list_arg_1->type ())
-      {
-      case node_type_enum::LIST:
-      case node_type_enum::VECTOR:
-        let_bindings = root_list_arg_1->as<ast_node_container_base> ();
-        break;
-      default:
-        raise<mal_exception_eval_invalid_arg> (root_list_arg_1->to_string ());
-      };
+  if (auto pure = as_pure_builtin (builtin))
+  {
+    std::vector<fold_guard> guards {{fn, builtin}};
+    argument_frame values (args.size ());
+    size_t constants = 0;
+    while (constants < args.size () && args[constants]->is_constant (values[constants], guards))
+      ++constants;
+
+    ast_node::ptr value;
+    if (constants == args.size () && fold_pure_call (*pure, values, value))
+      return make_sp<code_folded> (value, std::move (guards), make_sp<code_apply> (fn, std::move (args), form, scope));
+  }
 
-      //
-      auto let_env = environment::make (a_env);
+  if (args.size () == 2 && builtin && builtin->type () == node_type_enum::CALLABLE_BUILTIN && builtin->as<ast_node_callable_builtin_base> ()->inline_op () != binary_op::NONE)
+  {
+    auto lhs = args[0];
+    auto rhs = args[1];
+    return make_sp<code_binary> (builtin, fn, lhs, rhs, make_sp<code_apply> (fn, std::move (args), form, scope));
+  }
 
-      if (let_bindings->size () % 2 != 0)
-        raise<mal_exception_eval_invalid_arg> (let_bindings->to_string ());
-      
-      for (size_t i = 0, e = let_bindings->size(); i < e; i += 2)
-      {
-        const auto& key = (*let_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol ();
-        ast_node::ptr value = EVAL ((*let_bindings)[i + 1], let_env);
+  return make_sp<code_apply> (fn, std::move (args), form, scope);
+}
 
-        let_env->set (key, value);
-      }
+///////////////////////////////
+ast_node_code::ptr
+analyze_list (const ast_node::ptr& form, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  // not as_or_throw - we know the type
+  auto root_list = form->as<ast_node_list> ();
+  if (root_list->empty ())
+    return make_sp<code_constant> (form);
 
-      return {(*root_list)[2], let_env};
-    };
+  auto first = (*root_list)[0];
+  if (first->type () != node_type_enum::SYMBOL)
+    return analyze_apply (root_list, scope, a_env);
 
-    // tco
-    auto fn_handle_apply_tco= [&tree, &a_env]() -> tco
+  // special symbols
+  const auto symbol = first->as<ast_node_symbol> ()->id ();
+  switch (symbol)
+  {
+  case SYMBOL_DEF:
+    return analyze_def (root_list, scope, a_env, false);
+  case SYMBOL_DEFMACRO:
+    return analyze_def (root_list, scope, a_env, true);
+  case SYMBOL_LET:
+    return analyze_let (root_list, scope, a_env);
+  case SYMBOL_DO:
+    return analyze_do (root_list, scope, a_env);
+  case SYMBOL_IF:
+    return analyze_if (root_list, scope, a_env);
+  case SYMBOL_FN:
+    return analyze_fn (root_list, scope, a_env);
+  case SYMBOL_QUOTE:
+    if (root_list->size () != 2)
+      raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+    return make_sp<code_constant> ((*root_list)[1]);
+  case SYMBOL_QUASIQUOTE:
+    if (root_list->size () != 2)
+      raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+    return analyze_quasiquote_impl ((*root_list)[1], scope, a_env);
+  case SYMBOL_MACROEXPAND:
+    if (root_list->size () != 2)
+      raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+    return make_sp<code_macroexpand> ((*root_list)[1]);
+  case SYMBOL_TRY:
+    return analyze_try (root_list, scope, a_env);
+  case SYMBOL_LOOP:
+  case SYMBOL_RECUR:
     {
-      ast_node::ptr new_node = eval_ast (tree, a_env);
-      auto callable_list = new_node->as_or_throw<ast_node_list, mal_exception_eval_not_list> ();
-
-      const size_t list_size = callable_list->size ();
-      if (list_size == 0)
-        raise<mal_exception_eval_not_callable> (callable_list->to_string ());
-
-      auto && callable_node = (*callable_list)[0]->as_or_throw<ast_node_callable, mal_exception_eval_not_callable> ();
+      // newer than the code which may use the names for locals - a local
+      // hides them, as it hides a macro
+      uint32_t depth = 0;
+      if (resolve_local (symbol, scope, depth) >= 0)
+        break;
 
-      return callable_node->call_tco (call_arguments (callable_list, 1, list_size - 1));
-    };
+      if (symbol == SYMBOL_LOOP)
+        return analyze_loop (root_list, scope, a_env);
+      return analyze_recur (root_list, scope, a_env);
+    }
+  default:
+    break;
+  }
 
-    // tco
-    auto fn_handle_do_tco = [root_list, &a_env]() -> tco
+  // a macro call - unless a local hides the macro. A failing expansion is
+  // left to the call to report
+  uint32_t depth = 0;
+  ast_node::ptr macro;
+  if (resolve_local (symbol, scope, depth) < 0 && (macro = is_macro_call (form, a_env)))
+  {
+    try
     {
-      const size_t list_size = root_list->size ();
-      if (list_size < 2)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
-
-      for (size_t i = 1, e = list_size - 1; i < e; ++i)
-      {
-        /*retVal = */EVAL ((*root_list)[i], a_env);
-      }
-
-      return {(*root_list)[list_size - 1], a_env};
-    };
-
-    // tco
-    auto fn_handle_if_tco = [root_list, &a_env] () -> tco
+      return make_sp<code_macro_call> (copy_form (root_list), scope, macro, a_env);
+    }
+    catch (const mal_exception&)
     {
-      const size_t list_size = root_list->size ();
-      if (list_size < 3 || list_size > 4)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+      return analyze_apply (root_list, scope, a_env);
+    }
+    catch (const ast_node::ptr&)
+    {
+      return analyze_apply (root_list, scope, a_env);
+    }
+  }
 
-      ast_node::ptr condNode = EVAL ((*root_list)[1], a_env);
-      const bool cond = !(condNode == ast_node::nil_node) && !(condNode == ast_node::false_node);
+  return analyze_apply (root_list, scope, a_env);
+}
 
-      if (cond)
-        return {(*root_list)[2], a_env};
-      else if (list_size == 4)
-        return {(*root_list)[3], a_env};
+///////////////////////////////
+ast_node_code::ptr
+analyze_form (const ast_node::ptr& form, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  switch (form->type ())
+  {
+  case node_type_enum::SYMBOL:
+    return analyze_symbol (form, scope);
 
-      return tco {nullptr, nullptr, ast_node::nil_node};
-    };
+  case node_type_enum::LIST:
+    return analyze_list (form, scope, a_env);
 
-    auto fn_handle_fn = [root_list, &a_env] () -> ast
+  case node_type_enum::VECTOR:
     {
-      const size_t list_size = root_list->size ();
-      if (list_size != 3)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
-
-      auto&& bindsNode = (*root_list)[1];
-      auto&& astNode = (*root_list)[2];
-
-      ast_node::ptr retVal = std::make_shared<ast_node_callable_lambda> (bindsNode, astNode, a_env);
-      return retVal;
-    };
+      if (form->has_flag (ast_node::FLAG_CONSTANT))
+        break;
 
-    auto fn_handle_quote = [root_list, &a_env] () -> ast
-    {
-      const size_t list_size = root_list->size ();
-      if (list_size != 2)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+      // not as_or_throw - we know the type
+      const auto& node_container = form->as<ast_node_container_base> ();
+      std::vector<ast_node_code::ptr> elements;
+      for (size_t i = 0, e = node_container->size (); i < e; ++i)
+        elements.push_back (analyze ((*node_container)[i], scope, a_env));
 
-      return (*root_list)[1];
-    };
+      return make_sp<code_vector> (std::move (elements));
+    }
 
-    //
-    auto fn_handle_defmacro = [root_list, &a_env]()
+  case node_type_enum::HASHMAP:
     {
-      if (root_list->size () != 3)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
-
-      const auto& key = (*root_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol ();
+      if (form->has_flag (ast_node::FLAG_CONSTANT))
+        break;
 
-      ast_node::ptr value = EVAL ((*root_list)[2], a_env);
-      auto macro_call = value->as_or_zero<ast_node_macro_call> ();
-      if (macro_call)
-        a_env->set (key, value);
-      else
-        a_env->set (key, std::make_shared<ast_node_macro_call> (value));
-      return value;
-    };
+      // not as_or_throw - we know the type
+      const auto& node_hashmap = form->as<ast_node_hashmap> ();
+      std::vector<code_hashmap::entry> entries;
+      node_hashmap->for_each ([&] (ast_node::ptr k, ast_node::ptr v) { entries.emplace_back (analyze (k, scope, a_env), analyze (v, scope, a_env)); });
 
-    //
-    auto fn_handle_macroexpand = [root_list, &a_env] () -> ast
-    {
-      const size_t list_size = root_list->size ();
-      if (list_size != 2)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+      return make_sp<code_hashmap> (std::move (entries));
+    }
 
-      return macroexpand ((*root_list)[1], a_env);
-    };
+  default:
+    break;
+  }
 
-    // try
-    auto fn_handle_try = [root_list, &a_env] () -> ast
-    {
-      const size_t list_size = root_list->size ();
-      if (list_size != 3)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+  return make_sp<code_constant> (form);
+}
 
-      auto eval_part = (*root_list)[1];
-      auto catch_list = (*root_list)[2]->as_or_throw<ast_node_list, mal_exception_eval_invalid_arg> ();
+///////////////////////////////
+ast_node_code::ptr
+analyze_tail (const ast_node::ptr& form, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  try
+  {
+    return analyze_form (form, scope, a_env);
+  }
+  catch (const mal_exception&)
+  {
+    return make_sp<code_raise> (std::current_exception ());
+  }
+  catch (const ast_node::ptr&)
+  {
+    return make_sp<code_raise> (std::current_exception ());
+  }
+}
 
-      const size_t catch_list_size = catch_list->size ();
-      if (catch_list_size != 3)
-        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+} // end of anonymous namespace
 
-      if ((*catch_list)[0]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->symbol () != "catch*")
-        raise<mal_exception_eval_invalid_arg> (catch_list->to_string ());
+///////////////////////////////
+ast_node_code::ptr
+analyze (const ast_node::ptr& form, const frame_layout::const_ptr& scope, const environment::ptr& a_env)
+{
+  // not a tail position of a loop body, see analyze_tail
+  recur_scope target (nullptr);
+  return analyze_tail (form, scope, a_env);
+}
 
-      auto bind_ex_symbol = (*catch_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ();
-      auto catch_eval_part = (*catch_list)[2];
+///////////////////////////////
+// stepA_mal --vm - forms go to the bytecode vm instead of the evaluator below
+static bool use_vm = false;
 
-      ast retVal;
-      try
-      {
-        retVal = EVAL (eval_part, a_env);
-      }
-      catch (const mal_exception& ex)
-      {
-        auto catch_env = environment::make (a_env);
-        catch_env->set (bind_ex_symbol->symbol (), mal::make_string (ex.what ()));
-        retVal = EVAL (catch_eval_part, catch_env);
-      }
-      catch (const ast_node::ptr& ex)
-      {
-        auto catch_env = environment::make (a_env);
-        catch_env->set (bind_ex_symbol->symbol (), ex);
-        retVal = EVAL (catch_eval_part, catch_env);
-      }
-      return retVal;
-    };
+///////////////////////////////
+ast
+EVAL (ast tree, environment::ptr a_env)
+{
+  if (use_vm)
+    return vm::eval (tree, a_env);
 
+  // every call of a lambda which is not a tail call comes here
+  stack_guard::check ();
 
-    auto first = (*root_list)[0];
-    if (first->type () == node_type_enum::SYMBOL)
+  for (;;)
+  {
+    ast_node::ptr code;
+    switch (tree->type ())
     {
-      // apply special symbols
-      // not as_or_throw - we know the type
-      const auto first_symbol = first->as<ast_node_symbol> ();
-      const auto& symbol = first_symbol->symbol ();
+    case node_type_enum::CODE:
+      code = tree;
+      break;
 
-      if (symbol == "def!")
-      {
-        return fn_handle_def ();
-      }
-      else if (symbol == "let*")
-      {
-        std::tie (tree, a_env, std::ignore) = fn_handle_let_tco ();
-        continue;
-      }
-      else if (symbol == "do")
-      {
-        std::tie (tree, a_env, std::ignore) = fn_handle_do_tco ();
-        continue;
-      }
-      else if (symbol == "if")
-      {
-        ast retVal;
-        std::tie (tree, a_env, retVal) = fn_handle_if_tco ();
-        if (retVal)
-          return retVal;
-        continue;
-      }
-      else if (symbol == "fn*")
-      {
-        return fn_handle_fn ();
-      }
-      else if (symbol == "quote")
-      {
-        return fn_handle_quote ();
-      }
-      else if (symbol == "quasiquote")
-      {
-        ast retVal;
-        std::tie (tree, a_env, retVal) = handle_quasiquote (root_list, a_env);
-        if (retVal)
-          return retVal;
-        continue;
-      }
-      else if (symbol == "defmacro!")
-      {
-        return fn_handle_defmacro ();
-      }
-      else if (symbol == "macroexpand")
-      {
-        return fn_handle_macroexpand ();
-      }
-      else if (symbol == "try*")
+    case node_type_enum::LIST:
       {
-        return fn_handle_try ();
-      }
-    }
+        // not as_or_throw - we know the type
+        auto root_list = tree->as<ast_node_list> ();
+        if (root_list->empty ())
+          return tree;
 
-    // apply
-    {
-      ast retVal;
-      std::tie (tree, a_env, retVal) = fn_handle_apply_tco ();
-      if (retVal)
-        return retVal;
-      continue;
-    }
+        code = root_list->code ();
+        if (!code)
+        {
+          code = analyze (tree, nullptr, a_env);
+          root_list->set_code (code);
+        }
+      }
+      break;
 
-  }
-}
+    case node_type_enum::SYMBOL:
+      // not as_or_throw - we know the type
+      return a_env->get_or_throw (tree->as<ast_node_symbol> ()->id ());
 
+    case node_type_enum::VECTOR:
+    case node_type_enum::HASHMAP:
+      // a literal of constants is its own value, see is_constant_literal
+      if (tree->has_flag (ast_node::FLAG_CONSTANT))
+        return tree;
 
-///////////////////////////////
-ast
-eval_ast (ast tree, environment::ptr a_env)
-{
-  switch (tree->type ())
-  {
-  case node_type_enum::SYMBOL:
-    {
-      // not as_or_throw - we know the type
-      const auto& node_symbol = tree->as<ast_node_symbol> ();
-      return a_env->get_or_throw (node_symbol->symbol ());
+      code = analyze (tree, nullptr, a_env);
+      break;
 
-    }
-  case node_type_enum::LIST:
-  case node_type_enum::VECTOR:
-    {
-      // not as_or_throw - we know the type
-      const auto& node_container = tree->as<ast_node_container_base> ();
-      // TODO - add here optimization to do not clone underlying node if the current pointer is unique!
-      return node_container->map (
-        [&a_env] (ast_node::ptr v) { 
-          return EVAL (v, a_env);
-        });
-    }
-  case node_type_enum::HASHMAP:
-    {
-      // not as_or_throw - we know the type
-      const auto& node_hashmap = tree->as<ast_node_hashmap> ();
-      auto retVal = mal::make_hashmap ();
-      node_hashmap->for_each ([&] (ast_node::ptr k, ast_node::ptr v) { retVal->insert (EVAL (k, a_env), EVAL (v, a_env)); });
-      return static_cast<ast_node::ptr> (retVal);
+    default:
+      return tree;
     }
 
-  default:
-    break;
+    ast retVal;
+    std::tie (tree, a_env, retVal) = code->as<ast_node_code> ()->eval_tco (a_env);
+    if (retVal)
+      return retVal;
   }
-
-  return tree;
 }
 
 ///////////////////////////////
@@ -516,7 +1615,7 @@ PRINT (ast tree)
 std::string
 rep (const std::string& line, environment::ptr env)
 {
-  return PRINT (EVAL ( READ (line), env));
+  return PRINT (ast_node_raised::value_or_throw (EVAL ( READ (line), env)));
 }
 
 
@@ -570,8 +1669,30 @@ mainRepl (environment::ptr env)
 int
 main(int argc, char** argv)
 {
+  // --vm: evaluate with the bytecode vm. --max-depth N: the most calls
+  // the vm keeps active at once
+  while (argc > 1 && std::string (argv [1]).compare (0, 2, "--") == 0)
+  {
+    const std::string option = argv [1];
+    if (option == "--vm")
+      use_vm = true;
+    else if (option == "--max-depth" && argc > 2)
+    {
+      vm::set_max_depth (std::stoul (argv [2]));
+      --argc;
+      ++argv;
+    }
+    else
+      break;
+
+    --argc;
+    ++argv;
+  }
+
   auto env = environment::make ();
   core ns (env);
+  env->set ("macro-cache-stats", make_sp<ast_node_callable_builtin<decltype (&builtin_macro_cache_stats)>> ("macro-cache-stats", &builtin_macro_cache_stats));
+  env->set ("throw", make_sp<ast_node_callable_builtin<decltype (&builtin_throw)>> ("throw", &builtin_throw));
 
   // argv
   auto argvList = mal::make_list ();
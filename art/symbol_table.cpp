@@ -0,0 +1,109 @@
+#include "symbol_table.h"
+
+#include <assert.h>
+
+///////////////////////////////
+/// symbol_table class
+///////////////////////////////
+symbol_table::symbol_table ()
+{
+  // same order as known_symbol
+  for (auto && name : {"def!", "let*", "do", "if", "fn*", "quote", "quasiquote", "unquote", "splice-unquote",
+                       "defmacro!", "macroexpand", "try*", "catch*", "&", "loop", "recur"})
+  {
+    const symbol_id id = static_cast<symbol_id> (m_symbols.size ());
+    m_symbols.emplace_back (new interned_symbol (name, id));
+
+    // never released
+    m_symbols.back ()->m_refcount = 1;
+    m_lookup.emplace (m_symbols.back ()->name (), m_symbols.back ().get ());
+  }
+  assert (m_symbols.size () == KNOWN_SYMBOL_COUNT);
+}
+
+///////////////////////////////
+symbol_table&
+symbol_table::instance ()
+{
+  // function local - symbols get interned by static initializers too.
+  // Never destroyed, nodes may release symbols during static destruction
+  static symbol_table* retVal = new symbol_table;
+  return *retVal;
+}
+
+///////////////////////////////
+const interned_symbol&
+symbol_table::intern (const std::string& name)
+{
+  auto& table = instance ();
+
+  auto it = table.m_lookup.find (name);
+  if (it != table.m_lookup.end ())
+    return *it->second;
+
+  symbol_id id = static_cast<symbol_id> (table.m_symbols.size ());
+  if (!table.m_free_ids.empty ())
+  {
+    id = table.m_free_ids.back ();
+    table.m_free_ids.pop_back ();
+  }
+  else
+  {
+    table.m_symbols.emplace_back ();
+  }
+
+  table.m_symbols[id].reset (new interned_symbol (name, id));
+  interned_symbol& retVal = *table.m_symbols[id];
+  table.m_lookup.emplace (retVal.name (), &retVal);
+  return retVal;
+}
+
+///////////////////////////////
+const interned_symbol*
+symbol_table::find (const std::string& name)
+{
+  auto& table = instance ();
+
+  auto it = table.m_lookup.find (name);
+  return it != table.m_lookup.end () ? it->second : nullptr;
+}
+
+///////////////////////////////
+const interned_symbol&
+symbol_table::get (symbol_id id)
+{
+  auto& table = instance ();
+  assert (id < table.m_symbols.size () && table.m_symbols[id]);
+  return *table.m_symbols[id];
+}
+
+///////////////////////////////
+void
+symbol_table::add_ref (symbol_id id)
+{
+  ++instance ().m_symbols[id]->m_refcount;
+}
+
+///////////////////////////////
+void
+symbol_table::release (symbol_id id)
+{
+  auto& table = instance ();
+  auto& symbol = table.m_symbols[id];
+  assert (symbol && symbol->m_refcount > 0);
+
+  if (--symbol->m_refcount != 0)
+    return;
+
+  table.m_lookup.erase (symbol->name ());
+  symbol.reset ();
+  table.m_free_ids.push_back (id);
+}
+
+///////////////////////////////
+size_t
+symbol_table::size ()
+{
+  auto& table = instance ();
+  return table.m_symbols.size () - table.m_free_ids.size ();
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+///////////////////////////////
+using symbol_id = uint32_t;
+
+///////////////////////////////
+// symbols interned before anything else, in this order, so their ids are
+// compile time constants (e.g. for the special form checks in EVAL)
+enum known_symbol : symbol_id
+{
+  SYMBOL_DEF = 0,           // def!
+  SYMBOL_LET,               // let*
+  SYMBOL_DO,                // do
+  SYMBOL_IF,                // if
+  SYMBOL_FN,                // fn*
+  SYMBOL_QUOTE,             // quote
+  SYMBOL_QUASIQUOTE,        // quasiquote
+  SYMBOL_UNQUOTE,           // unquote
+  SYMBOL_SPLICE_UNQUOTE,    // splice-unquote
+  SYMBOL_DEFMACRO,          // defmacro!
+  SYMBOL_MACROEXPAND,       // macroexpand
+  SYMBOL_TRY,               // try*
+  SYMBOL_CATCH,             // catch*
+  SYMBOL_VARIADIC,          // &
+  SYMBOL_LOOP,              // loop
+  SYMBOL_RECUR,             // recur
+  KNOWN_SYMBOL_COUNT
+};
+
+///////////////////////////////
+class interned_symbol
+{
+public:
+  interned_symbol (std::string name, symbol_id id)
+    : m_name (std::move (name))
+    , m_hash (static_cast<uint32_t> (std::hash<std::string> () (m_name)))
+    , m_id (id)
+  {}
+
+  const std::string& name () const
+  {
+    return m_name;
+  }
+
+  uint32_t hash () const
+  {
+    return m_hash;
+  }
+
+  // dense, ids of released symbols are reused
+  symbol_id id () const
+  {
+    return m_id;
+  }
+
+private:
+  friend class symbol_table;
+
+  interned_symbol (const interned_symbol&) = delete;
+  interned_symbol& operator = (const interned_symbol&) = delete;
+
+  std::string m_name;
+  uint32_t m_hash;
+  symbol_id m_id;
+  uint32_t m_refcount = 0;
+};
+
+///////////////////////////////
+// process-wide, not thread safe. Symbols are reference counted by their
+// users (symbol nodes, environment keys), so generated symbols - think
+// gensym - go away with the code that used them. Known symbols stay.
+class symbol_table
+{
+public:
+  // the symbol stays interned while somebody holds a reference
+  static const interned_symbol& intern (const std::string& name);
+  // nullptr if the name is not interned
+  static const interned_symbol* find (const std::string& name);
+  static const interned_symbol& get (symbol_id id);
+
+  static void add_ref (symbol_id id);
+  static void release (symbol_id id);
+
+  // number of live symbols
+  static size_t size ();
+
+private:
+  symbol_table ();
+  static symbol_table& instance ();
+
+  std::unordered_map<std::string, interned_symbol*> m_lookup;
+  std::vector<std::unique_ptr<interned_symbol>> m_symbols;
+  std::vector<symbol_id> m_free_ids;
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+#include "pointer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include <assert.h>
+
+///////////////////////////////
+// persistent bit-partitioned trie of WIDTH-wide nodes. It holds the
+// elements of full leaves only - a vector keeps the rest in a tail of its
+// own and moves the tail here once it is full. Immutable: an update copies
+// the path from the root to the changed leaf and shares everything else
+// with the trie it was made from, so copying a vector copies only its
+// tail. nullptr is the empty trie.
+template <typename T>
+class vector_trie
+{
+public:
+  using const_ptr = sp<const vector_trie>;
+
+  static constexpr uint32_t BITS = 5;
+  static constexpr size_t WIDTH = size_t (1) << BITS;
+  static constexpr size_t MASK = WIDTH - 1;
+
+  // a multiple of WIDTH
+  size_t size () const
+  {
+    return m_size;
+  }
+
+  const T& operator [] (size_t index) const
+  {
+    assert (index < m_size);
+    return leaf_of (index)->values[index & MASK];
+  }
+
+  // the trie with the WIDTH values after its elements, moved from values
+  static const_ptr push_leaf (const const_ptr& trie, T* values)
+  {
+    sp<leaf_node> leaf (new leaf_node);
+    for (size_t i = 0; i < WIDTH; ++i)
+      leaf->values[i] = std::move (values[i]);
+
+    if (!trie)
+      return const_ptr (new vector_trie (leaf, 0, WIDTH));
+
+    // a full root gets a parent
+    node_ptr root = trie->m_root;
+    uint32_t shift = trie->m_shift;
+    if (trie->m_size == (WIDTH << shift))
+    {
+      sp<inner_node> grown (new inner_node);
+      grown->children[0] = root;
+      root = grown;
+      shift += BITS;
+    }
+
+    return const_ptr (new vector_trie (insert (root.get (), shift, trie->m_size, leaf), shift, trie->m_size + WIDTH));
+  }
+
+  // the trie without its last leaf, whose values are passed to out
+  template <typename Fn>
+  static const_ptr pop_leaf (const const_ptr& trie, const Fn& out)
+  {
+    assert (trie);
+    const size_t index = trie->m_size - WIDTH;
+    const leaf_node* leaf = trie->leaf_of (index);
+    for (size_t i = 0; i < WIDTH; ++i)
+      out (leaf->values[i]);
+
+    if (index == 0)
+      return nullptr;
+
+    node_ptr root = remove (trie->m_root.get (), trie->m_shift, index);
+    uint32_t shift = trie->m_shift;
+
+    // a root with a single child is not needed
+    if (shift > 0 && index <= (WIDTH << (shift - BITS)))
+    {
+      root = static_cast<const inner_node*> (root.get ())->children[0];
+      shift -= BITS;
+    }
+
+    return const_ptr (new vector_trie (root, shift, index));
+  }
+
+  // the trie with the element at index replaced
+  const_ptr set (size_t index, T value) const
+  {
+    assert (index < m_size);
+    return const_ptr (new vector_trie (replace (m_root.get (), m_shift, index, std::move (value)), m_shift, m_size));
+  }
+
+  // fn (const T&) for every element, in order
+  template <typename Fn>
+  void for_each (const Fn& fn) const
+  {
+    for (size_t i = 0; i < m_size; i += WIDTH)
+    {
+      const leaf_node* leaf = leaf_of (i);
+      for (size_t k = 0; k < WIDTH; ++k)
+        fn (leaf->values[k]);
+    }
+  }
+
+private:
+  struct node;
+  using node_ptr = sp<const node>;
+
+  // a leaf holds WIDTH values, any other node up to WIDTH children from
+  // the left
+  struct node
+  {
+    explicit node (bool is_leaf)
+      : leaf (is_leaf)
+    {}
+
+    mutable uint32_t refcount = 0;
+    const bool leaf;
+
+    friend void intrusive_add_ref (const node* n)
+    {
+      ++n->refcount;
+    }
+
+    friend void intrusive_release (const node* n)
+    {
+      if (--n->refcount != 0)
+        return;
+
+      if (n->leaf)
+        delete static_cast<const leaf_node*> (n);
+      else
+        delete static_cast<const inner_node*> (n);
+    }
+  };
+
+  struct inner_node : node
+  {
+    inner_node ()
+      : node (false)
+    {}
+
+    node_ptr children[WIDTH];
+  };
+
+  struct leaf_node : node
+  {
+    leaf_node ()
+      : node (true)
+    {}
+
+    T values[WIDTH];
+  };
+
+  vector_trie (node_ptr root, uint32_t shift, size_t size)
+    : m_root (std::move (root))
+    , m_shift (shift)
+    , m_size (size)
+  {}
+
+  vector_trie (const vector_trie&) = delete;
+  vector_trie& operator = (const vector_trie&) = delete;
+
+  friend void intrusive_add_ref (const vector_trie* trie)
+  {
+    ++trie->m_refcount;
+  }
+
+  friend void intrusive_release (const vector_trie* trie)
+  {
+    if (--trie->m_refcount == 0)
+      delete trie;
+  }
+
+  const leaf_node* leaf_of (size_t index) const
+  {
+    const node* n = m_root.get ();
+    for (uint32_t level = m_shift; level > 0; level -= BITS)
+      n = static_cast<const inner_node*> (n)->children[(index >> level) & MASK].get ();
+
+    return static_cast<const leaf_node*> (n);
+  }
+
+  static inner_node* copy_of (const node* n)
+  {
+    auto retVal = new inner_node;
+    if (n)
+    {
+      for (size_t i = 0; i < WIDTH; ++i)
+        retVal->children[i] = static_cast<const inner_node*> (n)->children[i];
+    }
+    return retVal;
+  }
+
+  // the node at level with leaf as the one starting at index - a new path
+  // below where n is nullptr
+  static node_ptr insert (const node* n, uint32_t level, size_t index, const node_ptr& leaf)
+  {
+    if (level == 0)
+      return leaf;
+
+    sp<inner_node> copy (copy_of (n));
+    const size_t child = (index >> level) & MASK;
+    copy->children[child] = insert (copy->children[child].get (), level - BITS, index, leaf);
+    return copy;
+  }
+
+  // the node at level without the last leaf, which starts at index.
+  // nullptr if nothing is left of it
+  static node_ptr remove (const node* n, uint32_t level, size_t index)
+  {
+    if (level == 0)
+      return nullptr;
+
+    const size_t child = (index >> level) & MASK;
+    node_ptr rest = remove (static_cast<const inner_node*> (n)->children[child].get (), level - BITS, index);
+    if (!rest && child == 0)
+      return nullptr;
+
+    sp<inner_node> copy (copy_of (n));
+    copy->children[child] = rest;
+    return copy;
+  }
+
+  static node_ptr replace (const node* n, uint32_t level, size_t index, T value)
+  {
+    if (level == 0)
+    {
+      sp<leaf_node> leaf (new leaf_node);
+      for (size_t i = 0; i < WIDTH; ++i)
+        leaf->values[i] = static_cast<const leaf_node*> (n)->values[i];
+      leaf->values[index & MASK] = std::move (value);
+      return leaf;
+    }
+
+    sp<inner_node> copy (copy_of (n));
+    const size_t child = (index >> level) & MASK;
+    copy->children[child] = replace (copy->children[child].get (), level - BITS, index, std::move (value));
+    return copy;
+  }
+
+  mutable uint32_t m_refcount = 0;
+  node_ptr m_root;
+  uint32_t m_shift;
+  size_t m_size;
+};
+
+template <typename T>
+constexpr uint32_t vector_trie<T>::BITS;
+template <typename T>
+constexpr size_t vector_trie<T>::WIDTH;
+template <typename T>
+constexpr size_t vector_trie<T>::MASK;
@@ -0,0 +1,2274 @@
+#include "vm.h"
+#include "ast_details.h"
+#include "exceptions.h"
+#include "stack_guard.h"
+
+#include <algorithm>
+#include <exception>
+#include <tuple>
+#include <vector>
+
+namespace
+{
+
+///////////////////////////////
+// R - registers of the frame, K - constants, F - nested functions,
+// U - upvalues of the closure, E - errors found by the compiler,
+// G - global references, M - macro sites
+enum class opcode : uint8_t
+{
+  LOAD_CONST,     // R[a] = K[b]
+  MOVE,           // R[a] = R[b]
+  GET_GLOBAL,     // R[a] = env[symbol b], G[c] caches its binding cell
+  GET_CALLEE,     // GET_GLOBAL of the head of M[c], if it is a macro: R[a] = M[c] run anew
+  SET_GLOBAL,     // env[symbol b] = R[a]
+  SET_MACRO,      // env[symbol b] = macro R[a]
+  MAKE_MACRO,     // R[a] = macro R[b]
+  GET_UPVAL,      // R[a] = U[b]
+  JUMP,           // pc = b
+  JUMP_IF_FALSE,  // if R[a] is nil or false: pc = b
+  JUMP_IF_NOT_CONST, // if R[a] is not K[c]: pc = b
+  CLOSURE,        // R[a] = closure of F[b]
+  CALL,           // R[a] = R[a] (R[a + 1] .. R[a + b])
+  TAIL_CALL,      // return R[a] (R[a + 1] .. R[a + b])
+  CALL_BINARY,    // CALL with b = 2, inline if R[a] is the builtin of S[c]
+  TAIL_CALL_BINARY, // TAIL_CALL with b = 2, inline if R[a] is the builtin of S[c]
+  RETURN,         // return R[a]
+  MAKE_VECTOR,    // R[a] = [R[b] .. R[b + c - 1]]
+  MAKE_HASHMAP,   // R[a] = {R[b] R[b + 1] .. R[b + c - 1]}
+  QUASIQUOTE,     // R[a] = (R[b] ..), K[c] tells which elements are spliced
+  MACROEXPAND,    // R[a] = macroexpand K[b]
+  MACRO_GUARD,    // if the head of M[b] is not the macro it was expanded with: R[a] = M[b] run anew
+  TRY,            // an error until END_TRY: R[a] = the error, pc = b
+  END_TRY,
+  CLOSE_UPVALS,   // closes the upvalues of R[a] and above
+  RAISE,          // throws E[a]
+};
+
+///////////////////////////////
+struct instruction
+{
+  opcode op;
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+};
+
+///////////////////////////////
+// a local captured by a closure. Open while the local is alive - the
+// value is in its register then, found by the stack index - and closed,
+// holding the value itself, once the frame or block of the local ends
+class vm_upvalue
+{
+public:
+  using ptr = sp<vm_upvalue>;
+
+  explicit vm_upvalue (size_t index)
+    : m_index (index)
+  {}
+
+  // closed from the start, see machine::run_site
+  explicit vm_upvalue (ast_node::ptr value)
+    : m_index (0)
+    , m_open (false)
+    , m_value (value)
+  {}
+
+  size_t index () const
+  {
+    return m_index;
+  }
+
+  bool is_open () const
+  {
+    return m_open;
+  }
+
+  const ast_node::ptr& get (const std::vector<ast_node::ptr>& stack) const
+  {
+    return m_open ? stack[m_index] : m_value;
+  }
+
+  void close (const std::vector<ast_node::ptr>& stack)
+  {
+    m_value = stack[m_index];
+    m_open = false;
+  }
+
+private:
+  vm_upvalue (const vm_upvalue&) = delete;
+  vm_upvalue& operator = (const vm_upvalue&) = delete;
+
+  friend void intrusive_add_ref (const vm_upvalue* upvalue)
+  {
+    ++upvalue->m_refcount;
+  }
+
+  friend void intrusive_release (const vm_upvalue* upvalue)
+  {
+    if (--upvalue->m_refcount == 0)
+      delete upvalue;
+  }
+
+  mutable uint32_t m_refcount = 0;
+  size_t m_index;
+  bool m_open = true;
+  ast_node::ptr m_value;
+};
+
+///////////////////////////////
+// compiled fn* or top level form
+struct vm_function
+{
+  using ptr = sp<vm_function>;
+  using const_ptr = sp<const vm_function>;
+
+  // where a new closure takes an upvalue from - a register of the frame
+  // creating it or an upvalue of the closure creating it
+  struct capture
+  {
+    bool from_register;
+    uint32_t index;
+    // the name, see macro_site
+    symbol_id id;
+  };
+
+  vm_function () = default;
+  vm_function (const vm_function&) = delete;
+  vm_function& operator = (const vm_function&) = delete;
+
+  std::vector<instruction> code;
+  std::vector<ast_node::ptr> constants;
+  std::vector<const_ptr> functions;
+  std::vector<std::exception_ptr> errors;
+  std::vector<capture> captures;
+
+  // a global the code reads, see environment::root_cell
+  struct global
+  {
+    ast_node::ptr symbol;
+    mutable const ast_node::ptr* cell;
+    mutable environment::const_ptr root;
+  };
+  std::vector<global> globals;
+
+  // a call site of an inline builtin, see apply_binary_op
+  struct binary_site
+  {
+    ast_node::ptr builtin;
+    mutable map_slot_cache cache;
+  };
+  std::vector<binary_site> binary_sites;
+
+  // a call site whose code holds while its head is bound to what it was
+  // when compiled: the expansion of a macro call (MACRO_GUARD) or a call
+  // of a global (GET_CALLEE). Once the head changed, the form is compiled
+  // again as a function of no params and run by the frame, with the
+  // locals of the site - see machine::run_site
+  struct macro_site
+  {
+    // a local of the frame in scope at the site
+    struct local
+    {
+      symbol_id id;
+      uint32_t reg;
+      bool assigned;
+    };
+
+    ast_node::ptr form;
+    // the macro of the expansion, nullptr for a call
+    ast_node::ptr macro;
+    std::vector<local> locals;
+    // the names the functions around bind, this one has the upvalues it
+    // captured of them
+    std::vector<symbol_id> outer;
+    // the code after the site
+    uint32_t resume;
+    // of GET_CALLEE
+    uint32_t global;
+
+    // whether the head is the macro, as of the epoch - see
+    // ast_node_macro_call::epoch
+    mutable uint64_t epoch;
+    mutable bool expanded;
+    // the form compiled again
+    mutable const_ptr recompiled;
+  };
+  std::vector<macro_site> macro_sites;
+
+  uint32_t register_count = 0;
+  // arguments are in the first registers, the rest list after them
+  uint32_t param_count = 0;
+  bool variadic = false;
+
+  // a multi-arity fn*: the code of each arity starts at its entry, the
+  // params above are not used
+  struct arity
+  {
+    uint32_t entry;
+    uint32_t param_count;
+    bool variadic;
+  };
+  std::vector<arity> arities;
+  arity_dispatch dispatch;
+
+  // the fn* it was compiled from, for printing and comparing
+  ast_node::ptr binds;
+  ast_node::ptr body;
+
+  mutable uint32_t refcount = 0;
+};
+
+///////////////////////////////
+void intrusive_add_ref (const vm_function* function)
+{
+  ++function->refcount;
+}
+
+///////////////////////////////
+void intrusive_release (const vm_function* function)
+{
+  if (--function->refcount == 0)
+    delete function;
+}
+
+///////////////////////////////
+class vm_closure : public ast_node_callable
+{
+public:
+  vm_closure (vm_function::const_ptr function, environment::ptr env)
+    : ast_node_callable (node_type_enum::CALLABLE_VM_CLOSURE)
+    , m_function (function)
+    , m_env (env)
+  {}
+
+  std::string to_string (bool print_readable) const override
+  {
+    if (m_function->arities.empty ())
+      return "#callable-lambda" + m_function->binds->to_string () + " -> " + m_function->body->to_string ();
+
+    // the body is the list of clauses, see compiler::compile_multi_fn
+    std::string retVal = "#callable-lambda";
+    auto clauses = m_function->body->as<ast_node_list> ();
+    for (size_t i = 0, e = clauses->size (); i < e; ++i)
+    {
+      auto clause = (*clauses)[i]->as<ast_node_list> ();
+      retVal += "(" + (*clause)[0]->to_string () + " -> " + (*clause)[1]->to_string () + ")";
+    }
+    return retVal;
+  }
+
+  tco call_tco (const call_arguments&) const override;
+
+  bool operator == (const ast_node& rp) const override
+  {
+    if (type () != rp.type ())
+      return false;
+
+    auto rp_closure = rp.as<vm_closure> ();
+    return equals (*m_function->binds, *rp_closure->m_function->binds) && equals (*m_function->body, *rp_closure->m_function->body);
+  }
+
+  uint32_t hash () const override
+  {
+    return (m_function->binds->hash () * 1622000167 + 582512737) * m_function->body->hash () + 2152752083;
+  }
+
+  static constexpr bool IS_VALID_TYPE (node_type_enum t)
+  {
+    return node_type_enum::CALLABLE_VM_CLOSURE == t;
+  }
+
+  const vm_function& function () const
+  {
+    return *m_function;
+  }
+
+  // globals
+  const environment::ptr& env () const
+  {
+    return m_env;
+  }
+
+  const vm_upvalue::ptr& upvalue (size_t index) const
+  {
+    return m_upvalues[index];
+  }
+
+  void add_upvalue (vm_upvalue::ptr upvalue)
+  {
+    m_upvalues.push_back (upvalue);
+  }
+
+protected:
+  mutable_ptr clone () const override
+  {
+    auto retVal = make_sp<vm_closure> (m_function, m_env);
+    retVal->m_upvalues = m_upvalues;
+    return retVal;
+  }
+
+private:
+  vm_function::const_ptr m_function;
+  environment::ptr m_env;
+  std::vector<vm_upvalue::ptr> m_upvalues;
+};
+
+///////////////////////////////
+// the tree a vm closure called through call_tco continues with: the call
+// is left pending in the machine, so a builtin ending in a call (apply)
+// leaves a tail call to the code which called the builtin. vm::eval of it
+// runs the call
+class vm_pending_call final : public ast_node_base<node_type_enum::VM_CALL>
+{
+public:
+  std::string to_string (bool print_readable) const override
+  {
+    return "#vm-call";
+  }
+
+  bool operator == (const ast_node& rp) const override
+  {
+    return this == std::addressof (rp);
+  }
+
+  uint32_t hash () const override
+  {
+    const uint32_t retVal = reinterpret_cast<uint64_t> (this) * 2052828881 + 541325663;
+    return retVal;
+  }
+
+  static const ast_node::ptr& instance ()
+  {
+    static const ast_node::ptr retVal = make_sp<vm_pending_call> ();
+    return retVal;
+  }
+
+protected:
+  mutable_ptr clone () const override
+  {
+    return mutable_ptr (const_cast<vm_pending_call*> (this));
+  }
+};
+
+///////////////////////////////
+// the form of a macro site compiled as a function of no params, in the
+// scope of the site. function - the one of the site
+vm_function::const_ptr
+compile_site (const vm_function::macro_site& site, const vm_function& function, const environment::ptr& env);
+
+// a closure of no params running form at the top level of env, the
+// macros it calls expanded in place. nullptr if it expands to a do - its
+// forms are evaluated one by one then, so each sees the def!s of those
+// before (see vm::eval)
+sp<const vm_closure>
+compile_top_level (ast_node::ptr& form, const environment::ptr& env);
+
+///////////////////////////////
+// the macro a form calls, nullptr if it is not a macro call
+ast_node::ptr
+macro_of (const ast_node::ptr& form, const environment::ptr& env)
+{
+  auto form_list = form->as_or_zero<ast_node_list> ();
+  if (!form_list || form_list->empty ())
+    return nullptr;
+
+  auto first_symbol = (*form_list)[0]->as_or_zero<ast_node_symbol> ();
+  if (!first_symbol)
+    return nullptr;
+
+  auto macro_node = env->get (first_symbol->id ());
+  if (!macro_node || !macro_node->as_or_zero<ast_node_macro_call> ())
+    return nullptr;
+
+  return macro_node;
+}
+
+///////////////////////////////
+ast_node::ptr
+expand (const ast_node::ptr& form, const ast_node::ptr& macro)
+{
+  auto form_list = form->as<ast_node_list> ();
+
+  ast tree;
+  environment::ptr env;
+  ast retVal;
+  std::tie (tree, env, retVal) = macro->as<ast_node_macro_call> ()->callable_node ()->as<ast_node_callable> ()->call_tco (call_arguments (form_list, 1, form_list->size () - 1));
+
+  return ast_node_raised::value_or_throw (retVal ? ast_node::ptr (retVal) : vm::eval (tree, env));
+}
+
+///////////////////////////////
+ast_node::ptr
+macroexpand (ast_node::ptr form, const environment::ptr& env)
+{
+  while (auto macro = macro_of (form, env))
+    form = expand (form, macro);
+
+  return form;
+}
+
+///////////////////////////////
+/// machine class
+///////////////////////////////
+class machine
+{
+public:
+  static machine& instance ()
+  {
+    static machine retVal;
+    return retVal;
+  }
+
+  // runs the closure to its value, on top of the calls active already
+  ast_node::ptr call (const vm_closure& closure, const call_arguments& args);
+
+  // a call to make next - the arguments wait above the top frame. Returns
+  // the tree (vm_pending_call) to continue with
+  tco defer (const vm_closure& closure, const call_arguments& args);
+  // runs the deferred call to its value
+  ast_node::ptr call_pending ();
+
+  void set_max_depth (size_t depth)
+  {
+    m_max_depth = depth;
+  }
+
+private:
+  struct frame
+  {
+    sp<const vm_closure> closure;
+    const instruction* pc;
+    size_t base;
+    // stack index of the register of the caller the value goes to
+    size_t result;
+  };
+
+  struct handler
+  {
+    size_t frame;
+    const instruction* pc;
+    size_t exception;
+  };
+
+  machine ()
+  {
+    m_stack.resize (1024);
+  }
+
+  ast_node::ptr run (size_t floor);
+  ast_node::ptr execute (size_t floor);
+  bool unwind (size_t floor, ast_node::ptr error);
+
+  size_t push_frame (const ast_node::ptr& callee, size_t argc, size_t result);
+  void drop_arguments (size_t argc);
+  void bind_arguments (const vm_function& function, size_t base, size_t argc);
+  void pop_frame ();
+
+  vm_upvalue::ptr capture_upvalue (size_t index);
+  void close_upvalues (size_t level);
+
+  void ensure_stack (size_t size)
+  {
+    if (size > m_stack.size ())
+      m_stack.resize (std::max (size, m_stack.size () * 2));
+  }
+
+  std::vector<ast_node::ptr> m_stack;
+  std::vector<frame> m_frames;
+  std::vector<handler> m_handlers;
+  // sorted by the stack index
+  std::vector<vm_upvalue::ptr> m_open_upvalues;
+
+  // first stack index above the registers of the top frame
+  size_t m_top = 0;
+
+  // see defer, the arguments are at m_top
+  sp<const vm_closure> m_pending;
+  size_t m_pending_argc = 0;
+
+  // of m_frames. The memory of the stack and the frames is kept, so deep
+  // calls allocate only the first time
+  size_t m_max_depth = 1000000;
+};
+
+///////////////////////////////
+ast_node::ptr
+machine::call (const vm_closure& closure, const call_arguments& args)
+{
+  defer (closure, args);
+  return call_pending ();
+}
+
+///////////////////////////////
+tco
+machine::defer (const vm_closure& closure, const call_arguments& args)
+{
+  const size_t argc = args.size ();
+
+  // a builtin called by the machine passes on its registers, growing the
+  // stack moves them
+  const ast_node::ptr* argv = argc ? &args[0] : nullptr;
+  const bool on_stack = argc && !std::less<const ast_node::ptr*> () (argv, m_stack.data ()) && std::less<const ast_node::ptr*> () (argv, m_stack.data () + m_stack.size ());
+  const size_t offset = on_stack ? argv - m_stack.data () : 0;
+
+  ensure_stack (m_top + argc);
+  if (on_stack)
+    argv = m_stack.data () + offset;
+  for (size_t i = 0; i < argc; ++i)
+    m_stack[m_top + i] = argv[i];
+
+  m_pending = sp<const vm_closure> (&closure);
+  m_pending_argc = argc;
+  return tco {vm_pending_call::instance (), nullptr, nullptr};
+}
+
+///////////////////////////////
+ast_node::ptr
+machine::call_pending ()
+{
+  assert (m_pending);
+  const size_t floor = m_frames.size ();
+  sp<const vm_closure> closure = std::move (m_pending);
+
+  // a run nested in a builtin or a macro expansion, the machine recurses
+  // on the C++ stack only here
+  if (stack_guard::exhausted ())
+  {
+    drop_arguments (m_pending_argc);
+    stack_guard::overflow ();
+  }
+
+  try
+  {
+    const size_t base = push_frame (ast_node::ptr (closure), m_pending_argc, 0);
+    bind_arguments (closure->function (), base, m_pending_argc);
+  }
+  catch (...)
+  {
+    while (m_frames.size () > floor)
+      pop_frame ();
+    throw;
+  }
+
+  return run (floor);
+}
+
+///////////////////////////////
+// the frames above floor are of this run. An error unwinds to the
+// innermost try* of them, or out of the run
+ast_node::ptr
+machine::run (size_t floor)
+{
+  for (;;)
+  {
+    try
+    {
+      return execute (floor);
+    }
+    catch (const mal_exception& ex)
+    {
+      if (!unwind (floor, mal::make_string (ex.what ())))
+        throw;
+    }
+    catch (const ast_node::ptr& ex)
+    {
+      if (!unwind (floor, ex))
+        throw;
+    }
+  }
+}
+
+///////////////////////////////
+// false if no try* of the run catches the error, the frames of the run
+// are gone then
+bool
+machine::unwind (size_t floor, ast_node::ptr error)
+{
+  if (!m_handlers.empty () && m_handlers.back ().frame >= floor)
+  {
+    const handler h = m_handlers.back ();
+    m_handlers.pop_back ();
+
+    while (m_frames.size () > h.frame + 1)
+      pop_frame ();
+
+    close_upvalues (h.exception);
+    m_stack[h.exception] = error;
+    m_frames.back ().pc = h.pc;
+    return true;
+  }
+
+  while (m_frames.size () > floor)
+    pop_frame ();
+
+  return false;
+}
+
+///////////////////////////////
+// the frame starts above the top one, the caller puts argc arguments to
+// its first registers and binds them. Returns the base of the frame
+size_t
+machine::push_frame (const ast_node::ptr& callee, size_t argc, size_t result)
+{
+  if (m_frames.size () >= m_max_depth)
+  {
+    drop_arguments (argc);
+    // the error the tree evaluator raises, so try* sees the same value
+    stack_guard::overflow ();
+  }
+
+  sp<const vm_closure> closure (callee->as<vm_closure> ());
+  const vm_function& function = closure->function ();
+
+  const size_t base = m_top;
+  ensure_stack (base + std::max<size_t> (function.register_count, argc));
+
+  m_frames.push_back ({closure, function.code.data (), base, result});
+  m_top = base + function.register_count;
+  return base;
+}
+
+///////////////////////////////
+// the arguments of a call which does not start. Those of a deferred one
+// wait above the top frame, nothing else is there
+void
+machine::drop_arguments (size_t argc)
+{
+  for (size_t i = m_top, e = std::min (m_top + argc, m_stack.size ()); i < e; ++i)
+    m_stack[i] = nullptr;
+}
+
+///////////////////////////////
+void
+machine::bind_arguments (const vm_function& function, size_t base, size_t argc)
+{
+  auto reject = [&] (std::string message)
+  {
+    // the extra ones are above the registers the frame clears
+    for (size_t i = function.register_count; i < argc; ++i)
+      m_stack[base + i] = nullptr;
+    raise<mal_exception_eval_invalid_arg> (std::move (message));
+  };
+
+  uint32_t param_count = function.param_count;
+  bool variadic = function.variadic;
+  if (!function.arities.empty ())
+  {
+    const int index = function.dispatch.select (argc);
+    if (index < 0)
+      reject ("no arity takes " + std::to_string (argc) + " arguments");
+
+    // the top frame starts at the entry of the arity
+    const vm_function::arity& arity = function.arities[index];
+    m_frames.back ().pc = function.code.data () + arity.entry;
+    param_count = arity.param_count;
+    variadic = arity.variadic;
+  }
+
+  if (!variadic && argc == param_count)
+    return;
+
+  auto error = ast_node_callable_lambda::arity_error (param_count, variadic, argc);
+  if (!error.empty ())
+    reject (std::move (error));
+
+  auto rest = mal::make_list (call_arguments (m_stack.data () + base, argc), param_count);
+  for (size_t i = param_count; i < argc; ++i)
+    m_stack[base + i] = nullptr;
+  m_stack[base + param_count] = rest;
+}
+
+///////////////////////////////
+// registers are cleared, so values do not outlive their frame
+void
+machine::pop_frame ()
+{
+  const frame& f = m_frames.back ();
+  const size_t top = f.base + f.closure->function ().register_count;
+
+  close_upvalues (f.base);
+  for (size_t i = f.base; i < top; ++i)
+    m_stack[i] = nullptr;
+
+  while (!m_handlers.empty () && m_handlers.back ().frame + 1 >= m_frames.size ())
+    m_handlers.pop_back ();
+
+  m_frames.pop_back ();
+  m_top = m_frames.empty () ? 0 : m_frames.back ().base + m_frames.back ().closure->function ().register_count;
+}
+
+///////////////////////////////
+vm_upvalue::ptr
+machine::capture_upvalue (size_t index)
+{
+  auto it = m_open_upvalues.end ();
+  while (it != m_open_upvalues.begin () && (*(it - 1))->index () >= index)
+  {
+    --it;
+    if ((*it)->index () == index)
+      return *it;
+  }
+
+  return *m_open_upvalues.insert (it, make_sp<vm_upvalue> (index));
+}
+
+///////////////////////////////
+void
+machine::close_upvalues (size_t level)
+{
+  while (!m_open_upvalues.empty () && m_open_upvalues.back ()->index () >= level)
+  {
+    m_open_upvalues.back ()->close (m_stack);
+    m_open_upvalues.pop_back ();
+  }
+}
+
+///////////////////////////////
+ast_node::ptr
+machine::execute (size_t floor)
+{
+  // the top frame, reloaded whenever frames or the stack may have changed
+  frame* f;
+  const vm_function* function;
+  const instruction* pc;
+  ast_node::ptr* regs;
+
+  auto load = [&] ()
+  {
+    f = &m_frames.back ();
+    function = &f->closure->function ();
+    pc = f->pc;
+    regs = m_stack.data () + f->base;
+  };
+
+  // a callable which is not a closure of the vm - builtins, hashmaps. A
+  // tree it continues with is evaluated, unless it is a call of a vm
+  // closure - that is left to the instruction, with the arguments at
+  // m_top. Returns nullptr then
+  auto call_other = [&] (const ast_node::ptr& callee, const instruction& i) -> ast_node::ptr
+  {
+    f->pc = pc;
+    auto callable = callee->as_or_throw<ast_node_callable, mal_exception_eval_not_callable> ();
+
+    ast tree;
+    environment::ptr env;
+    ast retVal;
+    std::tie (tree, env, retVal) = callable->call_tco (call_arguments (regs + i.a + 1, i.b));
+    // a builtin calling a closure (map, apply) runs the machine, which may
+    // have moved the frames and the stack
+    load ();
+    for (uint32_t k = 1; k <= i.b; ++k)
+      regs[i.a + k] = nullptr;
+
+    if (retVal)
+      return retVal;
+
+    if (tree->type () == node_type_enum::VM_CALL)
+      return nullptr;
+
+    // a form to evaluate (eval, or a tree the callable continues with) is
+    // compiled and called by the instruction, a tail call stays one. The
+    // expansion runs the machine
+    ast_node::ptr form = tree;
+    auto closure = compile_top_level (form, env);
+    load ();
+    if (closure)
+    {
+      m_pending = std::move (closure);
+      m_pending_argc = 0;
+      return nullptr;
+    }
+
+    ast_node::ptr value = vm::eval (form, env);
+    load ();
+    return value;
+  };
+
+  // a value a callable threw, see ast_node_raised: on to the innermost
+  // try* of the run. false if there is none - the value leaves the run
+  // raised then
+  auto catch_raised = [&] () -> bool
+  {
+    ast_node::ptr error = ast_node_raised::take ();
+    if (!unwind (floor, error))
+    {
+      ast_node_raised::raise (std::move (error));
+      return false;
+    }
+
+    load ();
+    return true;
+  };
+
+  // the top frame returns the value to its caller. false if it was the
+  // first frame of the run, the run returns the value then
+  auto return_value = [&] (ast_node::ptr& value) -> bool
+  {
+    const size_t result = f->result;
+    pop_frame ();
+    if (m_frames.size () == floor)
+      return false;
+
+    m_stack[result] = std::move (value);
+    load ();
+    return true;
+  };
+
+  // CALL_BINARY, TAIL_CALL_BINARY: R[a] = the value of the inline
+  // builtin. false if the call is an ordinary one
+  auto call_binary = [&] (const instruction& i) -> bool
+  {
+    const vm_function::binary_site& site = function->binary_sites[i.c];
+    if (regs[i.a] != site.builtin)
+      return false;
+
+    const binary_op op = static_cast<const ast_node_callable_builtin_base*> (site.builtin.get ())->inline_op ();
+    if (op != binary_op::GET)
+      return apply_binary_op (op, regs[i.a + 1], regs[i.a + 2], regs[i.a]);
+
+    if (!apply_get (regs[i.a + 1], regs[i.a + 2], site.cache, regs[i.a]))
+      return false;
+
+    // the map is not kept alive by its register
+    regs[i.a + 1] = nullptr;
+    regs[i.a + 2] = nullptr;
+    return true;
+  };
+
+  // a global, by its binding cell while the name is not bound in a
+  // nested environment
+  auto global_value = [&] (symbol_id id, const vm_function::global& g) -> ast_node::ptr
+  {
+    if (!environment::is_bound_nested (id))
+    {
+      if (!g.cell)
+        g.cell = f->closure->env ()->root_cell (id, g.root);
+
+      if (g.cell)
+        return *g.cell;
+    }
+    return f->closure->env ()->get_or_throw (id);
+  };
+
+  // a macro site whose code does not hold any more: the form, compiled
+  // again, is called with the locals of the frame - by value, the site
+  // runs before they change - and returns to the resume of the site with
+  // the value in R[dst]
+  auto run_site = [&] (const vm_function::macro_site& site, uint32_t dst)
+  {
+    f->pc = function->code.data () + site.resume;
+    if (!site.recompiled)
+    {
+      // the expansion runs the machine
+      site.recompiled = compile_site (site, *function, f->closure->env ());
+      load ();
+    }
+
+    auto closure = make_sp<vm_closure> (site.recompiled, f->closure->env ());
+    for (auto && c : site.recompiled->captures)
+    {
+      if (c.from_register)
+        closure->add_upvalue (make_sp<vm_upvalue> (regs[c.index]));
+      else
+        closure->add_upvalue (f->closure->upvalue (c.index));
+    }
+
+    push_frame (closure, 0, f->base + dst);
+    load ();
+  };
+
+  load ();
+  for (;;)
+  {
+    const instruction& i = *pc++;
+    switch (i.op)
+    {
+    case opcode::LOAD_CONST:
+      regs[i.a] = function->constants[i.b];
+      break;
+
+    case opcode::MOVE:
+      regs[i.a] = regs[i.b];
+      break;
+
+    case opcode::GET_GLOBAL:
+      regs[i.a] = global_value (i.b, function->globals[i.c]);
+      break;
+
+    case opcode::GET_CALLEE:
+      {
+        const vm_function::macro_site& site = function->macro_sites[i.c];
+        regs[i.a] = global_value (i.b, function->globals[site.global]);
+        if (regs[i.a]->type () == node_type_enum::MACRO_CALL)
+          run_site (site, i.a);
+      }
+      break;
+
+    case opcode::SET_GLOBAL:
+      // (re)defining a macro outdates the expansions of the call sites
+      {
+        auto&& env = f->closure->env ();
+        ast_node::ptr value = env->get (i.b);
+        if (regs[i.a]->type () == node_type_enum::MACRO_CALL || (value && value->type () == node_type_enum::MACRO_CALL))
+          ++ast_node_macro_call::epoch;
+        env->set (i.b, regs[i.a]);
+      }
+      break;
+
+    case opcode::SET_MACRO:
+      ++ast_node_macro_call::epoch;
+      if (regs[i.a]->as_or_zero<ast_node_macro_call> ())
+        f->closure->env ()->set (i.b, regs[i.a]);
+      else
+        f->closure->env ()->set (i.b, make_sp<ast_node_macro_call> (regs[i.a]));
+      break;
+
+    case opcode::MAKE_MACRO:
+      if (regs[i.b]->as_or_zero<ast_node_macro_call> ())
+        regs[i.a] = regs[i.b];
+      else
+        regs[i.a] = make_sp<ast_node_macro_call> (regs[i.b]);
+      break;
+
+    case opcode::GET_UPVAL:
+      regs[i.a] = f->closure->upvalue (i.b)->get (m_stack);
+      break;
+
+    case opcode::JUMP:
+      pc = function->code.data () + i.b;
+      break;
+
+    case opcode::JUMP_IF_FALSE:
+      if (regs[i.a] == ast_node::nil_node || regs[i.a] == ast_node::false_node)
+        pc = function->code.data () + i.b;
+      break;
+
+    case opcode::JUMP_IF_NOT_CONST:
+      if (regs[i.a] != function->constants[i.c])
+        pc = function->code.data () + i.b;
+      break;
+
+    case opcode::CLOSURE:
+      {
+        auto&& nested = function->functions[i.b];
+        auto closure = make_sp<vm_closure> (nested, f->closure->env ());
+        for (auto && c : nested->captures)
+        {
+          if (c.from_register)
+            closure->add_upvalue (capture_upvalue (f->base + c.index));
+          else
+            closure->add_upvalue (f->closure->upvalue (c.index));
+        }
+        regs[i.a] = closure;
+      }
+      break;
+
+    case opcode::CALL_BINARY:
+      // the arguments are immediates or cleared, see call_binary
+      if (call_binary (i))
+        break;
+      // fall through
+    case opcode::CALL:
+      {
+        // the arguments, as a stack index
+        sp<const vm_closure> closure;
+        size_t args = f->base + i.a + 1;
+        size_t argc = i.b;
+
+        ast_node::ptr callee = regs[i.a];
+        if (callee->type () == node_type_enum::CALLABLE_VM_CLOSURE)
+          closure = sp<const vm_closure> (callee->as<vm_closure> ());
+        else
+        {
+          ast_node::ptr value = call_other (callee, i);
+          if (ast_node_raised::is (value))
+          {
+            if (!catch_raised ())
+              return value;
+            break;
+          }
+
+          if (value)
+          {
+            regs[i.a] = std::move (value);
+            break;
+          }
+
+          closure = std::move (m_pending);
+          args = m_top;
+          argc = m_pending_argc;
+        }
+
+        f->pc = pc;
+        const size_t base = push_frame (ast_node::ptr (closure), argc, f->base + i.a);
+        if (args != base)
+        {
+          for (size_t k = 0; k < argc; ++k)
+            m_stack[base + k] = std::move (m_stack[args + k]);
+        }
+        bind_arguments (closure->function (), base, argc);
+        load ();
+      }
+      break;
+
+    case opcode::TAIL_CALL_BINARY:
+      if (call_binary (i))
+      {
+        ast_node::ptr value = std::move (regs[i.a]);
+        if (!return_value (value))
+          return value;
+        break;
+      }
+      // fall through
+    case opcode::TAIL_CALL:
+      {
+        // the arguments, as a register index
+        sp<const vm_closure> closure;
+        size_t args = i.a + 1;
+        size_t argc = i.b;
+
+        ast_node::ptr callee = regs[i.a];
+        if (callee->type () == node_type_enum::CALLABLE_VM_CLOSURE)
+          closure = sp<const vm_closure> (callee->as<vm_closure> ());
+        else
+        {
+          ast_node::ptr value = call_other (callee, i);
+          if (ast_node_raised::is (value))
+          {
+            if (!catch_raised ())
+              return value;
+            break;
+          }
+
+          if (value)
+          {
+            if (!return_value (value))
+              return value;
+            break;
+          }
+
+          closure = std::move (m_pending);
+          args = m_top - f->base;
+          argc = m_pending_argc;
+        }
+
+        // the frame is reused for the callee
+        close_upvalues (f->base);
+
+        for (size_t k = 0; k < argc; ++k)
+          regs[k] = std::move (regs[args + k]);
+        for (size_t k = argc, e = function->register_count; k < e; ++k)
+          regs[k] = nullptr;
+
+        f->closure = std::move (closure);
+        const vm_function& callee_function = f->closure->function ();
+        f->pc = callee_function.code.data ();
+
+        ensure_stack (f->base + std::max<size_t> (callee_function.register_count, argc));
+        m_top = f->base + callee_function.register_count;
+        bind_arguments (callee_function, f->base, argc);
+        load ();
+      }
+      break;
+
+    case opcode::RETURN:
+      {
+        ast_node::ptr value = std::move (regs[i.a]);
+        if (!return_value (value))
+          return value;
+      }
+      break;
+
+    case opcode::MAKE_VECTOR:
+      {
+        auto retVal = mal::make_vector ();
+        for (uint32_t k = 0; k < i.c; ++k)
+          retVal->add_child (regs[i.b + k]);
+        regs[i.a] = retVal;
+      }
+      break;
+
+    case opcode::MAKE_HASHMAP:
+      {
+        auto retVal = mal::make_hashmap ();
+        for (uint32_t k = 0; k < i.c; k += 2)
+          retVal->insert (regs[i.b + k], regs[i.b + k + 1]);
+        regs[i.a] = retVal;
+      }
+      break;
+
+    case opcode::QUASIQUOTE:
+      {
+        auto splices = function->constants[i.c]->as<ast_node_container_base> ();
+        auto retVal = mal::make_list ();
+        for (size_t k = 0, e = splices->size (); k < e; ++k)
+        {
+          auto&& value = regs[i.b + k];
+          if ((*splices)[k] != ast_node::true_node)
+          {
+            retVal->add_child (value);
+            continue;
+          }
+
+          auto splicedList = value->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ();
+          for (size_t c = 0, ce = splicedList->size (); c < ce; ++c)
+            retVal->add_child ((*splicedList) [c]);
+        }
+        regs[i.a] = retVal;
+      }
+      break;
+
+    case opcode::MACROEXPAND:
+      {
+        f->pc = pc;
+        ast_node::ptr value = macroexpand (function->constants[i.b], f->closure->env ());
+        load ();
+        regs[i.a] = value;
+      }
+      break;
+
+    case opcode::MACRO_GUARD:
+      {
+        const vm_function::macro_site& site = function->macro_sites[i.b];
+        if (site.epoch != ast_node_macro_call::epoch)
+        {
+          site.epoch = ast_node_macro_call::epoch;
+          site.expanded = macro_of (site.form, f->closure->env ()) == site.macro;
+        }
+
+        if (site.expanded)
+          ++ast_node_macro_call::cache_hits;
+        else
+          run_site (site, i.a);
+      }
+      break;
+
+    case opcode::TRY:
+      m_handlers.push_back ({m_frames.size () - 1, function->code.data () + i.b, f->base + i.a});
+      break;
+
+    case opcode::END_TRY:
+      m_handlers.pop_back ();
+      break;
+
+    case opcode::CLOSE_UPVALS:
+      close_upvalues (f->base + i.a);
+      break;
+
+    case opcode::RAISE:
+      std::rethrow_exception (function->errors[i.a]);
+    }
+  }
+}
+
+///////////////////////////////
+/// compiler class
+///////////////////////////////
+// one per function. Registers are allocated as a stack: the locals of the
+// open blocks (fn* params, let*, catch*, def! in a block), then the
+// temporaries of the expression being compiled
+class compiler
+{
+public:
+  compiler (compiler* parent, const environment::ptr& env)
+    : m_parent (parent)
+    , m_env (env)
+    , m_function (make_sp<vm_function> ())
+  {}
+
+  // the scope of a macro site, the parent of the function its form is
+  // compiled to again. It compiles nothing itself
+  compiler (const vm_function::macro_site& site, const vm_function& function, const environment::ptr& env)
+    : m_parent (nullptr)
+    , m_env (env)
+    , m_function (make_sp<vm_function> ())
+    , m_site (&site)
+    , m_site_function (&function)
+  {
+    for (auto && l : site.locals)
+      m_locals.push_back ({l.id, l.reg, l.assigned, false});
+  }
+
+  const vm_function::ptr& function () const
+  {
+    return m_function;
+  }
+
+  uint32_t alloc_register ()
+  {
+    const uint32_t retVal = m_free++;
+    m_function->register_count = std::max (m_function->register_count, m_free);
+    return retVal;
+  }
+
+  // the value of form to register dst. In a tail position the code
+  // returns the value. Errors in the form are raised when it runs
+  void compile (const ast_node::ptr& form, uint32_t dst, bool tail)
+  {
+    // not a tail position of a loop body, see compile_tail
+    const loop_target* outer_recur = m_recur;
+    m_recur = nullptr;
+    compile_tail (form, dst, tail);
+    m_recur = outer_recur;
+  }
+
+  // fn* params, see bind_arguments
+  void compile_params (const ast_node_container_base& binds);
+
+private:
+  // the registers of the names of a loop and the start of its body
+  struct loop_target
+  {
+    uint32_t first_register;
+    uint32_t count;
+    uint32_t start;
+  };
+
+  struct local
+  {
+    symbol_id id;
+    uint32_t reg;
+    // a let* or def! local before it gets its value - not seen by the
+    // code of the frame, but closures see it
+    bool assigned;
+    bool captured;
+  };
+
+  // as compile, in a tail position of a loop body - a recur in the form
+  // jumps to m_recur
+  void compile_tail (const ast_node::ptr& form, uint32_t dst, bool tail);
+  void compile_form (const ast_node::ptr& form, uint32_t dst, bool tail);
+  void compile_symbol (const ast_node::ptr& form, uint32_t dst);
+  void compile_list (const ast_node::ptr& form, uint32_t dst, bool tail);
+  void compile_macro_call (const ast_node::ptr& form, const ast_node::ptr& macro, uint32_t dst, bool tail);
+  void compile_def (const ast_node_list* root_list, uint32_t dst, bool tail, bool is_macro);
+  void compile_let (const ast_node_list* root_list, uint32_t dst, bool tail);
+  void compile_loop (const ast_node_list* root_list, uint32_t dst, bool tail);
+  void compile_recur (const ast_node_list* root_list);
+  void compile_do (const ast_node_list* root_list, uint32_t dst, bool tail);
+  void compile_if (const ast_node_list* root_list, uint32_t dst, bool tail);
+  void compile_fn (const ast_node_list* root_list, uint32_t dst, bool tail);
+  void compile_multi_fn (const ast_node_list* root_list, uint32_t dst, bool tail);
+  void compile_quasiquote (const ast_node::ptr& node, uint32_t dst);
+  void compile_try (const ast_node_list* root_list, uint32_t dst, bool tail);
+  void compile_call (const ast_node::ptr& form, uint32_t dst, bool tail);
+  void compile_apply (const ast_node::ptr& form, uint32_t dst, bool tail);
+  // the inline core builtin a global head is bound to now, see
+  // apply_binary_op. nullptr if there is none
+  ast_node::ptr inline_builtin_of (const ast_node::ptr& head) const;
+
+  // a global head of a folded call and the builtin it was bound to
+  struct fold_guard
+  {
+    ast_node::ptr symbol;
+    ast_node::ptr builtin;
+  };
+
+  // the value of a constant literal, a quote or a call of a pure builtin
+  // on such forms (see fold_pure_call), false for any other form. The
+  // heads of the folded calls are added to guards
+  bool fold (const ast_node::ptr& form, ast_node::ptr& value, std::vector<fold_guard>& guards) const;
+  bool fold_call (const ast_node_list* root_list, ast_node::ptr& value, std::vector<fold_guard>& guards) const;
+
+  void free_registers (uint32_t to)
+  {
+    for (auto && l : m_locals)
+      to = std::max (to, l.reg + 1);
+    m_free = to;
+  }
+
+  uint32_t emit (opcode op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0)
+  {
+    m_function->code.push_back ({op, a, b, c});
+    return static_cast<uint32_t> (m_function->code.size () - 1);
+  }
+
+  uint32_t here () const
+  {
+    return static_cast<uint32_t> (m_function->code.size ());
+  }
+
+  uint32_t add_constant (ast_node::ptr value)
+  {
+    m_function->constants.push_back (value);
+    return static_cast<uint32_t> (m_function->constants.size () - 1);
+  }
+
+  void declare (symbol_id id, uint32_t reg, bool assigned)
+  {
+    m_locals.push_back ({id, reg, assigned, false});
+  }
+
+  // index in m_locals, -1 if none
+  int find_local (symbol_id id, bool for_capture) const
+  {
+    for (size_t i = m_locals.size (); i > 0; --i)
+    {
+      auto && l = m_locals[i - 1];
+      if (l.id == id && (l.assigned || for_capture))
+        return static_cast<int> (i - 1);
+    }
+    return -1;
+  }
+
+  int resolve_upvalue (symbol_id id);
+  uint32_t add_capture (bool from_register, uint32_t index, symbol_id id);
+
+  // the name is bound by a fn*, let*, catch* or def! around
+  bool is_local (symbol_id id) const
+  {
+    for (const compiler* c = this; c; c = c->m_parent)
+    {
+      if (c->find_local (id, true) >= 0)
+        return true;
+      if (c->m_site && std::find (c->m_site->outer.begin (), c->m_site->outer.end (), id) != c->m_site->outer.end ())
+        return true;
+    }
+    return false;
+  }
+
+  // a macro site of the form, with the locals in scope now
+  uint32_t add_site (const ast_node::ptr& form, const ast_node::ptr& macro);
+
+  // locals of the block started at block are gone
+  void end_block (size_t block, uint32_t first_register, bool tail);
+
+  compiler* m_parent;
+  environment::ptr m_env;
+  vm_function::ptr m_function;
+
+  std::vector<local> m_locals;
+  // def! adds to the innermost block
+  size_t m_block = 0;
+  uint32_t m_free = 0;
+  // the loop a recur compiled now jumps to, nullptr if there is none
+  const loop_target* m_recur = nullptr;
+
+  // of the scope of a macro site, see its constructor
+  const vm_function::macro_site* m_site = nullptr;
+  const vm_function* m_site_function = nullptr;
+};
+
+///////////////////////////////
+void
+compiler::compile_tail (const ast_node::ptr& form, uint32_t dst, bool tail)
+{
+  const size_t code_size = m_function->code.size ();
+  const size_t locals = m_locals.size ();
+  const size_t block = m_block;
+  const uint32_t free = m_free;
+
+  std::exception_ptr error;
+  try
+  {
+    compile_form (form, dst, tail);
+    return;
+  }
+  catch (const mal_exception&)
+  {
+    error = std::current_exception ();
+  }
+  catch (const ast_node::ptr&)
+  {
+    error = std::current_exception ();
+  }
+
+  m_function->code.resize (code_size);
+  m_locals.resize (locals);
+  m_block = block;
+  m_free = free;
+
+  m_function->errors.push_back (error);
+  emit (opcode::RAISE, static_cast<uint32_t> (m_function->errors.size () - 1));
+}
+
+///////////////////////////////
+void
+compiler::compile_params (const ast_node_container_base& binds)
+{
+  const size_t variadic = ast_node_callable_lambda::check_params (binds);
+  for (size_t i = 0, e = binds.size (); i < e; ++i)
+  {
+    if (i == variadic)
+      continue;
+
+    declare (binds[i]->as<ast_node_symbol> ()->id (), alloc_register (), true);
+    if (i < variadic)
+      ++m_function->param_count;
+  }
+  m_function->variadic = variadic != binds.size ();
+}
+
+///////////////////////////////
+void
+compiler::compile_form (const ast_node::ptr& form, uint32_t dst, bool tail)
+{
+  switch (form->type ())
+  {
+  case node_type_enum::SYMBOL:
+    compile_symbol (form, dst);
+    break;
+
+  case node_type_enum::LIST:
+    compile_list (form, dst, tail);
+    return;
+
+  case node_type_enum::VECTOR:
+    {
+      if (form->has_flag (ast_node::FLAG_CONSTANT))
+      {
+        emit (opcode::LOAD_CONST, dst, add_constant (form));
+        break;
+      }
+
+      // not as_or_throw - we know the type
+      const auto& node_container = form->as<ast_node_container_base> ();
+      const uint32_t saved = m_free;
+      const uint32_t count = static_cast<uint32_t> (node_container->size ());
+      const uint32_t first = m_free;
+      for (uint32_t i = 0; i < count; ++i)
+        alloc_register ();
+      for (uint32_t i = 0; i < count; ++i)
+        compile ((*node_container)[i], first + i, false);
+
+      emit (opcode::MAKE_VECTOR, dst, first, count);
+      free_registers (saved);
+    }
+    break;
+
+  case node_type_enum::HASHMAP:
+    {
+      if (form->has_flag (ast_node::FLAG_CONSTANT))
+      {
+        emit (opcode::LOAD_CONST, dst, add_constant (form));
+        break;
+      }
+
+      // not as_or_throw - we know the type
+      const auto& node_hashmap = form->as<ast_node_hashmap> ();
+      std::vector<ast_node::ptr> entries;
+      node_hashmap->for_each ([&] (ast_node::ptr k, ast_node::ptr v) { entries.push_back (k); entries.push_back (v); });
+
+      const uint32_t saved = m_free;
+      const uint32_t count = static_cast<uint32_t> (entries.size ());
+      const uint32_t first = m_free;
+      for (uint32_t i = 0; i < count; ++i)
+        alloc_register ();
+      for (uint32_t i = 0; i < count; ++i)
+        compile (entries[i], first + i, false);
+
+      emit (opcode::MAKE_HASHMAP, dst, first, count);
+      free_registers (saved);
+    }
+    break;
+
+  default:
+    emit (opcode::LOAD_CONST, dst, add_constant (form));
+    break;
+  }
+
+  if (tail)
+    emit (opcode::RETURN, dst);
+}
+
+///////////////////////////////
+void
+compiler::compile_symbol (const ast_node::ptr& form, uint32_t dst)
+{
+  const symbol_id id = form->as<ast_node_symbol> ()->id ();
+
+  const int local = find_local (id, false);
+  if (local >= 0)
+  {
+    if (m_locals[local].reg != dst)
+      emit (opcode::MOVE, dst, m_locals[local].reg);
+    return;
+  }
+
+  const int upvalue = resolve_upvalue (id);
+  if (upvalue >= 0)
+  {
+    emit (opcode::GET_UPVAL, dst, upvalue);
+    return;
+  }
+
+  // the entry keeps the symbol interned
+  m_function->globals.push_back ({form, nullptr, nullptr});
+  emit (opcode::GET_GLOBAL, dst, id, static_cast<uint32_t> (m_function->globals.size () - 1));
+}
+
+///////////////////////////////
+int
+compiler::resolve_upvalue (symbol_id id)
+{
+  // the scope of a macro site has the upvalues its function captured
+  if (m_site)
+  {
+    for (size_t i = 0, e = m_site_function->captures.size (); i < e; ++i)
+    {
+      if (m_site_function->captures[i].id == id)
+        return static_cast<int> (i);
+    }
+
+    if (std::find (m_site->outer.begin (), m_site->outer.end (), id) != m_site->outer.end ())
+      raise<mal_exception_eval_invalid_arg> (symbol_table::get (id).name () + " is not captured by the function of " + m_site->form->to_string ());
+    return -1;
+  }
+
+  if (!m_parent)
+    return -1;
+
+  const int local = m_parent->find_local (id, true);
+  if (local >= 0)
+  {
+    // a local of a macro site is captured by value, see machine::run_site
+    if (m_parent->m_site && !m_parent->m_locals[local].assigned)
+      raise<mal_exception_eval_invalid_arg> (symbol_table::get (id).name () + " has no value yet in " + m_parent->m_site->form->to_string ());
+
+    m_parent->m_locals[local].captured = true;
+    return add_capture (true, m_parent->m_locals[local].reg, id);
+  }
+
+  const int upvalue = m_parent->resolve_upvalue (id);
+  if (upvalue >= 0)
+    return add_capture (false, upvalue, id);
+
+  return -1;
+}
+
+///////////////////////////////
+uint32_t
+compiler::add_capture (bool from_register, uint32_t index, symbol_id id)
+{
+  auto&& captures = m_function->captures;
+  for (size_t i = 0, e = captures.size (); i < e; ++i)
+  {
+    if (captures[i].from_register == from_register && captures[i].index == index)
+      return static_cast<uint32_t> (i);
+  }
+
+  captures.push_back ({from_register, index, id});
+  return static_cast<uint32_t> (captures.size () - 1);
+}
+
+///////////////////////////////
+uint32_t
+compiler::add_site (const ast_node::ptr& form, const ast_node::ptr& macro)
+{
+  vm_function::macro_site site {form, macro, {}, {}, 0, 0, ast_node_macro_call::epoch, true, nullptr};
+  for (auto && l : m_locals)
+    site.locals.push_back ({l.id, l.reg, l.assigned});
+
+  for (const compiler* c = m_parent; c; c = c->m_parent)
+  {
+    for (auto && l : c->m_locals)
+      site.outer.push_back (l.id);
+    if (c->m_site)
+      site.outer.insert (site.outer.end (), c->m_site->outer.begin (), c->m_site->outer.end ());
+  }
+
+  m_function->macro_sites.push_back (std::move (site));
+  return static_cast<uint32_t> (m_function->macro_sites.size () - 1);
+}
+
+///////////////////////////////
+void
+compiler::end_block (size_t block, uint32_t first_register, bool tail)
+{
+  bool captured = false;
+  for (size_t i = block, e = m_locals.size (); i < e; ++i)
+    captured = captured || m_locals[i].captured;
+
+  m_locals.resize (block);
+
+  // a tail position has returned, and that closed them
+  if (captured && !tail)
+    emit (opcode::CLOSE_UPVALS, first_register);
+
+  free_registers (first_register);
+}
+
+///////////////////////////////
+void
+compiler::compile_list (const ast_node::ptr& form, uint32_t dst, bool tail)
+{
+  // not as_or_throw - we know the type
+  auto root_list = form->as<ast_node_list> ();
+  if (root_list->empty ())
+  {
+    emit (opcode::LOAD_CONST, dst, add_constant (form));
+    if (tail)
+      emit (opcode::RETURN, dst);
+    return;
+  }
+
+  auto first = (*root_list)[0];
+  if (first->type () == node_type_enum::SYMBOL)
+  {
+    const auto symbol = first->as<ast_node_symbol> ()->id ();
+    switch (symbol)
+    {
+    case SYMBOL_DEF:
+      return compile_def (root_list, dst, tail, false);
+    case SYMBOL_DEFMACRO:
+      return compile_def (root_list, dst, tail, true);
+    case SYMBOL_LET:
+      return compile_let (root_list, dst, tail);
+    case SYMBOL_DO:
+      return compile_do (root_list, dst, tail);
+    case SYMBOL_IF:
+      return compile_if (root_list, dst, tail);
+    case SYMBOL_FN:
+      return compile_fn (root_list, dst, tail);
+    case SYMBOL_QUOTE:
+      if (root_list->size () != 2)
+        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+      emit (opcode::LOAD_CONST, dst, add_constant ((*root_list)[1]));
+      break;
+    case SYMBOL_QUASIQUOTE:
+      if (root_list->size () != 2)
+        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+      compile_quasiquote ((*root_list)[1], dst);
+      break;
+    case SYMBOL_MACROEXPAND:
+      if (root_list->size () != 2)
+        raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+      emit (opcode::MACROEXPAND, dst, add_constant ((*root_list)[1]));
+      break;
+    case SYMBOL_TRY:
+      return compile_try (root_list, dst, tail);
+    case SYMBOL_LOOP:
+      // not reserved - a local of the name hides them, as it hides a macro
+      if (!is_local (symbol))
+        return compile_loop (root_list, dst, tail);
+      return compile_call (form, dst, tail);
+    case SYMBOL_RECUR:
+      if (!is_local (symbol))
+        return compile_recur (root_list);
+      return compile_call (form, dst, tail);
+
+    default:
+      // a macro call - unless a local hides the macro
+      if (!is_local (symbol))
+      {
+        if (auto macro = macro_of (form, m_env))
+          return compile_macro_call (form, macro, dst, tail);
+      }
+      return compile_call (form, dst, tail);
+    }
+
+    if (tail)
+      emit (opcode::RETURN, dst);
+    return;
+  }
+
+  compile_call (form, dst, tail);
+}
+
+///////////////////////////////
+// the expansion runs while the head is bound to the macro, else the form
+// is compiled again - see vm_function::macro_site
+void
+compiler::compile_macro_call (const ast_node::ptr& form, const ast_node::ptr& macro, uint32_t dst, bool tail)
+{
+  ++ast_node_macro_call::cache_misses;
+  const uint32_t site = add_site (form, macro);
+  emit (opcode::MACRO_GUARD, dst, site);
+
+  // the expansion takes the place of the call, a tail position of a loop
+  // body included
+  compile_form (expand (form, macro), dst, tail);
+  m_function->macro_sites[site].resume = tail ? emit (opcode::RETURN, dst) : here ();
+}
+
+///////////////////////////////
+// def! binds in the innermost block, at the top level in the environment
+void
+compiler::compile_def (const ast_node_list* root_list, uint32_t dst, bool tail, bool is_macro)
+{
+  if (root_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  auto key = (*root_list)[1];
+  const auto id = key->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
+
+  if (!m_parent && m_locals.empty ())
+  {
+    compile ((*root_list)[2], dst, false);
+    add_constant (key);
+    emit (is_macro ? opcode::SET_MACRO : opcode::SET_GLOBAL, dst, id);
+  }
+  else
+  {
+    int local = find_local (id, true);
+    if (local < static_cast<int> (m_block))
+    {
+      declare (id, alloc_register (), false);
+      local = static_cast<int> (m_locals.size () - 1);
+    }
+
+    const uint32_t reg = m_locals[local].reg;
+    compile ((*root_list)[2], dst, false);
+    emit (is_macro ? opcode::MAKE_MACRO : opcode::MOVE, reg, dst);
+    m_locals[local].assigned = true;
+  }
+
+  if (tail)
+    emit (opcode::RETURN, dst);
+}
+
+///////////////////////////////
+void
+compiler::compile_let (const ast_node_list* root_list, uint32_t dst, bool tail)
+{
+  if (root_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  const auto root_list_arg_1 = (*root_list)[1];
+  auto let_bindings = root_list_arg_1->as_or_zero<ast_node_container_base> ();
+  if (!let_bindings)
+    raise<mal_exception_eval_invalid_arg> (root_list_arg_1->to_string ());
+
+  if (let_bindings->size () % 2 != 0)
+    raise<mal_exception_eval_invalid_arg> (let_bindings->to_string ());
+
+  const size_t outer_block = m_block;
+  const size_t block = m_locals.size ();
+  const uint32_t first_register = m_free;
+  m_block = block;
+
+  // all names first - a closure made by an init sees the later ones
+  for (size_t i = 0, e = let_bindings->size (); i < e; i += 2)
+  {
+    const auto key = (*let_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
+    declare (key, alloc_register (), false);
+  }
+
+  for (size_t i = 0, e = let_bindings->size (); i < e; i += 2)
+  {
+    compile ((*let_bindings)[i + 1], m_locals[block + i / 2].reg, false);
+    m_locals[block + i / 2].assigned = true;
+  }
+
+  compile_tail ((*root_list)[2], dst, tail);
+
+  end_block (block, first_register, tail);
+  m_block = outer_block;
+}
+
+///////////////////////////////
+// the names live in registers of their own, a recur moves the new values
+// there and jumps back to the body - no frame, no call
+void
+compiler::compile_loop (const ast_node_list* root_list, uint32_t dst, bool tail)
+{
+  if (root_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  const auto root_list_arg_1 = (*root_list)[1];
+  auto loop_bindings = root_list_arg_1->as_or_zero<ast_node_container_base> ();
+  if (!loop_bindings)
+    raise<mal_exception_eval_invalid_arg> (root_list_arg_1->to_string ());
+
+  if (loop_bindings->size () % 2 != 0)
+    raise<mal_exception_eval_invalid_arg> (loop_bindings->to_string ());
+
+  const size_t outer_block = m_block;
+  const size_t block = m_locals.size ();
+  const uint32_t first_register = m_free;
+  m_block = block;
+
+  // as let*, one register per binding in order
+  for (size_t i = 0, e = loop_bindings->size (); i < e; i += 2)
+  {
+    const auto key = (*loop_bindings)[i]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
+    declare (key, alloc_register (), false);
+  }
+
+  for (size_t i = 0, e = loop_bindings->size (); i < e; i += 2)
+  {
+    compile ((*loop_bindings)[i + 1], m_locals[block + i / 2].reg, false);
+    m_locals[block + i / 2].assigned = true;
+  }
+
+  const loop_target target {first_register, static_cast<uint32_t> (loop_bindings->size () / 2), here ()};
+  const loop_target* outer_recur = m_recur;
+  m_recur = &target;
+  compile_tail ((*root_list)[2], dst, tail);
+  m_recur = outer_recur;
+
+  end_block (block, first_register, tail);
+  m_block = outer_block;
+}
+
+///////////////////////////////
+void
+compiler::compile_recur (const ast_node_list* root_list)
+{
+  if (!m_recur)
+    raise<mal_exception_eval_invalid_arg> ("recur outside a tail position of loop: " + root_list->to_string ());
+
+  // the arguments are compiled outside of it
+  const loop_target target = *m_recur;
+  if (root_list->size () - 1 != target.count)
+    raise<mal_exception_eval_invalid_arg> ("recur expects " + std::to_string (target.count) + " arguments: " + root_list->to_string ());
+
+  // all values first - they see the names as the iteration bound them
+  const uint32_t first_register = m_free;
+  for (size_t i = 1, e = root_list->size (); i < e; ++i)
+    compile ((*root_list)[i], alloc_register (), false);
+
+  // a closure of the iteration keeps the values it has seen
+  emit (opcode::CLOSE_UPVALS, target.first_register);
+  for (uint32_t i = 0; i < target.count; ++i)
+    emit (opcode::MOVE, target.first_register + i, first_register + i);
+  emit (opcode::JUMP, 0, target.start);
+
+  free_registers (first_register);
+}
+
+///////////////////////////////
+void
+compiler::compile_do (const ast_node_list* root_list, uint32_t dst, bool tail)
+{
+  const size_t list_size = root_list->size ();
+  if (list_size < 2)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  for (size_t i = 1; i < list_size - 1; ++i)
+    compile ((*root_list)[i], dst, false);
+
+  compile_tail ((*root_list)[list_size - 1], dst, tail);
+}
+
+///////////////////////////////
+void
+compiler::compile_if (const ast_node_list* root_list, uint32_t dst, bool tail)
+{
+  const size_t list_size = root_list->size ();
+  if (list_size < 3 || list_size > 4)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  compile ((*root_list)[1], dst, false);
+  const uint32_t jump_else = emit (opcode::JUMP_IF_FALSE, dst);
+
+  compile_tail ((*root_list)[2], dst, tail);
+  const uint32_t jump_end = tail ? 0 : emit (opcode::JUMP);
+
+  m_function->code[jump_else].b = here ();
+  if (list_size == 4)
+    compile_tail ((*root_list)[3], dst, tail);
+  else
+  {
+    emit (opcode::LOAD_CONST, dst, add_constant (ast_node::nil_node));
+    if (tail)
+      emit (opcode::RETURN, dst);
+  }
+
+  if (!tail)
+    m_function->code[jump_end].b = here ();
+}
+
+///////////////////////////////
+void
+compiler::compile_fn (const ast_node_list* root_list, uint32_t dst, bool tail)
+{
+  if (ast_node_callable_lambda::is_multi_arity (*root_list))
+    return compile_multi_fn (root_list, dst, tail);
+
+  if (root_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  auto&& bindsNode = (*root_list)[1];
+  auto&& astNode = (*root_list)[2];
+
+  compiler nested (this, m_env);
+  nested.compile_params (*bindsNode->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ());
+  nested.m_function->binds = bindsNode;
+  nested.m_function->body = astNode;
+  nested.compile (astNode, nested.alloc_register (), true);
+
+  m_function->functions.push_back (nested.function ());
+  emit (opcode::CLOSURE, dst, static_cast<uint32_t> (m_function->functions.size () - 1));
+
+  if (tail)
+    emit (opcode::RETURN, dst);
+}
+
+///////////////////////////////
+// (fn* (params body) ..) - one function, the code of the arities one
+// after the other. They share the upvalues
+void
+compiler::compile_multi_fn (const ast_node_list* root_list, uint32_t dst, bool tail)
+{
+  compiler nested (this, m_env);
+  auto clauses = mal::make_list ();
+  for (size_t i = 1, e = root_list->size (); i < e; ++i)
+  {
+    auto&& clauseNode = (*root_list)[i];
+    auto clause = clauseNode->as_or_throw<ast_node_list, mal_exception_eval_not_list> ();
+    if (clause->size () != 2)
+      raise<mal_exception_eval_invalid_arg> (clause->to_string ());
+
+    // the locals of the arity before are gone, its code returned
+    nested.m_locals.clear ();
+    nested.m_free = 0;
+    nested.m_function->param_count = 0;
+    nested.m_function->variadic = false;
+
+    const uint32_t entry = nested.here ();
+    nested.compile_params (*(*clause)[0]->as_or_throw<ast_node_container_base, mal_exception_eval_not_list> ());
+    nested.m_function->dispatch.add (nested.m_function->param_count, nested.m_function->variadic);
+    nested.m_function->arities.push_back ({entry, nested.m_function->param_count, nested.m_function->variadic});
+    nested.compile ((*clause)[1], nested.alloc_register (), true);
+
+    clauses->add_child (clauseNode);
+  }
+
+  nested.m_function->binds = mal::make_list ();
+  nested.m_function->body = clauses;
+
+  m_function->functions.push_back (nested.function ());
+  emit (opcode::CLOSURE, dst, static_cast<uint32_t> (m_function->functions.size () - 1));
+
+  if (tail)
+    emit (opcode::RETURN, dst);
+}
+
+///////////////////////////////
+void
+compiler::compile_quasiquote (const ast_node::ptr& node, uint32_t dst)
+{
+  auto is_pair = [] (const ast_node::ptr& p) -> bool
+  {
+    auto p_list = p->as_or_zero<ast_node_container_base> ();
+    return p_list ? p_list->size () != 0 : false;
+  };
+
+  if (!is_pair (node))
+  {
+    emit (opcode::LOAD_CONST, dst, add_constant (node));
+    return;
+  }
+
+  // it's non-empy list
+  auto nodeList = node->as<ast_node_container_base> ();
+  const auto nodeListSize = nodeList->size ();
+  auto nodeListFirstSym = (*nodeList)[0]->as_or_zero<ast_node_symbol> ();
+
+  if (nodeListFirstSym && nodeListFirstSym->id () == SYMBOL_UNQUOTE)
+  {
+    if (nodeListSize != 2)
+      raise<mal_exception_eval_invalid_arg> (nodeList->to_string ());
+    compile ((*nodeList)[1], dst, false);
+    return;
+  }
+
+  const uint32_t saved = m_free;
+  const uint32_t first = m_free;
+  for (size_t i = 0; i < nodeListSize; ++i)
+    alloc_register ();
+
+  auto splices = mal::make_list ();
+  for (size_t i = 0; i < nodeListSize; ++i)
+  {
+    auto && v = (*nodeList) [i];
+    const uint32_t reg = first + static_cast<uint32_t> (i);
+
+    // splice-unquote
+    if (is_pair (v))
+    {
+      auto childNodeList = v->as<ast_node_container_base> ();
+      auto childSymCom = (*childNodeList)[0]->as_or_zero<ast_node_symbol> ();
+      if (childSymCom && childSymCom->id () == SYMBOL_SPLICE_UNQUOTE)
+      {
+        if (childNodeList->size () != 2)
+          raise<mal_exception_eval_invalid_arg> (childNodeList->to_string ());
+
+        compile ((*childNodeList)[1], reg, false);
+        splices->add_child (ast_node::true_node);
+        continue;
+      }
+    }
+
+    compile_quasiquote (v, reg);
+    splices->add_child (ast_node::false_node);
+  }
+
+  emit (opcode::QUASIQUOTE, dst, first, add_constant (splices));
+  free_registers (saved);
+}
+
+///////////////////////////////
+// the body is not in a tail position - the handler is active until it
+// ends
+void
+compiler::compile_try (const ast_node_list* root_list, uint32_t dst, bool tail)
+{
+  if (root_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  auto catch_list = (*root_list)[2]->as_or_throw<ast_node_list, mal_exception_eval_invalid_arg> ();
+  if (catch_list->size () != 3)
+    raise<mal_exception_eval_invalid_arg> (root_list->to_string ());
+
+  if ((*catch_list)[0]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id () != SYMBOL_CATCH)
+    raise<mal_exception_eval_invalid_arg> (catch_list->to_string ());
+
+  const auto bind_ex_symbol = (*catch_list)[1]->as_or_throw<ast_node_symbol, mal_exception_eval_invalid_arg> ()->id ();
+
+  const uint32_t exception = alloc_register ();
+  const uint32_t try_start = emit (opcode::TRY, exception);
+  compile ((*root_list)[1], dst, false);
+  emit (opcode::END_TRY);
+  const uint32_t jump_end = emit (opcode::JUMP);
+
+  // the catch* block
+  m_function->code[try_start].b = here ();
+
+  const size_t outer_block = m_block;
+  const size_t block = m_locals.size ();
+  m_block = block;
+  declare (bind_ex_symbol, exception, true);
+  compile ((*catch_list)[2], dst, false);
+  end_block (block, exception, false);
+  m_block = outer_block;
+
+  m_function->code[jump_end].b = here ();
+  if (tail)
+    emit (opcode::RETURN, dst);
+}
+
+///////////////////////////////
+// a call folded by the compiler loads the value while every head it
+// relies on is bound to the same builtin, otherwise it runs
+void
+compiler::compile_call (const ast_node::ptr& form, uint32_t dst, bool tail)
+{
+  // not as_or_throw - we know the type
+  auto root_list = form->as<ast_node_list> ();
+  std::vector<fold_guard> guards;
+  ast_node::ptr value;
+  if (!fold_call (root_list, value, guards))
+    return compile_apply (form, dst, tail);
+
+  const uint32_t saved = m_free;
+  const uint32_t head = alloc_register ();
+  std::vector<uint32_t> jumps_changed;
+  for (auto&& g : guards)
+  {
+    compile_symbol (g.symbol, head);
+    jumps_changed.push_back (emit (opcode::JUMP_IF_NOT_CONST, head, 0, add_constant (g.builtin)));
+  }
+  free_registers (saved);
+
+  emit (opcode::LOAD_CONST, dst, add_constant (value));
+  const uint32_t jump_end = tail ? emit (opcode::RETURN, dst) : emit (opcode::JUMP);
+
+  for (auto jump : jumps_changed)
+    m_function->code[jump].b = here ();
+  compile_apply (form, dst, tail);
+
+  if (!tail)
+    m_function->code[jump_end].b = here ();
+}
+
+///////////////////////////////
+// the callee and the arguments go to consecutive registers. A global head
+// bound to a macro by the time the call runs (e.g. defmacro! after the
+// fn* of the call) makes it a macro call, see GET_CALLEE
+void
+compiler::compile_apply (const ast_node::ptr& form, uint32_t dst, bool tail)
+{
+  // not as_or_throw - we know the type
+  auto root_list = form->as<ast_node_list> ();
+  const uint32_t saved = m_free;
+  const uint32_t base = (dst + 1 == m_free) ? dst : alloc_register ();
+
+  const uint32_t argc = static_cast<uint32_t> (root_list->size () - 1);
+  for (uint32_t i = 0; i < argc; ++i)
+    alloc_register ();
+
+  auto head = (*root_list)[0];
+  auto head_symbol = head->as_or_zero<ast_node_symbol> ();
+  int site = -1;
+  if (head_symbol && !is_local (head_symbol->id ()))
+  {
+    site = static_cast<int> (add_site (form, nullptr));
+    m_function->globals.push_back ({head, nullptr, nullptr});
+    m_function->macro_sites[site].global = static_cast<uint32_t> (m_function->globals.size () - 1);
+    emit (opcode::GET_CALLEE, base, head_symbol->id (), static_cast<uint32_t> (site));
+  }
+  else
+    compile (head, base, false);
+
+  for (uint32_t i = 1; i <= argc; ++i)
+    compile ((*root_list)[i], base + i, false);
+
+  // (+ a b) and the like, while the name is bound to the builtin
+  ast_node::ptr builtin = argc == 2 ? inline_builtin_of ((*root_list)[0]) : nullptr;
+  if (builtin)
+  {
+    m_function->binary_sites.push_back ({builtin, {}});
+    emit (tail ? opcode::TAIL_CALL_BINARY : opcode::CALL_BINARY, base, argc, static_cast<uint32_t> (m_function->binary_sites.size () - 1));
+  }
+  else
+    emit (tail ? opcode::TAIL_CALL : opcode::CALL, base, argc);
+
+  if (site >= 0)
+    m_function->macro_sites[site].resume = tail ? emit (opcode::RETURN, base) : here ();
+  if (!tail && base != dst)
+    emit (opcode::MOVE, dst, base);
+
+  free_registers (saved);
+}
+
+///////////////////////////////
+ast_node::ptr
+compiler::inline_builtin_of (const ast_node::ptr& head) const
+{
+  auto symbol = head->as_or_zero<ast_node_symbol> ();
+  if (!symbol || is_local (symbol->id ()))
+    return nullptr;
+
+  ast_node::ptr value = m_env->get (symbol->id ());
+  if (!value || value->type () != node_type_enum::CALLABLE_BUILTIN || value->as<ast_node_callable_builtin_base> ()->inline_op () == binary_op::NONE)
+    return nullptr;
+
+  return value;
+}
+
+///////////////////////////////
+bool
+compiler::fold (const ast_node::ptr& form, ast_node::ptr& value, std::vector<fold_guard>& guards) const
+{
+  if (is_constant_literal (form))
+  {
+    value = form;
+    return true;
+  }
+
+  auto root_list = form->as_or_zero<ast_node_list> ();
+  if (!root_list || root_list->empty ())
+    return false;
+
+  auto symbol = (*root_list)[0]->as_or_zero<ast_node_symbol> ();
+  if (symbol && symbol->id () == SYMBOL_QUOTE && root_list->size () == 2)
+  {
+    value = (*root_list)[1];
+    return true;
+  }
+
+  return fold_call (root_list, value, guards);
+}
+
+///////////////////////////////
+bool
+compiler::fold_call (const ast_node_list* root_list, ast_node::ptr& value, std::vector<fold_guard>& guards) const
+{
+  auto head = (*root_list)[0];
+  auto symbol = head->as_or_zero<ast_node_symbol> ();
+  if (!symbol || is_local (symbol->id ()))
+    return false;
+
+  ast_node::ptr builtin = m_env->get (symbol->id ());
+  auto pure = as_pure_builtin (builtin);
+  if (!pure)
+    return false;
+
+  const size_t argc = root_list->size () - 1;
+  std::vector<fold_guard> folded_guards {{head, builtin}};
+  argument_frame args (argc);
+  for (size_t i = 0; i < argc; ++i)
+  {
+    if (!fold ((*root_list)[i + 1], args[i], folded_guards))
+      return false;
+  }
+
+  if (!fold_pure_call (*pure, args, value))
+    return false;
+
+  guards.insert (guards.end (), folded_guards.begin (), folded_guards.end ());
+  return true;
+}
+
+///////////////////////////////
+// a recur in the form is not in a tail position of a loop any more - its
+// target is in the code of the site
+vm_function::const_ptr
+compile_site (const vm_function::macro_site& site, const vm_function& function, const environment::ptr& env)
+{
+  compiler scope (site, function, env);
+  compiler nested (&scope, env);
+  nested.function ()->binds = mal::make_list ();
+  nested.function ()->body = site.form;
+  nested.compile (site.form, nested.alloc_register (), true);
+  return nested.function ();
+}
+
+///////////////////////////////
+sp<const vm_closure>
+compile_top_level (ast_node::ptr& form, const environment::ptr& env)
+{
+  while (auto macro = macro_of (form, env))
+  {
+    ++ast_node_macro_call::cache_misses;
+    form = expand (form, macro);
+  }
+
+  auto root_list = form->as_or_zero<ast_node_list> ();
+  if (root_list && root_list->size () > 1)
+  {
+    auto first_symbol = (*root_list)[0]->as_or_zero<ast_node_symbol> ();
+    if (first_symbol && first_symbol->id () == SYMBOL_DO)
+      return nullptr;
+  }
+
+  compiler top_level (nullptr, env);
+  top_level.function ()->binds = mal::make_list ();
+  top_level.function ()->body = form;
+  top_level.compile (form, top_level.alloc_register (), true);
+
+  return make_sp<vm_closure> (top_level.function (), env);
+}
+
+///////////////////////////////
+tco
+vm_closure::call_tco (const call_arguments& args) const
+{
+  return machine::instance ().defer (*this, args);
+}
+
+} // end of anonymous namespace
+
+///////////////////////////////
+void
+vm::set_max_depth (size_t depth)
+{
+  machine::instance ().set_max_depth (depth);
+}
+
+///////////////////////////////
+ast_node::ptr
+vm::eval (ast_node::ptr form, const environment::ptr& env)
+{
+  if (form->type () == node_type_enum::VM_CALL)
+    return machine::instance ().call_pending ();
+
+  // a do a macro expands to is split too
+  auto closure = compile_top_level (form, env);
+  if (closure)
+    return machine::instance ().call (*closure, call_arguments (nullptr, 0));
+
+  auto root_list = form->as<ast_node_list> ();
+  ast_node::ptr retVal;
+  for (size_t i = 1, e = root_list->size (); i < e; ++i)
+  {
+    retVal = eval ((*root_list)[i], env);
+    if (ast_node_raised::is (retVal))
+      break;
+  }
+
+  return retVal;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "ast.h"
+#include "environment.h"
+
+///////////////////////////////
+// register based bytecode virtual machine - the alternative evaluator of
+// stepA (stepA_mal --vm). A form is compiled into functions whose
+// instructions work on registers, the registers of all active calls live
+// on one stack owned by the machine. Closures capture locals through
+// upvalues, globals stay in the environment.
+namespace vm
+{
+  // compiles the form and runs it. Forms of a top level do are compiled
+  // one by one, so a macro defined by one of them expands in the next
+  ast_node::ptr eval (ast_node::ptr form, const environment::ptr& env);
+
+  // a call deeper than this raises a mal error. The frames live on the
+  // heap, so the limit is not bound by the C++ stack
+  void set_max_depth (size_t depth);
+}